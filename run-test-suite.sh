@@ -1,6 +1,6 @@
 #!/bin/bash
 
-if [ ! -x libpng-dumper -o ! -x sfpng-dumper ]; then
+if [ ! -x libpng-dumper -o ! -x sfpng-dumper -o ! -x sfpng-dumper-nosimd ]; then
     echo 'run "make check" to build and run the test suite.'
     exit 1
 fi
@@ -25,22 +25,52 @@ for f in $inputs; do
     echo -n "$f: "
     $valgrind ./libpng-dumper $f 2>&1 > $libpng_output
     libpng_exit=$?
-    $valgrind ./sfpng-dumper $f 2>&1 > $sfpng_output
-    sfpng_exit=$?
 
-    if [ $libpng_exit == 1 -a $sfpng_exit == 1 ]; then
-        echo 'PASS [both invalid]'
-        continue
-    fi
+    # Check sfpng both with zlib and with its own inflater, with rows
+    # passed one at a time and in batches, and with threads (using small
+    # blocks, so that the test images span several).  Also check that
+    # the encoder round trips each image, with its usual settings, with
+    # the fast ones, and with threads (in small bands again), that
+    # scaled-down output matches the full image box-filtered, with and
+    # without threads, and that the plain C code the SIMD kernels stand
+    # in for still decodes and converts the same.
+    for run in "sfpng-dumper" "sfpng-dumper --builtin-inflate" \
+               "sfpng-dumper --batch-rows 5" \
+               "sfpng-dumper --threads 3 --row-buffer-rows 3" \
+               "sfpng-dumper --reencode default" \
+               "sfpng-dumper --reencode min-entropy --level 1 --strategy rle" \
+               "sfpng-dumper --reencode paeth --threads 2 --band-rows 3" \
+               "sfpng-dumper --scale 3" \
+               "sfpng-dumper --scale 2 --threads 3 --row-buffer-rows 3" \
+               "sfpng-dumper-nosimd" "sfpng-dumper-nosimd --scale 3"; do
+        $valgrind ./$run $f 2>&1 > $sfpng_output
+        sfpng_exit=$?
 
-    if diff -q $libpng_output $sfpng_output; then
-        echo 'PASS'
-    else
-        exit=$?
-        echo 'FAIL'
-        diff -U5 $libpng_output $sfpng_output
-        exit 1
-    fi
+        if [ $libpng_exit == 1 -a $sfpng_exit == 1 ]; then
+            # Rows before bad data still come out, so where both know
+            # how many did, they should agree.
+            libpng_rows=$(grep '^rows before the error' $libpng_output)
+            sfpng_rows=$(grep '^rows before the error' $sfpng_output)
+            if [ -n "$libpng_rows" -a -n "$sfpng_rows" -a \
+                 "$libpng_rows" != "$sfpng_rows" ]; then
+                echo "FAIL $run"
+                echo "libpng: $libpng_rows"
+                echo "sfpng: $sfpng_rows"
+                exit 1
+            fi
+            result='PASS [both invalid]'
+            continue
+        fi
+
+        if diff -q $libpng_output $sfpng_output > /dev/null; then
+            result='PASS'
+        else
+            echo "FAIL $run"
+            diff -U5 $libpng_output $sfpng_output
+            exit 1
+        fi
+    done
+    echo "$result"
 done
 
 exit 0
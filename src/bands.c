@@ -0,0 +1,578 @@
+#include "sfpng.h"
+
+#include <arpa/inet.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "bands.h"
+#include "crc.h"
+#include "encoder.h"
+
+/* About how many bytes of scanlines go in each band when the band size
+   isn't set.  Each band ends in a sync flush, which costs a few bytes,
+   and its worker re-filters up to a window's worth of the band before,
+   so bands much smaller than this lose out. */
+#define BAND_BYTES (256 << 10)
+
+/* The size of the DEFLATE window, and so of the most of the band before
+   that is any use as a dictionary. */
+#define WINDOW_BYTES (32 << 10)
+
+/* Room in each band's output buffer around the compressed data: before
+   it for the IDAT chunk's header and the zlib header, and after it for
+   the zlib trailer and the chunk's CRC. */
+#define OUT_BEFORE (8 + 2)
+#define OUT_AFTER (4 + 4)
+
+/* A band of rows and what became of it.  The buffers belong to the slot
+   of the ring the band is in. */
+typedef struct {
+  /* Set by the calling thread: rows [first_row, first_row + rows) are in
+     |raw|, after the |context| rows before them, which the worker needs
+     for the first row's filter and for the dictionary. */
+  int first_row;
+  int rows;
+  int context;
+  int last;
+  uint8_t* raw;
+  size_t raw_size;
+
+  /* Set by the worker that encoded it: the compressed data, starting
+     OUT_BEFORE bytes into |out|, and its CRC, and the Adler-32 and
+     length of the scanlines it came from. */
+  uint8_t* out;
+  size_t out_size;
+  size_t out_len;
+  uint32_t crc;
+  uint32_t adler;
+  size_t in_len;
+  int done;
+  sfpng_status status;
+} band;
+
+/* A worker thread, with a zlib stream of its own, and room to filter a
+   row into and to filter the rows before its band into. */
+typedef struct {
+  struct bands* bands;
+  pthread_t thread;
+  z_stream zlib;
+  int zlib_initialized;
+  uint8_t* filtered;
+  uint8_t* dict;
+  uint8_t* scratch;
+  size_t scratch_size;
+} worker;
+
+struct bands {
+  sfpng_encoder* encoder;
+
+  /* Everything below is protected by |lock|.  work_cond is signalled
+     when there may be new work for the workers (or they should stop),
+     and done_cond when a band is done. */
+  pthread_mutex_t lock;
+  pthread_cond_t work_cond;
+  pthread_cond_t done_cond;
+  worker* workers;
+  int worker_count;
+  int thread_count;
+  int stop;
+
+  /* A ring of slots for the bands in flight, each with room for
+     |band_rows| rows after |max_context| rows of context, and for the
+     band's compressed data, which is at most |out_bound| bytes.  Bands
+     are numbered from the top of the image, and band n is in slot
+     n % slot_count.  Those before |filled| have all their rows, those
+     before |taken| have been picked up by a worker, and those before
+     |written| written out.  |open| is set while band |filled| is being
+     filled. */
+  band* slots;
+  int slot_count;
+  int band_rows;
+  int max_context;
+  size_t out_bound;
+  int filled;
+  int taken;
+  int written;
+  int open;
+
+  /* A row of zeros, for the row before the first, and the Adler-32 of
+     the scanlines of all the bands written so far. */
+  uint8_t* zeros;
+  size_t zeros_size;
+  uint32_t adler;
+};
+
+/* How many rows go in each band of the current image. */
+static int band_rows(const sfpng_encoder* encoder) {
+  int rows = encoder->band_rows;
+  if (rows <= 0) {
+    rows = BAND_BYTES / (1 + encoder->stride);
+    if (rows < 1)
+      rows = 1;
+  }
+  return rows < encoder->height ? rows : encoder->height;
+}
+
+int bands_wanted(const sfpng_encoder* encoder) {
+  /* Each band goes out as one chunk, whose length has to fit in an int
+     even if the data doesn't compress at all. */
+  return encoder->threads > 0 && !encoder->interlaced &&
+    (uint64_t)band_rows(encoder) * (1 + encoder->stride) <= INT_MAX / 2;
+}
+
+/* Filter and compress |bd|. */
+static sfpng_status encode_band(bands* b, worker* w, band* bd) {
+  const sfpng_encoder* encoder = b->encoder;
+  const int len = encoder->stride;
+  const int scanline_size = 1 + len;
+  z_stream* zlib = &w->zlib;
+  const uint8_t* prev = b->zeros;
+  const uint8_t* row = bd->raw;
+  int i;
+
+  if (deflateReset(zlib) != Z_OK)
+    return SFPNG_ERROR_ZLIB_ERROR;
+
+  /* Filter the rows before the band the same way their own band's
+     worker does, and start with the end of them as the dictionary, as
+     if the stream had carried on.  Unless the context goes back to the
+     top of the image, its first row is only there to be the previous
+     row of the second. */
+  if (bd->context > 0) {
+    uint8_t* dict = w->dict;
+    i = 0;
+    if (bd->context < bd->first_row) {
+      prev = row;
+      row += len;
+      i = 1;
+    }
+    for (; i < bd->context; ++i) {
+      const uint8_t* scanline =
+        encoder_filter_row(encoder, row, prev, len, w->filtered);
+      memcpy(dict, scanline, scanline_size);
+      dict += scanline_size;
+      prev = row;
+      row += len;
+    }
+    const size_t dict_len = dict - w->dict;
+    const size_t keep = dict_len < WINDOW_BYTES ? dict_len : WINDOW_BYTES;
+    if (deflateSetDictionary(zlib, dict - keep, keep) != Z_OK)
+      return SFPNG_ERROR_ZLIB_ERROR;
+  }
+
+  /* Every band but the last ends in a sync flush, which leaves the
+     stream at a byte boundary with nothing pending, so the next band's
+     data can follow straight on; the last one finishes the stream. */
+  uLong adler = adler32(0, NULL, 0);
+  zlib->next_out = bd->out + OUT_BEFORE;
+  zlib->avail_out = b->out_bound;
+  for (i = 0; i < bd->rows; ++i) {
+    const uint8_t* scanline =
+      encoder_filter_row(encoder, row, prev, len, w->filtered);
+    adler = adler32(adler, scanline, scanline_size);
+    const int flush = i + 1 < bd->rows ? Z_NO_FLUSH :
+      bd->last ? Z_FINISH : Z_SYNC_FLUSH;
+    zlib->next_in = (uint8_t*)scanline;
+    zlib->avail_in = scanline_size;
+    const int status = deflate(zlib, flush);
+    if (flush == Z_FINISH ? status != Z_STREAM_END :
+        status != Z_OK || zlib->avail_in != 0 || zlib->avail_out == 0) {
+      /* out_bound should make running out of room impossible. */
+      return SFPNG_ERROR_ZLIB_ERROR;
+    }
+    prev = row;
+    row += len;
+  }
+
+  bd->out_len = zlib->next_out - (bd->out + OUT_BEFORE);
+  bd->crc = crc_data(bd->out + OUT_BEFORE, bd->out_len);
+  bd->adler = adler;
+  bd->in_len = (size_t)bd->rows * scanline_size;
+  return SFPNG_SUCCESS;
+}
+
+static void* worker_main(void* arg) {
+  worker* w = arg;
+  bands* b = w->bands;
+
+  pthread_mutex_lock(&b->lock);
+  while (!b->stop) {
+    if (b->taken < b->filled) {
+      band* bd = &b->slots[b->taken++ % b->slot_count];
+      pthread_mutex_unlock(&b->lock);
+      sfpng_status status = encode_band(b, w, bd);
+      pthread_mutex_lock(&b->lock);
+      bd->status = status;
+      bd->done = 1;
+      pthread_cond_broadcast(&b->done_cond);
+      continue;
+    }
+    pthread_cond_wait(&b->work_cond, &b->lock);
+  }
+  pthread_mutex_unlock(&b->lock);
+  return NULL;
+}
+
+static bands* bands_create(sfpng_encoder* encoder) {
+  bands* b = encoder_alloc(encoder, sizeof(*b));
+  int i;
+  if (!b)
+    return NULL;
+  memset(b, 0, sizeof(*b));
+  b->encoder = encoder;
+  encoder->bands = b;
+
+  b->workers = encoder_alloc(encoder, encoder->threads * sizeof(worker));
+  if (!b->workers) {
+    bands_free(encoder);
+    return NULL;
+  }
+  memset(b->workers, 0, encoder->threads * sizeof(worker));
+  b->worker_count = encoder->threads;
+  pthread_mutex_init(&b->lock, NULL);
+  pthread_cond_init(&b->work_cond, NULL);
+  pthread_cond_init(&b->done_cond, NULL);
+  b->slots = encoder_alloc(encoder, 2 * encoder->threads * sizeof(band));
+  if (!b->slots) {
+    bands_free(encoder);
+    return NULL;
+  }
+  memset(b->slots, 0, 2 * encoder->threads * sizeof(band));
+  b->slot_count = 2 * encoder->threads;
+  for (i = 0; i < b->worker_count; ++i)
+    b->workers[i].bands = b;
+  for (; b->thread_count < encoder->threads; ++b->thread_count) {
+    worker* w = &b->workers[b->thread_count];
+    if (pthread_create(&w->thread, NULL, worker_main, w) != 0) {
+      bands_free(encoder);
+      return NULL;
+    }
+  }
+  return b;
+}
+
+/* Make |*buf| hold at least |size| bytes. */
+static sfpng_status reserve(sfpng_encoder* encoder, uint8_t** buf,
+                            size_t* buf_size, size_t size) {
+  if (size <= *buf_size)
+    return SFPNG_SUCCESS;
+  encoder_free(encoder, *buf);
+  *buf_size = 0;
+  *buf = encoder_alloc(encoder, size);
+  if (!*buf)
+    return SFPNG_ERROR_ALLOC_FAILED;
+  *buf_size = size;
+  return SFPNG_SUCCESS;
+}
+
+sfpng_status bands_start(sfpng_encoder* encoder) {
+  bands* b = encoder->bands;
+  const int scanline_size = 1 + encoder->stride;
+  const int strategy = encoder_zlib_strategy(encoder->strategy);
+  sfpng_status status;
+  int i;
+
+  if (b && b->thread_count != encoder->threads) {
+    bands_free(encoder);
+    b = NULL;
+  }
+  if (!b) {
+    b = bands_create(encoder);
+    if (!b)
+      return SFPNG_ERROR_ALLOC_FAILED;
+  }
+
+  /* The context is enough rows to fill the window, plus the one before
+     them. */
+  b->band_rows = band_rows(encoder);
+  b->max_context = (WINDOW_BYTES + scanline_size - 1) / scanline_size + 1;
+
+  /* The workers' zlib streams are set up here rather than by the
+     workers, so that only the calling thread ever allocates. */
+  for (i = 0; i < b->worker_count; ++i) {
+    worker* w = &b->workers[i];
+    if (!w->zlib_initialized) {
+      encoder_use_allocator(encoder, &w->zlib);
+      if (deflateInit2(&w->zlib, encoder->level, Z_DEFLATED, -15, 8,
+                       strategy) != Z_OK) {
+        return SFPNG_ERROR_ZLIB_ERROR;
+      }
+      w->zlib_initialized = 1;
+    } else if (deflateReset(&w->zlib) != Z_OK ||
+               deflateParams(&w->zlib, encoder->level, strategy) != Z_OK) {
+      return SFPNG_ERROR_ZLIB_ERROR;
+    }
+
+    status = reserve(encoder, &w->scratch, &w->scratch_size,
+                     (size_t)scanline_size * (5 + b->max_context));
+    if (status != SFPNG_SUCCESS)
+      return status;
+    w->filtered = w->scratch;
+    w->dict = w->scratch + (size_t)scanline_size * 5;
+  }
+
+  /* A sync flush can take a few bytes more than deflateBound allows. */
+  b->out_bound = deflateBound(&b->workers[0].zlib,
+                              (uLong)b->band_rows * scanline_size) + 16;
+  const size_t raw_size =
+    (size_t)(b->max_context + b->band_rows) * encoder->stride;
+  const size_t out_size = OUT_BEFORE + b->out_bound + OUT_AFTER;
+  for (i = 0; i < b->slot_count; ++i) {
+    band* bd = &b->slots[i];
+    status = reserve(encoder, &bd->raw, &bd->raw_size, raw_size);
+    if (status != SFPNG_SUCCESS)
+      return status;
+    status = reserve(encoder, &bd->out, &bd->out_size, out_size);
+    if (status != SFPNG_SUCCESS)
+      return status;
+  }
+
+  status = reserve(encoder, &b->zeros, &b->zeros_size, encoder->stride);
+  if (status != SFPNG_SUCCESS)
+    return status;
+  memset(b->zeros, 0, encoder->stride);
+
+  pthread_mutex_lock(&b->lock);
+  b->filled = 0;
+  b->taken = 0;
+  b->written = 0;
+  pthread_mutex_unlock(&b->lock);
+  b->open = 0;
+  b->adler = adler32(0, NULL, 0);
+  return SFPNG_SUCCESS;
+}
+
+/* The zlib header deflateInit2 would have written for a 32kb window.
+   Its level field is only informational. */
+static void zlib_header(const sfpng_encoder* encoder, uint8_t* out) {
+  const int level =
+    encoder->level == Z_DEFAULT_COMPRESSION ? 6 : encoder->level;
+  int level_flags;
+  if (encoder->strategy != SFPNG_STRATEGY_DEFAULT || level < 2)
+    level_flags = 0;
+  else if (level < 6)
+    level_flags = 1;
+  else if (level == 6)
+    level_flags = 2;
+  else
+    level_flags = 3;
+  unsigned header = 0x7800 | level_flags << 6;
+  header += 31 - header % 31;
+  out[0] = header >> 8;
+  out[1] = header & 0xff;
+}
+
+/* Write the oldest band not yet written as an IDAT chunk, waiting for
+   it to be done if |wait| is set.  Sets |*written| if it was. */
+static sfpng_status write_band(bands* b, int wait, int* written) {
+  sfpng_encoder* encoder = b->encoder;
+
+  *written = 0;
+  pthread_mutex_lock(&b->lock);
+  band* bd = &b->slots[b->written % b->slot_count];
+  if (b->written == b->filled || (!bd->done && !wait)) {
+    pthread_mutex_unlock(&b->lock);
+    return SFPNG_SUCCESS;
+  }
+  while (!bd->done)
+    pthread_cond_wait(&b->done_cond, &b->lock);
+  pthread_mutex_unlock(&b->lock);
+  if (bd->status != SFPNG_SUCCESS)
+    return bd->status;
+
+  /* The chunk is the zlib header for the first band, the band's data,
+     and the zlib trailer for the last; the data's CRC is already known,
+     and the rest is combined with it. */
+  uint8_t* data = bd->out + OUT_BEFORE;
+  uint8_t* chunk = data - 8;
+  size_t len = bd->out_len;
+  uint32_t crc;
+  if (bd->first_row == 0) {
+    chunk -= 2;
+    len += 2;
+    zlib_header(encoder, data - 2);
+    crc = crc_compute("IDAT", data - 2, 2);
+  } else {
+    crc = crc_compute("IDAT", NULL, 0);
+  }
+  crc = crc_combine(crc, bd->crc, bd->out_len);
+  b->adler = adler32_combine(b->adler, bd->adler, bd->in_len);
+  if (bd->last) {
+    uint8_t* trailer = data + bd->out_len;
+    uint32_t n = htonl(b->adler);
+    memcpy(trailer, &n, 4);
+    crc = crc_combine(crc, crc_data(trailer, 4), 4);
+    len += 4;
+  }
+
+  uint32_t n = htonl(len);
+  memcpy(chunk, &n, 4);
+  memcpy(chunk + 4, "IDAT", 4);
+  n = htonl(crc);
+  memcpy(chunk + 8 + len, &n, 4);
+  encoder_write(encoder, chunk, 8 + len + 4);
+
+  pthread_mutex_lock(&b->lock);
+  ++b->written;
+  pthread_mutex_unlock(&b->lock);
+  *written = 1;
+  return SFPNG_SUCCESS;
+}
+
+/* Set up the next band to be filled, at |row|, once its slot is free. */
+static sfpng_status open_band(bands* b, int row) {
+  const sfpng_encoder* encoder = b->encoder;
+  sfpng_status status;
+  int written;
+
+  while (b->filled - b->written >= b->slot_count) {
+    status = write_band(b, 1, &written);
+    if (status != SFPNG_SUCCESS)
+      return status;
+  }
+
+  band* bd = &b->slots[b->filled % b->slot_count];
+  bd->first_row = row;
+  bd->rows = 0;
+  bd->context = row < b->max_context ? row : b->max_context;
+  bd->last = 0;
+  bd->done = 0;
+  if (bd->context) {
+    /* The context rows are the end of the band before, and of its
+       context if that's short; either way they're in its slot, which
+       is only being read. */
+    const band* prev = &b->slots[(b->filled - 1) % b->slot_count];
+    const int prev_top = prev->first_row - prev->context;
+    memcpy(bd->raw,
+           prev->raw + (size_t)(row - bd->context - prev_top) *
+           encoder->stride,
+           (size_t)bd->context * encoder->stride);
+  }
+  b->open = 1;
+  return SFPNG_SUCCESS;
+}
+
+/* Hand the band being filled to the workers. */
+static void dispatch(bands* b) {
+  pthread_mutex_lock(&b->lock);
+  ++b->filled;
+  pthread_cond_broadcast(&b->work_cond);
+  pthread_mutex_unlock(&b->lock);
+  b->open = 0;
+}
+
+sfpng_status bands_write(sfpng_encoder* encoder, const uint8_t* buf,
+                         ptrdiff_t stride, int count) {
+  bands* b = encoder->bands;
+  const int len = encoder->stride;
+  sfpng_status status;
+  int row = encoder->row;
+  int written;
+  int i;
+
+  while (count > 0) {
+    if (!b->open) {
+      status = open_band(b, row);
+      if (status != SFPNG_SUCCESS)
+        return status;
+    }
+    band* bd = &b->slots[b->filled % b->slot_count];
+    const int room = b->band_rows - bd->rows;
+    const int n = count < room ? count : room;
+    uint8_t* out = bd->raw + (size_t)(bd->context + bd->rows) * len;
+    for (i = 0; i < n; ++i)
+      memcpy(out + (size_t)i * len, buf + i * stride, len);
+    bd->rows += n;
+    row += n;
+    buf += n * stride;
+    count -= n;
+    if (bd->rows == b->band_rows || row == encoder->height) {
+      bd->last = row == encoder->height;
+      dispatch(b);
+    }
+  }
+
+  /* Write out whatever is done already, so the file comes out as it's
+     produced rather than all at the end. */
+  do {
+    status = write_band(b, 0, &written);
+    if (status != SFPNG_SUCCESS)
+      return status;
+  } while (written);
+  return SFPNG_SUCCESS;
+}
+
+sfpng_status bands_finish(sfpng_encoder* encoder) {
+  bands* b = encoder->bands;
+  sfpng_status status;
+  int written;
+
+  do {
+    status = write_band(b, 1, &written);
+    if (status != SFPNG_SUCCESS)
+      return status;
+  } while (written);
+  return SFPNG_SUCCESS;
+}
+
+void bands_abort(sfpng_encoder* encoder) {
+  bands* b = encoder->bands;
+  int i;
+  if (!b)
+    return;
+
+  /* Drop the bands no worker has picked up, and wait for the rest. */
+  pthread_mutex_lock(&b->lock);
+  b->filled = b->taken;
+  for (i = b->written; i < b->taken; ++i) {
+    while (!b->slots[i % b->slot_count].done)
+      pthread_cond_wait(&b->done_cond, &b->lock);
+  }
+  b->filled = 0;
+  b->taken = 0;
+  b->written = 0;
+  pthread_mutex_unlock(&b->lock);
+  b->open = 0;
+}
+
+void bands_free(sfpng_encoder* encoder) {
+  bands* b = encoder->bands;
+  int i;
+  if (!b)
+    return;
+
+  if (b->thread_count > 0) {
+    pthread_mutex_lock(&b->lock);
+    b->stop = 1;
+    pthread_cond_broadcast(&b->work_cond);
+    pthread_mutex_unlock(&b->lock);
+    for (i = 0; i < b->thread_count; ++i)
+      pthread_join(b->workers[i].thread, NULL);
+  }
+  if (b->workers) {
+    pthread_mutex_destroy(&b->lock);
+    pthread_cond_destroy(&b->work_cond);
+    pthread_cond_destroy(&b->done_cond);
+    for (i = 0; i < b->worker_count; ++i) {
+      worker* w = &b->workers[i];
+      if (w->zlib_initialized) {
+        int status = deflateEnd(&w->zlib);
+        /* We don't care about a bad status at this point. */
+      }
+      encoder_free(encoder, w->scratch);
+    }
+  }
+  if (b->slots) {
+    for (i = 0; i < b->slot_count; ++i) {
+      encoder_free(encoder, b->slots[i].raw);
+      encoder_free(encoder, b->slots[i].out);
+    }
+  }
+  encoder_free(encoder, b->workers);
+  encoder_free(encoder, b->slots);
+  encoder_free(encoder, b->zeros);
+  encoder_free(encoder, b);
+  encoder->bands = NULL;
+}
@@ -0,0 +1,37 @@
+/* Parallel encoding of non-interlaced images, as set up by
+   sfpng_encoder_set_threads, in the manner of pigz.
+
+   The image is cut into bands of rows, and worker threads filter and
+   compress each band on its own into raw DEFLATE data ending in a sync
+   flush, so that the bands' data put end to end is one valid stream.
+   Each worker primes its compressor with what the end of the band
+   before compresses to (re-filtering those rows itself), so little is
+   lost to the cuts.  The workers also take the Adler-32 of their
+   band's scanlines and the CRC of its compressed data, and the calling
+   thread writes each band out in order as an IDAT chunk, combining
+   those with the zlib header and trailer. */
+typedef struct bands bands;
+
+/* Whether the image that's starting should be encoded in bands. */
+int bands_wanted(const sfpng_encoder* encoder);
+
+/* Get ready to encode the current image, starting the worker threads
+   and allocating the buffers if needed. */
+sfpng_status bands_start(sfpng_encoder* encoder) SFPNG_WARN_UNUSED_RESULT;
+
+/* Take |count| rows, as sfpng_encoder_write_rows, handing each band to
+   the workers once it's full and writing out any that are done. */
+sfpng_status bands_write(sfpng_encoder* encoder, const uint8_t* buf,
+                         ptrdiff_t stride, int count)
+  SFPNG_WARN_UNUSED_RESULT;
+
+/* Hand out the last band once the last row is in, and write out all
+   the image data. */
+sfpng_status bands_finish(sfpng_encoder* encoder) SFPNG_WARN_UNUSED_RESULT;
+
+/* Wait for the workers to finish with the current image and drop its
+   bands.  Does nothing if there are no workers. */
+void bands_abort(sfpng_encoder* encoder);
+
+/* Stop the worker threads and free everything, if any. */
+void bands_free(sfpng_encoder* encoder);
@@ -1,9 +1,27 @@
+#include <stddef.h>
 #include <stdint.h>
 
-typedef uint32_t crc_table[256];
-
-void crc_init_table(crc_table table);
+/* The CRC tables are precomputed (see crc_table.h) and shared by all
+   decoders, so there is nothing to initialize. */
 
 /* |type| is the 4-byte chunk type used in the CRC. */
-uint32_t crc_compute(const crc_table table, const void* type,
-                     const void* buf, int len);
+uint32_t crc_compute(const void* type, const void* buf, int len);
+
+/* The same computation as crc_compute, for data that arrives in pieces:
+     crc_end(crc_update(crc_begin(type), buf, len))
+   equals crc_compute(type, buf, len), and crc_update may be called any
+   number of times. */
+uint32_t crc_begin(const void* type);
+uint32_t crc_update(uint32_t crc, const void* buf, int len);
+uint32_t crc_end(uint32_t crc);
+
+/* The CRC of |len| bytes with no chunk type in front, for crc_combine. */
+uint32_t crc_data(const void* buf, int len);
+
+/* The CRC of two pieces of data one after the other, given the CRC of
+   each as crc_compute or crc_data returns them and the length of the
+   second, so that pieces can be checksummed separately (on different
+   threads, say) and joined up later:
+   crc_combine(crc_compute(type, a, n), crc_data(b, m), m) ==
+   crc_compute(type, ab, n + m). */
+uint32_t crc_combine(uint32_t crc1, uint32_t crc2, size_t len2);
@@ -1,12 +1,12 @@
 #include <zlib.h>  /* z_stream */
 
-#include "crc.h"  /* crc_table */
-
 typedef enum {
   STATE_SIGNATURE,
   STATE_CHUNK_HEADER,
   STATE_CHUNK_DATA,
   STATE_CHUNK_CRC,
+  /* A probe reached the image data; the rest of the input is ignored. */
+  STATE_PROBED,
 } decode_state;
 
 /* 5.6 Chunk ordering */
@@ -18,8 +18,10 @@ typedef enum {
   CHUNK_STATE_IEND,
 } decode_chunk_state;
 
+/* Stored inline, with room for the largest allowed palette, so that a
+   reused decoder doesn't allocate for it. */
 typedef struct {
-  uint8_t* bytes;
+  uint8_t bytes[3 * 256];
   int entries;
 } palette;
 
@@ -30,17 +32,44 @@ typedef struct {
   int r, g, b, value;
 } trans;
 
-struct _sfpng_decoder {
-  crc_table crc_table;
+/* Converts |width| pixels of raw row data to 8-bit RGBA. */
+typedef void (*transform_func)(const sfpng_decoder* decoder,
+                               const uint8_t* in, uint8_t* out, int width);
 
+struct _sfpng_decoder {
   /* User-specified context pointer. */
   void* context;
 
+  /* Allocator for everything the decoder allocates, including zlib's
+     state. */
+  sfpng_alloc_func alloc_func;
+  sfpng_free_func free_func;
+  void* alloc_opaque;
+
   sfpng_info_func info_func;
   sfpng_row_func row_func;
+  sfpng_rows_func rows_func;
+  int batch_rows;
+  sfpng_pass_row_func pass_row_func;
   sfpng_text_func text_func;
   sfpng_unknown_chunk_func unknown_chunk_func;
 
+  /* The SFPNG_VERIFY_* checksums to check. */
+  int verify;
+
+  /* Set by sfpng_decoder_set_probe: stop at the first IDAT. */
+  int probe;
+
+  /* The limits from sfpng_decoder_set_max_size and friends, zero for
+     none, and the metadata inflated so far for the current image. */
+  uint32_t max_width;
+  uint32_t max_height;
+  uint64_t max_pixels;
+  uint32_t max_chunk_size;
+  size_t max_metadata_size;
+  uint64_t max_decoded_size;
+  size_t metadata_size;
+
   /* Header decoding state. */
   decode_state state;
   uint8_t in_buf[8];
@@ -52,6 +81,21 @@ struct _sfpng_decoder {
   char chunk_type[4];
   int chunk_ofs;
   uint8_t* chunk_buf;
+  int chunk_buf_size;
+  /* Set if the chunk's data is passed along as it arrives rather than
+     collected in chunk_buf; its CRC is then accumulated in chunk_crc. */
+  int chunk_streamed;
+  uint32_t chunk_crc;
+  /* Set if the chunk is streamed only to be dropped, which is done for
+     ancillary chunks nothing would look at. */
+  int chunk_skipped;
+
+  /* Chunk types the caller asked to skip, as PNG_TAG values, and whether
+     to still check the CRCs of skipped chunks. */
+  uint32_t* skip_types;
+  int skip_types_count;
+  int skip_types_size;
+  int skip_ignore_crc;
 
   /* Image properties, read from IHDR chunk. */
   uint32_t width;
@@ -63,8 +107,10 @@ struct _sfpng_decoder {
   /* Derived image properties, computed from above. */
   int stride;
   int bytes_per_pixel;
+  int pixel_bits;
 
   /* Palette, from PLTE. */
+  int has_palette;
   palette palette;
 
   /* Gamma, from gAMA. */
@@ -74,9 +120,114 @@ struct _sfpng_decoder {
   int has_trans;
   trans trans;
 
-  /* IDAT decoding state. */
+  /* Row converter for sfpng_decoder_transform, chosen once the image
+     format is known, and for paletted images the RGBA value of each
+     index (as bytes in memory order). */
+  transform_func transform_func;
+  uint32_t palette_rgba[256];
+
+  /* Output buffer set by sfpng_decoder_set_output, if any. */
+  uint8_t* output_buf;
+  ptrdiff_t output_stride;
+  sfpng_format output_format;
+
+  /* The size set by sfpng_decoder_set_output_size, or zero if the output
+     isn't scaled, and the box filter's accumulator (see scale.h), which
+     lives in scale_buf: for each output column, the sums of premultiplied
+     red, green and blue and of alpha over its box so far, and the image
+     column the box ends at.  scale_rows counts the image rows summed. */
+  int scale_width;
+  int scale_height;
+  uint64_t* scale_sums;
+  uint32_t* scale_ends;
+  int scale_rows;
+  void* scale_buf;
+  size_t scale_buf_size;
+
+  /* IDAT decoding state.  inflate fills row_buf, which holds row_buf_rows
+     scanlines (each with its filter byte), and rows are unfiltered in
+     place as they complete; row_buf_done counts the rows already handled
+     since row_buf was last refilled from the top, and row_buf_emitted
+     those of them already passed to the output (which for a
+     non-interlaced image is done batch_rows at a time).  scanline_prev_buf
+     holds the row before the first one in row_buf.  scanline_row counts
+     rows within the current pass.
+
+     The zlib stream and the buffers outlive a single image so that
+     sfpng_decoder_reset can reuse them: zlib_initialized tracks the
+     stream's lifetime and zlib_active whether it has been set up for the
+     current image.  row_buf_size and image_buf_size are the allocated
+     sizes, and requested_rows is the caller's row_buf_rows setting. */
   z_stream zlib_stream;
-  uint8_t* scanline_buf;
+  int zlib_initialized;
+  int zlib_active;
+
+  /* The built-in inflater, used instead of zlib for image data when
+     use_inflater was set as the image's data started. */
+  struct inflater* inflater;
+  int use_inflater;
+  int inflater_active;
+
+  /* The worker threads, if any, for pipelined decoding of non-interlaced
+     images (see pipeline.h), and whether the current image uses them. */
+  int threads;
+  struct pipeline* pipeline;
+  int pipelined;
+
+  /* Restart points from an sfRS chunk, as pairs of row and offset into
+     the image data, and the threads and buffers for decoding the
+     segments between them in parallel (see segments.h), which takes
+     precedence over the pipeline. */
+  uint32_t* restarts;
+  int restart_count;
+  int restarts_size;
+  struct segments* segments;
+  int segmented;
+  /* If the restart points didn't match the data, the rows the segments
+     handed out before that was found, which decoding the data again
+     without them skips. */
+  int replayed_rows;
+
+  uint8_t* row_buf;
+  size_t row_buf_size;
+  int row_buf_rows;
+  int requested_rows;
+  int row_buf_done;
+  int row_buf_emitted;
   uint8_t* scanline_prev_buf;
   int scanline_row;
+
+  /* The current interlace pass and the size of its reduced image.  A
+     non-interlaced image has a single pass, pass 0, the size of the
+     whole image. */
+  int pass;
+  int pass_width;
+  int pass_height;
+  int pass_stride;
+
+  /* Deinterlacing state: the full image so far as raw pixel data, the
+     next row of it to complete, and the first completed row not yet
+     handed to the output. */
+  uint8_t* image_buf;
+  size_t image_buf_size;
+  int image_row;
+  int image_row_emitted;
+  int interlace_preview;
+
+#ifdef SFPNG_STATS
+  sfpng_stats stats;
+#endif
 };
+
+/* Allocate and free memory with the decoder's allocator.  Freeing NULL
+   does nothing. */
+void* decoder_alloc(sfpng_decoder* decoder, size_t size);
+void decoder_free(const sfpng_decoder* decoder, void* ptr);
+
+/* Whether buffers of |bytes| for the current image, on top of its row
+   buffer, stay within the decoded size limit. */
+int decoder_within_budget(const sfpng_decoder* decoder, uint64_t bytes);
+
+/* Run the current image's inflater over zlib_stream, returning a zlib
+   status as inflate does. */
+int decoder_inflate(sfpng_decoder* decoder);
@@ -0,0 +1,567 @@
+#include "sfpng.h"
+
+#include <arpa/inet.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bands.h"
+#include "crc.h"
+#include "encoder.h"
+#include "filter.h"
+#include "interlace.h"
+
+/* How much compressed data goes in each IDAT chunk.  Bigger chunks mean
+   fewer CRCs and callback calls; 32kb is plenty for that. */
+#define IDAT_BYTES (32 << 10)
+
+static const uint8_t png_signature[8] = {
+  137, 80, 78, 71, 13, 10, 26, 10
+};
+
+static void* default_alloc(void* opaque, size_t size) {
+  return malloc(size);
+}
+
+static void default_free(void* opaque, void* ptr) {
+  free(ptr);
+}
+
+void* encoder_alloc(const sfpng_encoder* encoder, size_t size) {
+  return encoder->alloc_func(encoder->alloc_opaque, size);
+}
+
+void encoder_free(const sfpng_encoder* encoder, void* ptr) {
+  if (ptr)
+    encoder->free_func(encoder->alloc_opaque, ptr);
+}
+
+/* zlib's allocator hooks, with the encoder as zlib's opaque pointer. */
+static voidpf zlib_alloc(voidpf opaque, uInt items, uInt size) {
+  if (size && items > SIZE_MAX / size)
+    return Z_NULL;
+  return encoder_alloc(opaque, (size_t)items * size);
+}
+
+static void zlib_free(voidpf opaque, voidpf ptr) {
+  encoder_free(opaque, ptr);
+}
+
+void encoder_use_allocator(sfpng_encoder* encoder, z_stream* zlib) {
+  zlib->zalloc = zlib_alloc;
+  zlib->zfree = zlib_free;
+  zlib->opaque = encoder;
+}
+
+sfpng_encoder* sfpng_encoder_new() {
+  return sfpng_encoder_new_with_allocator(NULL, NULL, NULL);
+}
+
+sfpng_encoder* sfpng_encoder_new_with_allocator(sfpng_alloc_func alloc_func,
+                                                sfpng_free_func free_func,
+                                                void* opaque) {
+  sfpng_encoder* encoder;
+
+  if (!alloc_func || !free_func) {
+    alloc_func = default_alloc;
+    free_func = default_free;
+    opaque = NULL;
+  }
+
+  encoder = alloc_func(opaque, sizeof(*encoder));
+  if (!encoder)
+    return NULL;
+
+  memset(encoder, 0, sizeof(*encoder));
+  encoder->alloc_func = alloc_func;
+  encoder->free_func = free_func;
+  encoder->alloc_opaque = opaque;
+  encoder->filter = SFPNG_FILTER_DEFAULT;
+  encoder->level = Z_DEFAULT_COMPRESSION;
+  encoder->strategy = SFPNG_STRATEGY_DEFAULT;
+
+  return encoder;
+}
+
+void sfpng_encoder_reset(sfpng_encoder* encoder) {
+  bands_abort(encoder);
+  encoder->width = 0;
+  encoder->height = 0;
+  encoder->palette_entries = 0;
+  encoder->alpha_entries = 0;
+  encoder->started = 0;
+  encoder->row = 0;
+}
+
+void sfpng_encoder_set_context(sfpng_encoder* encoder, void* context) {
+  encoder->context = context;
+}
+
+void* sfpng_encoder_get_context(sfpng_encoder* encoder) {
+  return encoder->context;
+}
+
+void sfpng_encoder_set_write_func(sfpng_encoder* encoder,
+                                  sfpng_write_func write_func) {
+  encoder->write_func = write_func;
+}
+void sfpng_encoder_set_filter(sfpng_encoder* encoder, sfpng_filter filter) {
+  encoder->filter = filter;
+}
+void sfpng_encoder_set_level(sfpng_encoder* encoder, int level) {
+  encoder->level = level;
+}
+void sfpng_encoder_set_strategy(sfpng_encoder* encoder,
+                                sfpng_strategy strategy) {
+  encoder->strategy = strategy;
+}
+void sfpng_encoder_set_threads(sfpng_encoder* encoder, int threads) {
+  encoder->threads = threads > 0 ? threads : 0;
+}
+void sfpng_encoder_set_band_rows(sfpng_encoder* encoder, int rows) {
+  encoder->band_rows = rows > 0 ? rows : 0;
+}
+
+sfpng_status sfpng_encoder_set_header(sfpng_encoder* encoder,
+                                      int width, int height, int depth,
+                                      sfpng_color_type color_type,
+                                      int interlaced) {
+  int channels;
+
+  if (encoder->started)
+    return SFPNG_ERROR_BAD_ATTRIBUTE;
+  if (width <= 0 || height <= 0)
+    return SFPNG_ERROR_BAD_ATTRIBUTE;
+
+  /* 11.2.2 IHDR: the allowed combinations of color type and depth. */
+  switch (color_type) {
+  case SFPNG_COLOR_GRAYSCALE:
+    if (depth != 1 && depth != 2 && depth != 4 && depth != 8 && depth != 16)
+      return SFPNG_ERROR_BAD_ATTRIBUTE;
+    channels = 1;
+    break;
+  case SFPNG_COLOR_INDEXED:
+    if (depth != 1 && depth != 2 && depth != 4 && depth != 8)
+      return SFPNG_ERROR_BAD_ATTRIBUTE;
+    channels = 1;
+    break;
+  case SFPNG_COLOR_TRUECOLOR:
+  case SFPNG_COLOR_GRAYSCALE_ALPHA:
+  case SFPNG_COLOR_TRUECOLOR_ALPHA:
+    if (depth != 8 && depth != 16)
+      return SFPNG_ERROR_BAD_ATTRIBUTE;
+    channels = color_type == SFPNG_COLOR_TRUECOLOR ? 3 :
+               color_type == SFPNG_COLOR_GRAYSCALE_ALPHA ? 2 : 4;
+    break;
+  default:
+    return SFPNG_ERROR_BAD_ATTRIBUTE;
+  }
+
+  /* Each row, with its filter byte, has to fit in an int. */
+  const int pixel_bits = channels * depth;
+  if (((uint64_t)width * pixel_bits + 7) / 8 >= INT_MAX)
+    return SFPNG_ERROR_BAD_ATTRIBUTE;
+
+  encoder->width = width;
+  encoder->height = height;
+  encoder->bit_depth = depth;
+  encoder->color_type = color_type;
+  encoder->interlaced = interlaced != 0;
+  encoder->pixel_bits = pixel_bits;
+  encoder->bytes_per_pixel = pixel_bits < 8 ? 1 : pixel_bits / 8;
+  encoder->stride = ((uint64_t)width * pixel_bits + 7) / 8;
+  encoder->palette_entries = 0;
+  encoder->alpha_entries = 0;
+  return SFPNG_SUCCESS;
+}
+
+sfpng_status sfpng_encoder_set_palette(sfpng_encoder* encoder,
+                                       const uint8_t* rgb, int entries,
+                                       const uint8_t* alpha,
+                                       int alpha_entries) {
+  const int indexed = encoder->color_type == SFPNG_COLOR_INDEXED;
+
+  /* 11.2.3 PLTE: a palette is allowed for color images, and a paletted
+     one may have no more entries than its depth can index. */
+  if (encoder->started || !(encoder->color_type & SFPNG_COLOR_MASK_COLOR))
+    return SFPNG_ERROR_BAD_ATTRIBUTE;
+  if (entries <= 0 || entries > (indexed ? 1 << encoder->bit_depth : 256))
+    return SFPNG_ERROR_BAD_ATTRIBUTE;
+  if (!alpha)
+    alpha_entries = 0;
+  if (alpha_entries < 0 || alpha_entries > entries ||
+      (alpha_entries && !indexed)) {
+    return SFPNG_ERROR_BAD_ATTRIBUTE;
+  }
+
+  memcpy(encoder->palette, rgb, 3 * entries);
+  encoder->palette_entries = entries;
+  if (alpha_entries)
+    memcpy(encoder->palette_alpha, alpha, alpha_entries);
+  encoder->alpha_entries = alpha_entries;
+  return SFPNG_SUCCESS;
+}
+
+void encoder_write(sfpng_encoder* encoder, const uint8_t* buf, int len) {
+  if (encoder->write_func)
+    encoder->write_func(encoder, buf, len);
+}
+
+/* Write a chunk whose data isn't already laid out with room for its
+   header and CRC. */
+static void write_chunk(sfpng_encoder* encoder, const char* type,
+                        const uint8_t* data, int len) {
+  uint8_t header[8];
+  uint32_t n = htonl(len);
+  memcpy(header, &n, 4);
+  memcpy(header + 4, type, 4);
+  encoder_write(encoder, header, 8);
+  if (len)
+    encoder_write(encoder, data, len);
+  n = htonl(crc_compute(type, data, len));
+  encoder_write(encoder, (const uint8_t*)&n, 4);
+}
+
+/* Write the |len| bytes of compressed data at the start of idat_buf's
+   data area as an IDAT chunk. */
+static void write_idat(sfpng_encoder* encoder, int len) {
+  uint8_t* buf = encoder->idat_buf;
+  uint32_t n = htonl(len);
+  memcpy(buf, &n, 4);
+  memcpy(buf + 4, "IDAT", 4);
+  n = htonl(crc_compute("IDAT", buf + 8, len));
+  memcpy(buf + 8 + len, &n, 4);
+  encoder_write(encoder, buf, 8 + len + 4);
+}
+
+static void reset_idat(sfpng_encoder* encoder) {
+  encoder->zlib_stream.next_out = encoder->idat_buf + 8;
+  encoder->zlib_stream.avail_out = IDAT_BYTES;
+}
+
+int encoder_zlib_strategy(sfpng_strategy strategy) {
+  switch (strategy) {
+  case SFPNG_STRATEGY_RLE:
+    return Z_RLE;
+  case SFPNG_STRATEGY_HUFFMAN_ONLY:
+    return Z_HUFFMAN_ONLY;
+  case SFPNG_STRATEGY_DEFAULT:
+  default:
+    return Z_DEFAULT_STRATEGY;
+  }
+}
+
+/* Allocate the buffers for the image and get zlib ready for it. */
+static sfpng_status start_image_data(sfpng_encoder* encoder) {
+  const int scanline_size = 1 + encoder->stride;
+  z_stream* zlib = &encoder->zlib_stream;
+
+  size_t size = (size_t)scanline_size * (2 + 5);
+  if (size > encoder->row_bufs_size) {
+    encoder_free(encoder, encoder->row_bufs);
+    encoder->row_bufs_size = 0;
+    encoder->row_bufs = encoder_alloc(encoder, size);
+    if (!encoder->row_bufs)
+      return SFPNG_ERROR_ALLOC_FAILED;
+    encoder->row_bufs_size = size;
+  }
+  encoder->prev_row = encoder->row_bufs;
+  encoder->pass_row = encoder->prev_row + scanline_size;
+  encoder->filtered = encoder->pass_row + scanline_size;
+  memset(encoder->prev_row, 0, scanline_size);
+
+  if (encoder->interlaced) {
+    size = (size_t)encoder->height * encoder->stride;
+    if (size > encoder->image_buf_size) {
+      encoder_free(encoder, encoder->image_buf);
+      encoder->image_buf_size = 0;
+      encoder->image_buf = encoder_alloc(encoder, size);
+      if (!encoder->image_buf)
+        return SFPNG_ERROR_ALLOC_FAILED;
+      encoder->image_buf_size = size;
+    }
+  }
+
+  if (!encoder->idat_buf) {
+    encoder->idat_buf = encoder_alloc(encoder, 8 + IDAT_BYTES + 4);
+    if (!encoder->idat_buf)
+      return SFPNG_ERROR_ALLOC_FAILED;
+  }
+
+  const int strategy = encoder_zlib_strategy(encoder->strategy);
+  if (!encoder->zlib_initialized) {
+    encoder_use_allocator(encoder, zlib);
+    if (deflateInit2(zlib, encoder->level, Z_DEFLATED, 15, 8,
+                     strategy) != Z_OK) {
+      return SFPNG_ERROR_ZLIB_ERROR;
+    }
+    encoder->zlib_initialized = 1;
+  } else if (deflateReset(zlib) != Z_OK ||
+             deflateParams(zlib, encoder->level, strategy) != Z_OK) {
+    return SFPNG_ERROR_ZLIB_ERROR;
+  }
+  reset_idat(encoder);
+  return SFPNG_SUCCESS;
+}
+
+/* Write the signature and the chunks before the image data. */
+static sfpng_status start(sfpng_encoder* encoder) {
+  if (!encoder->width)
+    return SFPNG_ERROR_BAD_ATTRIBUTE;  /* No header. */
+  if (encoder->color_type == SFPNG_COLOR_INDEXED && !encoder->palette_entries)
+    return SFPNG_ERROR_BAD_ATTRIBUTE;  /* 11.2.3: PLTE is required. */
+
+  encoder->banded = bands_wanted(encoder);
+  sfpng_status status = encoder->banded ?
+    bands_start(encoder) : start_image_data(encoder);
+  if (status != SFPNG_SUCCESS)
+    return status;
+
+  encoder_write(encoder, png_signature, 8);
+
+  uint8_t ihdr[13];
+  uint32_t n = htonl(encoder->width);
+  memcpy(ihdr, &n, 4);
+  n = htonl(encoder->height);
+  memcpy(ihdr + 4, &n, 4);
+  ihdr[8] = encoder->bit_depth;
+  ihdr[9] = encoder->color_type;
+  ihdr[10] = 0;  /* Compression method. */
+  ihdr[11] = 0;  /* Filter method. */
+  ihdr[12] = encoder->interlaced;
+  write_chunk(encoder, "IHDR", ihdr, sizeof(ihdr));
+
+  if (encoder->palette_entries) {
+    write_chunk(encoder, "PLTE", encoder->palette,
+                3 * encoder->palette_entries);
+  }
+  if (encoder->alpha_entries) {
+    write_chunk(encoder, "tRNS", encoder->palette_alpha,
+                encoder->alpha_entries);
+  }
+
+  encoder->started = 1;
+  return SFPNG_SUCCESS;
+}
+
+/* The cost SFPNG_FILTER_MIN_SUM gives a filtered row: the sum of its
+   bytes' magnitudes as signed values. */
+static uint64_t sum_cost(const uint8_t* buf, int len) {
+  uint64_t sum = 0;
+  int i;
+  for (i = 0; i < len; ++i)
+    sum += buf[i] < 128 ? buf[i] : 256 - buf[i];
+  return sum;
+}
+
+/* log2(|x|) in 256ths, roughly: the position of the top bit, plus the
+   next eight bits as a linear stand-in for the fraction.  That's close
+   enough to compare rows with. */
+static uint32_t log2_fixed(uint32_t x) {
+  int bit = 0;
+  while (x >> (bit + 1))
+    ++bit;
+  const uint32_t frac = bit >= 8 ? x >> (bit - 8) : x << (8 - bit);
+  return (uint32_t)bit << 8 | (frac & 0xff);
+}
+
+/* The cost SFPNG_FILTER_MIN_ENTROPY gives a filtered row: about how
+   many bits an order-0 entropy coder would take for it, in 256ths. */
+static uint64_t entropy_cost(const uint8_t* buf, int len) {
+  uint32_t counts[256] = {0};
+  uint64_t cost = 0;
+  int i;
+  for (i = 0; i < len; ++i)
+    ++counts[buf[i]];
+  const uint32_t log_len = log2_fixed(len);
+  for (i = 0; i < 256; ++i) {
+    if (counts[i])
+      cost += (uint64_t)counts[i] * (log_len - log2_fixed(counts[i]));
+  }
+  return cost;
+}
+
+const uint8_t* encoder_filter_row(const sfpng_encoder* encoder,
+                                  const uint8_t* row, const uint8_t* prev,
+                                  int len, uint8_t* filtered) {
+  const int bpp = encoder->bytes_per_pixel;
+  sfpng_filter filter = encoder->filter;
+  int type;
+
+  if (filter == SFPNG_FILTER_DEFAULT) {
+    /* 12.8 Filter selection recommends this. */
+    filter = encoder->color_type == SFPNG_COLOR_INDEXED ||
+      encoder->bit_depth < 8 ? SFPNG_FILTER_NONE : SFPNG_FILTER_MIN_SUM;
+  }
+  if (filter >= SFPNG_FILTER_NONE && filter <= SFPNG_FILTER_PAETH) {
+    uint8_t* out = filtered;
+    out[0] = filter;
+    filter_apply(filter, row, prev, out + 1, len, bpp);
+    return out;
+  }
+
+  const uint8_t* best = NULL;
+  uint64_t best_cost = 0;
+  for (type = FILTER_NONE; type <= FILTER_PAETH; ++type) {
+    uint8_t* out = filtered + (size_t)type * (1 + len);
+    out[0] = type;
+    filter_apply(type, row, prev, out + 1, len, bpp);
+    const uint64_t cost = filter == SFPNG_FILTER_MIN_ENTROPY ?
+      entropy_cost(out + 1, len) : sum_cost(out + 1, len);
+    if (!best || cost < best_cost) {
+      best = out;
+      best_cost = cost;
+    }
+  }
+  return best;
+}
+
+/* Compress |len| bytes, or with |flush| set finish the stream, writing
+   out each IDAT chunk as it fills. */
+static sfpng_status deflate_bytes(sfpng_encoder* encoder, const uint8_t* buf,
+                                  int len, int flush) {
+  z_stream* zlib = &encoder->zlib_stream;
+  zlib->next_in = (uint8_t*)buf;
+  zlib->avail_in = len;
+  for (;;) {
+    int status = deflate(zlib, flush);
+    if (status != Z_OK && status != Z_STREAM_END && status != Z_BUF_ERROR)
+      return SFPNG_ERROR_ZLIB_ERROR;
+    if (zlib->avail_out == 0) {
+      write_idat(encoder, IDAT_BYTES);
+      reset_idat(encoder);
+      continue;
+    }
+    if (flush == Z_FINISH ? status == Z_STREAM_END : zlib->avail_in == 0)
+      break;
+  }
+  return SFPNG_SUCCESS;
+}
+
+/* Filter and compress a row of the current pass, |len| bytes long. */
+static sfpng_status encode_row(sfpng_encoder* encoder, const uint8_t* row,
+                               const uint8_t* prev, int len) {
+  const uint8_t* scanline =
+    encoder_filter_row(encoder, row, prev, len, encoder->filtered);
+  return deflate_bytes(encoder, scanline, 1 + len, Z_NO_FLUSH);
+}
+
+/* Encode the passes of an interlaced image from image_buf. */
+static sfpng_status encode_passes(sfpng_encoder* encoder) {
+  int pass, row;
+  for (pass = 0; pass < 7; ++pass) {
+    int width, height;
+    interlace_adam7_size(encoder->width, encoder->height, pass,
+                         &width, &height);
+    if (width == 0 || height == 0)
+      continue;  /* Empty passes have no scanlines at all. */
+    const int len = (width * encoder->pixel_bits + 7) / 8;
+    /* 9.2: the first row of each pass has an all-zero previous row. */
+    memset(encoder->prev_row, 0, len);
+    for (row = 0; row < height; ++row) {
+      interlace_gather_row(pass, row, encoder->pixel_bits, width,
+                           encoder->image_buf, encoder->stride,
+                           encoder->pass_row);
+      sfpng_status status = encode_row(encoder, encoder->pass_row,
+                                       encoder->prev_row, len);
+      if (status != SFPNG_SUCCESS)
+        return status;
+      memcpy(encoder->prev_row, encoder->pass_row, len);
+    }
+  }
+  return SFPNG_SUCCESS;
+}
+
+/* Finish the zlib stream and the file. */
+static sfpng_status finish(sfpng_encoder* encoder) {
+  sfpng_status status;
+  if (encoder->banded) {
+    status = bands_finish(encoder);
+    if (status != SFPNG_SUCCESS)
+      return status;
+  } else {
+    status = deflate_bytes(encoder, NULL, 0, Z_FINISH);
+    if (status != SFPNG_SUCCESS)
+      return status;
+    write_idat(encoder, IDAT_BYTES - encoder->zlib_stream.avail_out);
+  }
+  write_chunk(encoder, "IEND", NULL, 0);
+  return SFPNG_SUCCESS;
+}
+
+sfpng_status sfpng_encoder_write_rows(sfpng_encoder* encoder,
+                                      const uint8_t* buf,
+                                      ptrdiff_t stride,
+                                      int count) {
+  const int len = encoder->stride;
+  sfpng_status status;
+  int i;
+
+  /* Checked before anything is written, so that bad arguments don't
+     leave a file with nothing after its header. */
+  if (count < 0 || count > encoder->height - encoder->row ||
+      (count && !buf)) {
+    return SFPNG_ERROR_BAD_ATTRIBUTE;
+  }
+  if (!encoder->started) {
+    status = start(encoder);
+    if (status != SFPNG_SUCCESS)
+      return status;
+  }
+
+  if (encoder->banded) {
+    status = bands_write(encoder, buf, stride, count);
+    if (status != SFPNG_SUCCESS)
+      return status;
+    encoder->row += count;
+  } else if (encoder->interlaced) {
+    /* Nothing can be encoded until the last pass has all its rows, which
+       isn't until the last row. */
+    for (i = 0; i < count; ++i) {
+      memcpy(encoder->image_buf + (size_t)(encoder->row + i) * len,
+             buf + i * stride, len);
+    }
+    encoder->row += count;
+    if (encoder->row == encoder->height) {
+      status = encode_passes(encoder);
+      if (status != SFPNG_SUCCESS)
+        return status;
+    }
+  } else {
+    /* The rows before the first are in the caller's buffer, but that of
+       the last call has to be kept. */
+    const uint8_t* prev = encoder->prev_row;
+    for (i = 0; i < count; ++i) {
+      const uint8_t* row = buf + i * stride;
+      status = encode_row(encoder, row, prev, len);
+      if (status != SFPNG_SUCCESS)
+        return status;
+      prev = row;
+    }
+    if (count)
+      memcpy(encoder->prev_row, prev, len);
+    encoder->row += count;
+  }
+
+  if (encoder->row == encoder->height && count)
+    return finish(encoder);
+  return SFPNG_SUCCESS;
+}
+
+sfpng_status sfpng_encoder_write_row(sfpng_encoder* encoder,
+                                     const uint8_t* buf) {
+  return sfpng_encoder_write_rows(encoder, buf, 0, 1);
+}
+
+void sfpng_encoder_free(sfpng_encoder* encoder) {
+  bands_free(encoder);
+  encoder_free(encoder, encoder->row_bufs);
+  encoder_free(encoder, encoder->image_buf);
+  encoder_free(encoder, encoder->idat_buf);
+  if (encoder->zlib_initialized) {
+    int status = deflateEnd(&encoder->zlib_stream);
+    /* We don't care about a bad status at this point. */
+  }
+  encoder->free_func(encoder->alloc_opaque, encoder);
+}
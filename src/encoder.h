@@ -0,0 +1,94 @@
+#include <zlib.h>  /* z_stream */
+
+struct _sfpng_encoder {
+  /* User-specified context pointer. */
+  void* context;
+
+  /* Allocator for everything the encoder allocates, including zlib's
+     state. */
+  sfpng_alloc_func alloc_func;
+  sfpng_free_func free_func;
+  void* alloc_opaque;
+
+  sfpng_write_func write_func;
+
+  /* Options, which outlive a single image. */
+  sfpng_filter filter;
+  int level;
+  sfpng_strategy strategy;
+
+  /* Image header, from sfpng_encoder_set_header; width is zero until
+     it's set. */
+  uint32_t width;
+  uint32_t height;
+  int bit_depth;
+  sfpng_color_type color_type;
+  int interlaced;
+
+  /* Derived image properties, computed from above. */
+  int stride;
+  int bytes_per_pixel;
+  int pixel_bits;
+
+  /* Palette and the alpha of its first entries, from
+     sfpng_encoder_set_palette. */
+  uint8_t palette[3 * 256];
+  int palette_entries;
+  uint8_t palette_alpha[256];
+  int alpha_entries;
+
+  /* Whether the signature and the chunks before the image data have been
+     written, and how many rows of the image have been passed in. */
+  int started;
+  int row;
+
+  /* Row buffers, in one allocation of row_bufs_size bytes: the previous
+     row of the current pass (all zeros at the start of each pass), a row
+     of the current pass gathered from image_buf for an interlaced image,
+     and a scanline, with its filter byte, for each filter type.  An
+     interlaced image is collected in image_buf until its last row. */
+  uint8_t* row_bufs;
+  size_t row_bufs_size;
+  uint8_t* prev_row;
+  uint8_t* pass_row;
+  uint8_t* filtered;
+  uint8_t* image_buf;
+  size_t image_buf_size;
+
+  /* The zlib stream, which like the buffers outlives a single image, and
+     the buffer it compresses into, which has room before and after for
+     the IDAT chunk's header and CRC. */
+  z_stream zlib_stream;
+  int zlib_initialized;
+  uint8_t* idat_buf;
+
+  /* The worker threads, if any, for encoding non-interlaced images in
+     bands of band_rows rows (see bands.h), and whether the current image
+     uses them. */
+  int threads;
+  int band_rows;
+  struct bands* bands;
+  int banded;
+};
+
+/* Allocate and free memory with the encoder's allocator.  Freeing NULL
+   does nothing. */
+void* encoder_alloc(const sfpng_encoder* encoder, size_t size);
+void encoder_free(const sfpng_encoder* encoder, void* ptr);
+
+/* Have |zlib| allocate with the encoder's allocator. */
+void encoder_use_allocator(sfpng_encoder* encoder, z_stream* zlib);
+
+/* The zlib strategy for |strategy|. */
+int encoder_zlib_strategy(sfpng_strategy strategy);
+
+/* Pass |len| bytes of the file to the write callback. */
+void encoder_write(sfpng_encoder* encoder, const uint8_t* buf, int len);
+
+/* Filter |len| bytes of |row|, given the previous row |prev|, as the
+   encoder's filter setting says, and return the scanline with its
+   filter byte.  |filtered| is scratch space for a scanline of each
+   filter type. */
+const uint8_t* encoder_filter_row(const sfpng_encoder* encoder,
+                                  const uint8_t* row, const uint8_t* prev,
+                                  int len, uint8_t* filtered);
@@ -0,0 +1,268 @@
+#include "sfpng.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__SSE2__) && !defined(SFPNG_NO_SIMD)
+#define FILTER_SSE2 1
+#include <emmintrin.h>
+#endif
+
+#include "filter.h"
+
+/* Each filter is split into the first |bpp| bytes, which have no pixel
+   to their left, and the remainder of the row; this keeps the "is there
+   a left neighbor" check out of the per-byte loops. */
+
+static int paeth(int a, int b, int c) {
+  int p = a + b - c;
+  int pa = abs(p - a);
+  int pb = abs(p - b);
+  int pc = abs(p - c);
+  if (pa <= pb && pa <= pc)
+    return a;
+  else if (pb <= pc)
+    return b;
+  else
+    return c;
+}
+
+static void unfilter_sub(uint8_t* row, const uint8_t* prev,
+                         int len, int bpp) {
+  int i;
+  for (i = bpp; i < len; ++i)
+    row[i] += row[i - bpp];
+}
+
+static void unfilter_up(uint8_t* row, const uint8_t* prev,
+                        int len, int bpp) {
+  int i;
+  for (i = 0; i < len; ++i)
+    row[i] += prev[i];
+}
+
+static void unfilter_average(uint8_t* row, const uint8_t* prev,
+                             int len, int bpp) {
+  int i;
+  for (i = 0; i < bpp; ++i)
+    row[i] += prev[i] >> 1;
+  for (; i < len; ++i)
+    row[i] += (row[i - bpp] + prev[i]) >> 1;
+}
+
+static void unfilter_paeth(uint8_t* row, const uint8_t* prev,
+                           int len, int bpp) {
+  int i;
+  /* With no left neighbor, a = c = 0 and the predictor is just b. */
+  for (i = 0; i < bpp; ++i)
+    row[i] += prev[i];
+  for (; i < len; ++i)
+    row[i] += paeth(row[i - bpp], prev[i], prev[i - bpp]);
+}
+
+#if FILTER_SSE2
+/* SSE2 versions of the filters that depend on the pixel to the left.
+   These work one whole pixel at a time, so they only help when a pixel
+   is several bytes wide; the byte-per-pixel cases stay scalar.
+
+   |bpp| is always a compile-time constant at the call sites below, so
+   the load/store switches fold away. */
+
+static inline __m128i load_pixel(const uint8_t* p, int bpp) {
+  if (bpp == 8)
+    return _mm_loadl_epi64((const __m128i*)p);
+  if (bpp == 4) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return _mm_cvtsi32_si128(v);
+  }
+  uint64_t v = 0;
+  memcpy(&v, p, bpp);
+  return _mm_loadl_epi64((const __m128i*)&v);
+}
+
+static inline void store_pixel(uint8_t* p, __m128i v, int bpp) {
+  if (bpp == 8) {
+    _mm_storel_epi64((__m128i*)p, v);
+  } else if (bpp == 4) {
+    uint32_t x = _mm_cvtsi128_si32(v);
+    memcpy(p, &x, 4);
+  } else {
+    uint64_t x;
+    _mm_storel_epi64((__m128i*)&x, v);
+    memcpy(p, &x, bpp);
+  }
+}
+
+static inline void unfilter_sub_sse2(uint8_t* row, int len, int bpp) {
+  __m128i a = _mm_setzero_si128();
+  int i;
+  for (i = 0; i + bpp <= len; i += bpp) {
+    a = _mm_add_epi8(a, load_pixel(row + i, bpp));
+    store_pixel(row + i, a, bpp);
+  }
+}
+
+static inline void unfilter_average_sse2(uint8_t* row, const uint8_t* prev,
+                                         int len, int bpp) {
+  const __m128i one = _mm_set1_epi8(1);
+  __m128i a = _mm_setzero_si128();
+  int i;
+  for (i = 0; i + bpp <= len; i += bpp) {
+    __m128i b = load_pixel(prev + i, bpp);
+    /* _mm_avg_epu8 rounds up; the filter wants (a + b) >> 1. */
+    __m128i avg = _mm_sub_epi8(_mm_avg_epu8(a, b),
+                               _mm_and_si128(_mm_xor_si128(a, b), one));
+    a = _mm_add_epi8(avg, load_pixel(row + i, bpp));
+    store_pixel(row + i, a, bpp);
+  }
+}
+
+static inline __m128i abs_epi16(__m128i x) {
+  return _mm_max_epi16(x, _mm_sub_epi16(_mm_setzero_si128(), x));
+}
+
+static inline __m128i select_epi16(__m128i mask, __m128i t, __m128i f) {
+  return _mm_or_si128(_mm_and_si128(mask, t), _mm_andnot_si128(mask, f));
+}
+
+static inline void unfilter_paeth_sse2(uint8_t* row, const uint8_t* prev,
+                                       int len, int bpp) {
+  const __m128i zero = _mm_setzero_si128();
+  __m128i a = zero, c = zero;
+  int i;
+  for (i = 0; i + bpp <= len; i += bpp) {
+    __m128i b = _mm_unpacklo_epi8(load_pixel(prev + i, bpp), zero);
+    __m128i x = load_pixel(row + i, bpp);
+
+    /* Same predictor as paeth(), on 16-bit lanes:
+       pa = |b - c|, pb = |a - c|, pc = |a + b - 2c|. */
+    __m128i bc = _mm_sub_epi16(b, c);
+    __m128i ac = _mm_sub_epi16(a, c);
+    __m128i pa = abs_epi16(bc);
+    __m128i pb = abs_epi16(ac);
+    __m128i pc = abs_epi16(_mm_add_epi16(bc, ac));
+    __m128i smallest = _mm_min_epi16(pc, _mm_min_epi16(pa, pb));
+    __m128i pred = select_epi16(_mm_cmpeq_epi16(pa, smallest), a,
+                                select_epi16(_mm_cmpeq_epi16(pb, smallest),
+                                             b, c));
+
+    x = _mm_add_epi8(x, _mm_packus_epi16(pred, pred));
+    store_pixel(row + i, x, bpp);
+
+    a = _mm_unpacklo_epi8(x, zero);
+    c = b;
+  }
+}
+
+#define SSE2_KERNELS(bpp)                                               \
+  static void unfilter_sub_sse2_##bpp(uint8_t* row, const uint8_t* prev, \
+                                      int len, int unused) {            \
+    unfilter_sub_sse2(row, len, bpp);                                   \
+  }                                                                     \
+  static void unfilter_average_sse2_##bpp(uint8_t* row,                 \
+                                          const uint8_t* prev,          \
+                                          int len, int unused) {        \
+    unfilter_average_sse2(row, prev, len, bpp);                         \
+  }                                                                     \
+  static void unfilter_paeth_sse2_##bpp(uint8_t* row,                   \
+                                        const uint8_t* prev,            \
+                                        int len, int unused) {          \
+    unfilter_paeth_sse2(row, prev, len, bpp);                           \
+  }
+SSE2_KERNELS(3)
+SSE2_KERNELS(4)
+SSE2_KERNELS(6)
+SSE2_KERNELS(8)
+#undef SSE2_KERNELS
+#endif  /* FILTER_SSE2 */
+
+typedef void (*unfilter_func)(uint8_t* row, const uint8_t* prev,
+                              int len, int bpp);
+
+/* Kernels for the filters that look to the left, indexed by bpp.
+   Valid bpp values are 1, 2, 3, 4, 6 and 8. */
+typedef struct {
+  unfilter_func sub;
+  unfilter_func average;
+  unfilter_func paeth;
+} unfilter_kernels;
+
+#define SCALAR_KERNELS { unfilter_sub, unfilter_average, unfilter_paeth }
+#if FILTER_SSE2
+#define SSE2_KERNELS(bpp) \
+  { unfilter_sub_sse2_##bpp, unfilter_average_sse2_##bpp, \
+    unfilter_paeth_sse2_##bpp }
+#else
+#define SSE2_KERNELS(bpp) SCALAR_KERNELS
+#endif
+
+static const unfilter_kernels kernels[9] = {
+  SCALAR_KERNELS,   /* unused */
+  SCALAR_KERNELS,
+  SCALAR_KERNELS,
+  SSE2_KERNELS(3),
+  SSE2_KERNELS(4),
+  SCALAR_KERNELS,   /* unused */
+  SSE2_KERNELS(6),
+  SCALAR_KERNELS,   /* unused */
+  SSE2_KERNELS(8),
+};
+
+sfpng_status filter_reconstruct(int filter_type, uint8_t* row,
+                                const uint8_t* prev, int len, int bpp) {
+  const unfilter_kernels* k = &kernels[bpp];
+
+  switch (filter_type) {
+  case FILTER_NONE:
+    break;
+  case FILTER_SUB:
+    k->sub(row, prev, len, bpp);
+    break;
+  case FILTER_UP:
+    unfilter_up(row, prev, len, bpp);
+    break;
+  case FILTER_AVERAGE:
+    k->average(row, prev, len, bpp);
+    break;
+  case FILTER_PAETH:
+    k->paeth(row, prev, len, bpp);
+    break;
+  default:
+    return SFPNG_ERROR_BAD_FILTER;
+  }
+  return SFPNG_SUCCESS;
+}
+
+void filter_apply(int filter_type, const uint8_t* row, const uint8_t* prev,
+                  uint8_t* out, int len, int bpp) {
+  int i;
+
+  switch (filter_type) {
+  case FILTER_NONE:
+    memcpy(out, row, len);
+    break;
+  case FILTER_SUB:
+    memcpy(out, row, bpp);
+    for (i = bpp; i < len; ++i)
+      out[i] = row[i] - row[i - bpp];
+    break;
+  case FILTER_UP:
+    for (i = 0; i < len; ++i)
+      out[i] = row[i] - prev[i];
+    break;
+  case FILTER_AVERAGE:
+    for (i = 0; i < bpp; ++i)
+      out[i] = row[i] - (prev[i] >> 1);
+    for (; i < len; ++i)
+      out[i] = row[i] - ((row[i - bpp] + prev[i]) >> 1);
+    break;
+  case FILTER_PAETH:
+    /* As in unfilter_paeth, the predictor starts out as just b. */
+    for (i = 0; i < bpp; ++i)
+      out[i] = row[i] - prev[i];
+    for (; i < len; ++i)
+      out[i] = row[i] - paeth(row[i - bpp], prev[i], prev[i - bpp]);
+    break;
+  }
+}
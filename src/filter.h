@@ -0,0 +1,23 @@
+#include <stdint.h>
+
+/* 9.2 Filter types for filter method 0 */
+enum filter_type {
+  FILTER_NONE = 0,
+  FILTER_SUB,
+  FILTER_UP,
+  FILTER_AVERAGE,
+  FILTER_PAETH
+};
+
+/* Undo the filter |filter_type| on |len| bytes of |row| in place.
+   |prev| is the already-reconstructed previous row (all zeros for the
+   first row) and |bpp| is the filter's bytes per complete pixel. */
+sfpng_status filter_reconstruct(int filter_type, uint8_t* row,
+                                const uint8_t* prev, int len, int bpp)
+  SFPNG_WARN_UNUSED_RESULT;
+
+/* The reverse of filter_reconstruct, for encoding: write |len| bytes of
+   |row| filtered with |filter_type| to |out|, given the previous row
+   |prev| (again all zeros for the first row). */
+void filter_apply(int filter_type, const uint8_t* row, const uint8_t* prev,
+                  uint8_t* out, int len, int bpp);
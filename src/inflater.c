@@ -0,0 +1,835 @@
+#include "sfpng.h"
+
+#include <string.h>
+
+#include "inflater.h"
+
+#define min(a, b) ((a) < (b) ? (a) : (b))
+
+/* A DEFLATE (RFC 1951) decoder for zlib (RFC 1950) streams.
+
+   Compared to zlib's inflate, this keeps 64 bits of input in a bit
+   buffer that is refilled eight bytes at a time, decodes a pair of short
+   literal codes with a single table lookup, and copies matches in
+   eight-byte words.  Those tricks need slack at both ends of the
+   buffers, so near the end of the input or output it falls back to a
+   careful path that handles one symbol at a time and can stop between
+   any two symbols, picking up again on the next call.
+
+   Output is written straight to the caller's buffer, and the last 32kb
+   of it are also kept in a window for matches that reach back past the
+   start of the current call's output. */
+
+#define WINDOW_SIZE 32768
+
+/* Bits of code looked up by the first level of each table.  Longer codes
+   continue into a subtable. */
+#define LITLEN_BITS 10
+#define DIST_BITS 8
+#define CODELEN_BITS 7
+
+/* Worst case table sizes: the first level plus, for each prefix with
+   longer codes under it, a subtable big enough for the longest code. */
+#define LITLEN_TABLE_SIZE ((1 << LITLEN_BITS) + 288 * (1 << (15 - LITLEN_BITS)))
+#define DIST_TABLE_SIZE ((1 << DIST_BITS) + 32 * (1 << (15 - DIST_BITS)))
+#define CODELEN_TABLE_SIZE (1 << CODELEN_BITS)
+
+/* The fast path needs this many bytes of output space: the longest
+   match, plus room for a match copy to run over by a word. */
+#define FAST_OUT_MIN (258 + 8)
+
+/* Table entries pack the number of bits to consume, the kind of entry,
+   a four-bit field and a 16-bit value.
+
+   kind       | field                | value
+   -----------+----------------------+------------------------------
+   LITERAL    |                      | the byte
+   LITERAL2   | first code's length  | first byte | second byte << 8
+   LENGTH     | extra bits           | base length
+   DISTANCE   | extra bits           | base distance
+   END        |                      |
+   SUBTABLE   | subtable index bits  | subtable offset
+   BAD        |                      |
+
+   Subtable entries count only the bits after the first level's. */
+enum {
+  ENTRY_LITERAL,
+  ENTRY_LITERAL2,
+  ENTRY_LENGTH,
+  ENTRY_DISTANCE,
+  ENTRY_END,
+  ENTRY_SUBTABLE,
+  ENTRY_BAD,
+};
+#define ENTRY(kind, bits, field, value) \
+  ((uint32_t)(bits) | (kind) << 8 | (field) << 12 | (uint32_t)(value) << 16)
+#define ENTRY_BITS(e)  ((e) & 0xff)
+#define ENTRY_KIND(e)  (((e) >> 8) & 0xf)
+#define ENTRY_FIELD(e) (((e) >> 12) & 0xf)
+#define ENTRY_VALUE(e) ((e) >> 16)
+
+typedef enum {
+  TABLE_LITLEN,
+  TABLE_DIST,
+  TABLE_CODELEN,
+} table_type;
+
+typedef enum {
+  MODE_ZLIB_HEADER,
+  MODE_BLOCK_HEADER,
+  MODE_STORED_HEADER,
+  MODE_STORED_DATA,
+  MODE_TABLE_HEADER,
+  MODE_CODELEN_LENS,
+  MODE_CODE_LENS,
+  MODE_CODES,
+  MODE_COPY,
+  MODE_CHECKSUM,
+  MODE_DONE,
+  MODE_BAD,
+} inflater_mode;
+
+struct inflater {
+  inflater_mode mode;
+  int final_block;
+
+  /* Input bits not yet used, starting from the low bit. */
+  uint64_t bitbuf;
+  int bitcnt;
+
+  /* The Adler-32 of the output so far, if it's being computed, and
+     whether it's checked against the stream's.  A segment's Adler-32 is
+     only computed, and the stream's is kept in |checksum| for the caller
+     to check the combined one against. */
+  int sum_adler;
+  int check_adler;
+  uint32_t adler;
+  uint32_t checksum;
+
+  /* Bytes left in a stored block. */
+  int stored_left;
+
+  /* Dynamic block header: the code counts, and the code lengths read
+     so far. */
+  int nlen, ndist, ncodelen;
+  int have;
+  uint8_t lens[288 + 32];
+
+  /* A match cut short by the end of the output buffer. */
+  int copy_len;
+  int copy_dist;
+
+  /* The last whave (up to WINDOW_SIZE) bytes of output, as a ring
+     ending just before wnext. */
+  int wnext;
+  int whave;
+  uint8_t window[WINDOW_SIZE];
+
+  uint32_t litlen_table[LITLEN_TABLE_SIZE];
+  uint32_t dist_table[DIST_TABLE_SIZE];
+  uint32_t codelen_table[CODELEN_TABLE_SIZE];
+};
+
+static const uint16_t length_base[29] = {
+  3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+  35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+static const uint8_t length_extra[29] = {
+  0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+  3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+static const uint16_t dist_base[30] = {
+  1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+  257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
+  8193, 12289, 16385, 24577
+};
+static const uint8_t dist_extra[30] = {
+  0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+  7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+
+/* The order code length code lengths are sent in. */
+static const uint8_t codelen_order[19] = {
+  16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15
+};
+
+size_t inflater_size(void) {
+  return sizeof(inflater);
+}
+
+void inflater_reset(inflater* inf, int check_adler) {
+  inf->mode = MODE_ZLIB_HEADER;
+  inf->sum_adler = check_adler;
+  inf->check_adler = check_adler;
+  inf->final_block = 0;
+  inf->bitbuf = 0;
+  inf->bitcnt = 0;
+  inf->adler = 1;
+  inf->wnext = 0;
+  inf->whave = 0;
+}
+
+void inflater_reset_segment(inflater* inf, int at_start, int sum_adler) {
+  inflater_reset(inf, 0);
+  if (!at_start)
+    inf->mode = MODE_BLOCK_HEADER;
+  inf->sum_adler = sum_adler;
+}
+
+uint32_t inflater_adler(const inflater* inf) {
+  return inf->adler;
+}
+
+uint32_t inflater_checksum(const inflater* inf) {
+  return inf->checksum;
+}
+
+static uint32_t symbol_entry(table_type type, int symbol, int bits) {
+  switch (type) {
+  case TABLE_LITLEN:
+    if (symbol < 256)
+      return ENTRY(ENTRY_LITERAL, bits, 0, symbol);
+    if (symbol == 256)
+      return ENTRY(ENTRY_END, bits, 0, 0);
+    symbol -= 257;
+    if (symbol >= 29)
+      return ENTRY(ENTRY_BAD, bits, 0, 0);
+    return ENTRY(ENTRY_LENGTH, bits, length_extra[symbol],
+                 length_base[symbol]);
+  case TABLE_DIST:
+    if (symbol >= 30)
+      return ENTRY(ENTRY_BAD, bits, 0, 0);
+    return ENTRY(ENTRY_DISTANCE, bits, dist_extra[symbol], dist_base[symbol]);
+  case TABLE_CODELEN:
+  default:
+    return ENTRY(ENTRY_LITERAL, bits, 0, symbol);
+  }
+}
+
+static int reverse_bits(int code, int len) {
+  int rev = 0;
+  while (len--) {
+    rev = (rev << 1) | (code & 1);
+    code >>= 1;
+  }
+  return rev;
+}
+
+/* Build the decoding table for the canonical Huffman code with the
+   |count| code lengths in |lens|.  Returns 0 on success or -1 if the
+   lengths don't describe a valid code. */
+static int build_table(uint32_t* table, int root, int size,
+                       table_type type, const uint8_t* lens, int count) {
+  int len_count[16] = { 0 };
+  int next_code[16];
+  uint8_t sub_bits[1 << LITLEN_BITS] = { 0 };
+  const int root_size = 1 << root;
+  int max_len = 0;
+  int symbol, len, i;
+
+  for (symbol = 0; symbol < count; ++symbol)
+    ++len_count[lens[symbol]];
+  len_count[0] = 0;
+  for (len = 1; len <= 15; ++len) {
+    if (len_count[len])
+      max_len = len;
+  }
+
+  /* Reject over-subscribed codes.  Incomplete codes are only allowed
+     (as in zlib) when there's a single one-bit code, or for distances,
+     no codes at all. */
+  int left = 1;
+  for (len = 1; len <= 15; ++len) {
+    left = (left << 1) - len_count[len];
+    if (left < 0)
+      return -1;
+  }
+  if (left > 0 && (type == TABLE_CODELEN || max_len > 1) &&
+      !(type == TABLE_DIST && max_len == 0)) {
+    return -1;
+  }
+
+  int code = 0;
+  for (len = 1; len <= 15; ++len) {
+    code = (code + len_count[len - 1]) << 1;
+    next_code[len] = code;
+  }
+
+  for (i = 0; i < root_size; ++i)
+    table[i] = ENTRY(ENTRY_BAD, root, 0, 0);
+
+  /* Find how many index bits each subtable needs... */
+  if (max_len > root) {
+    int codes[16];
+    memcpy(codes, next_code, sizeof(codes));
+    for (symbol = 0; symbol < count; ++symbol) {
+      len = lens[symbol];
+      if (len <= root)
+        continue;
+      int prefix = reverse_bits(codes[len]++, len) & (root_size - 1);
+      if (len - root > sub_bits[prefix])
+        sub_bits[prefix] = len - root;
+    }
+    /* ...and lay them out after the first level. */
+    int offset = root_size;
+    for (i = 0; i < root_size; ++i) {
+      if (!sub_bits[i])
+        continue;
+      int sub_size = 1 << sub_bits[i];
+      if (offset + sub_size > size)
+        return -1;
+      table[i] = ENTRY(ENTRY_SUBTABLE, root, sub_bits[i], offset);
+      int j;
+      for (j = 0; j < sub_size; ++j)
+        table[offset + j] = ENTRY(ENTRY_BAD, sub_bits[i], 0, 0);
+      offset += sub_size;
+    }
+  }
+
+  /* Codes are read starting from their first bit, which is the low bit
+     of the table index, so each code of length len fills every entry
+     whose low len bits are the code reversed. */
+  for (symbol = 0; symbol < count; ++symbol) {
+    len = lens[symbol];
+    if (!len)
+      continue;
+    int rev = reverse_bits(next_code[len]++, len);
+    if (len <= root) {
+      uint32_t entry = symbol_entry(type, symbol, len);
+      for (i = rev; i < root_size; i += 1 << len)
+        table[i] = entry;
+    } else {
+      uint32_t sub = table[rev & (root_size - 1)];
+      uint32_t entry = symbol_entry(type, symbol, len - root);
+      uint32_t* subtable = table + ENTRY_VALUE(sub);
+      for (i = rev >> root; i < 1 << ENTRY_FIELD(sub); i += 1 << (len - root))
+        subtable[i] = entry;
+    }
+  }
+
+  if (type == TABLE_LITLEN) {
+    /* Where a literal's code leaves room in the index for all of a
+       second literal's code, have the entry produce both.  The entry
+       for the bits after the first code is at index i >> len, which may
+       already have been paired up. */
+    for (i = 0; i < root_size; ++i) {
+      uint32_t first = table[i];
+      if (ENTRY_KIND(first) != ENTRY_LITERAL)
+        continue;
+      int first_bits = ENTRY_BITS(first);
+      uint32_t second = table[i >> first_bits];
+      int second_bits = ENTRY_BITS(second);
+      if (ENTRY_KIND(second) == ENTRY_LITERAL2)
+        second_bits = ENTRY_FIELD(second);
+      else if (ENTRY_KIND(second) != ENTRY_LITERAL)
+        continue;
+      if (first_bits + second_bits > root)
+        continue;
+      table[i] = ENTRY(ENTRY_LITERAL2, first_bits + second_bits, first_bits,
+                       ENTRY_VALUE(first) | (ENTRY_VALUE(second) & 0xff) << 8);
+    }
+  }
+
+  return 0;
+}
+
+static int build_fixed_tables(inflater* inf) {
+  uint8_t* lens = inf->lens;
+  int i;
+  for (i = 0; i < 144; ++i)
+    lens[i] = 8;
+  for (; i < 256; ++i)
+    lens[i] = 9;
+  for (; i < 280; ++i)
+    lens[i] = 7;
+  for (; i < 288; ++i)
+    lens[i] = 8;
+  for (i = 0; i < 32; ++i)
+    lens[288 + i] = 5;
+  if (build_table(inf->litlen_table, LITLEN_BITS, LITLEN_TABLE_SIZE,
+                  TABLE_LITLEN, lens, 288) != 0 ||
+      build_table(inf->dist_table, DIST_BITS, DIST_TABLE_SIZE,
+                  TABLE_DIST, lens + 288, 32) != 0) {
+    return -1;
+  }
+  return 0;
+}
+
+/* Look up the next code in |table|, returning its entry and setting
+   |*bits| to the code's whole length. */
+static inline uint32_t lookup(const uint32_t* table, int root,
+                              uint64_t bitbuf, int* bits) {
+  uint32_t e = table[bitbuf & ((1 << root) - 1)];
+  int used = 0;
+  if (ENTRY_KIND(e) == ENTRY_SUBTABLE) {
+    used = root;
+    e = table[ENTRY_VALUE(e) +
+              ((bitbuf >> root) & ((1u << ENTRY_FIELD(e)) - 1))];
+  }
+  *bits = used + ENTRY_BITS(e);
+  return e;
+}
+
+static uint64_t load_le64(const uint8_t* p) {
+  uint64_t v = 0;
+  int i;
+  for (i = 7; i >= 0; --i)
+    v = (v << 8) | p[i];
+  return v;
+}
+
+/* Copy |len| bytes of match from |dist| back, which may reach before
+   |out_start| into the window.  Writes exactly |len| bytes. */
+static uint8_t* copy_match(const inflater* inf, uint8_t* out,
+                           const uint8_t* out_start, int len, int dist) {
+  const int produced = out - out_start;
+  if (dist > produced) {
+    const int back = dist - produced;
+    const int from = (inf->wnext - back) & (WINDOW_SIZE - 1);
+    const int n = min(len, back);
+    const int first = min(n, WINDOW_SIZE - from);
+    memcpy(out, inf->window + from, first);
+    memcpy(out + first, inf->window, n - first);
+    out += n;
+    len -= n;
+  }
+  const uint8_t* src = out - dist;
+  if (dist >= len) {
+    memcpy(out, src, len);
+    return out + len;
+  }
+  while (len--)
+    *out++ = *src++;
+  return out;
+}
+
+/* Like copy_match, but may write up to 7 bytes past the end of the
+   match. */
+static inline uint8_t* copy_match_fast(const inflater* inf, uint8_t* out,
+                                       const uint8_t* out_start,
+                                       int len, int dist) {
+  if (dist > out - out_start || dist < 8) {
+    if (dist == 1 && out > out_start) {
+      memset(out, out[-1], len);
+      return out + len;
+    }
+    return copy_match(inf, out, out_start, len, dist);
+  }
+  const uint8_t* src = out - dist;
+  uint8_t* end = out + len;
+  do {
+    uint64_t word;
+    memcpy(&word, src, 8);
+    memcpy(out, &word, 8);
+    src += 8;
+    out += 8;
+  } while (out < end);
+  return end;
+}
+
+/* Append |len| bytes of output to the window. */
+static void update_window(inflater* inf, const uint8_t* buf, size_t len) {
+  if (len >= WINDOW_SIZE) {
+    memcpy(inf->window, buf + len - WINDOW_SIZE, WINDOW_SIZE);
+    inf->wnext = 0;
+    inf->whave = WINDOW_SIZE;
+    return;
+  }
+  int first = min((int)len, WINDOW_SIZE - inf->wnext);
+  memcpy(inf->window + inf->wnext, buf, first);
+  memcpy(inf->window, buf + first, len - first);
+  inf->wnext = (inf->wnext + len) & (WINDOW_SIZE - 1);
+  inf->whave = min(WINDOW_SIZE, inf->whave + (int)len);
+}
+
+int inflater_run(inflater* inf, z_stream* strm) {
+  const uint8_t* in = strm->next_in;
+  const uint8_t* const in_end = in + strm->avail_in;
+  uint8_t* out = strm->next_out;
+  uint8_t* const out_start = out;
+  uint8_t* const out_end = out + strm->avail_out;
+  /* Output up to here has been included in the checksum. */
+  const uint8_t* adler_done = out;
+  uint64_t bitbuf = inf->bitbuf;
+  int bitcnt = inf->bitcnt;
+  int ret = Z_OK;
+
+/* Get at least |n| (at most 56) bits into the bit buffer, or stop until
+   there's more input. */
+#define NEED_BITS(n)                                    \
+  do {                                                  \
+    while (bitcnt < (n)) {                              \
+      if (in == in_end)                                 \
+        goto suspend;                                   \
+      bitbuf |= (uint64_t)*in++ << bitcnt;              \
+      bitcnt += 8;                                      \
+    }                                                   \
+  } while (0)
+/* Get one more byte into the bit buffer, or stop until there's more
+   input. */
+#define PULL_BYTE()                                     \
+  do {                                                  \
+    if (in == in_end)                                   \
+      goto suspend;                                     \
+    bitbuf |= (uint64_t)*in++ << bitcnt;                \
+    bitcnt += 8;                                        \
+  } while (0)
+#define BITS(n) ((uint32_t)bitbuf & ((1u << (n)) - 1))
+#define DROP_BITS(n)                                    \
+  do {                                                  \
+    bitbuf >>= (n);                                     \
+    bitcnt -= (n);                                      \
+  } while (0)
+#define FAIL()                                          \
+  do {                                                  \
+    inf->mode = MODE_BAD;                               \
+    goto suspend;                                       \
+  } while (0)
+
+  for (;;) {
+    switch (inf->mode) {
+    case MODE_ZLIB_HEADER: {
+      NEED_BITS(16);
+      const int cmf = BITS(8);
+      const int flg = (bitbuf >> 8) & 0xff;
+      /* PNG requires deflate with at most a 32kb window and no preset
+         dictionary. */
+      if ((cmf << 8 | flg) % 31 != 0 || (cmf & 0xf) != 8 || (cmf >> 4) > 7 ||
+          (flg & 0x20)) {
+        FAIL();
+      }
+      DROP_BITS(16);
+      inf->mode = MODE_BLOCK_HEADER;
+      break;
+    }
+
+    case MODE_BLOCK_HEADER:
+      NEED_BITS(3);
+      inf->final_block = BITS(1);
+      switch ((bitbuf >> 1) & 3) {
+      case 0:
+        inf->mode = MODE_STORED_HEADER;
+        break;
+      case 1:
+        if (build_fixed_tables(inf) != 0)
+          FAIL();
+        inf->mode = MODE_CODES;
+        break;
+      case 2:
+        inf->mode = MODE_TABLE_HEADER;
+        break;
+      default:
+        FAIL();
+      }
+      DROP_BITS(3);
+      break;
+
+    case MODE_STORED_HEADER: {
+      DROP_BITS(bitcnt & 7);
+      NEED_BITS(32);
+      const uint32_t len = BITS(16);
+      const uint32_t nlen = (bitbuf >> 16) & 0xffff;
+      if (len != (~nlen & 0xffff))
+        FAIL();
+      DROP_BITS(32);
+      inf->stored_left = len;
+      inf->mode = MODE_STORED_DATA;
+      break;
+    }
+
+    case MODE_STORED_DATA:
+      /* Bytes already in the bit buffer come first. */
+      while (inf->stored_left && bitcnt >= 8 && out < out_end) {
+        *out++ = BITS(8);
+        DROP_BITS(8);
+        --inf->stored_left;
+      }
+      if (inf->stored_left && bitcnt < 8) {
+        const int n = min(inf->stored_left, min(in_end - in, out_end - out));
+        memcpy(out, in, n);
+        in += n;
+        out += n;
+        inf->stored_left -= n;
+      }
+      if (inf->stored_left)
+        goto suspend;
+      inf->mode = inf->final_block ? MODE_CHECKSUM : MODE_BLOCK_HEADER;
+      break;
+
+    case MODE_TABLE_HEADER:
+      NEED_BITS(14);
+      inf->nlen = 257 + BITS(5);
+      inf->ndist = 1 + ((bitbuf >> 5) & 0x1f);
+      inf->ncodelen = 4 + ((bitbuf >> 10) & 0xf);
+      if (inf->nlen > 286 || inf->ndist > 30)
+        FAIL();
+      DROP_BITS(14);
+      memset(inf->lens, 0, 19);
+      inf->have = 0;
+      inf->mode = MODE_CODELEN_LENS;
+      break;
+
+    case MODE_CODELEN_LENS: {
+      uint8_t codelen_lens[19];
+      while (inf->have < inf->ncodelen) {
+        NEED_BITS(3);
+        inf->lens[inf->have++] = BITS(3);
+        DROP_BITS(3);
+      }
+      int i;
+      memset(codelen_lens, 0, sizeof(codelen_lens));
+      for (i = 0; i < inf->ncodelen; ++i)
+        codelen_lens[codelen_order[i]] = inf->lens[i];
+      if (build_table(inf->codelen_table, CODELEN_BITS, CODELEN_TABLE_SIZE,
+                      TABLE_CODELEN, codelen_lens, 19) != 0) {
+        FAIL();
+      }
+      inf->have = 0;
+      inf->mode = MODE_CODE_LENS;
+      break;
+    }
+
+    case MODE_CODE_LENS: {
+      const int total = inf->nlen + inf->ndist;
+      while (inf->have < total) {
+        const uint32_t e = inf->codelen_table[BITS(CODELEN_BITS)];
+        const int bits = ENTRY_BITS(e);
+        if (bits > bitcnt) {
+          PULL_BYTE();
+          continue;
+        }
+        if (ENTRY_KIND(e) == ENTRY_BAD)
+          FAIL();
+        const int symbol = ENTRY_VALUE(e);
+        if (symbol < 16) {
+          DROP_BITS(bits);
+          inf->lens[inf->have++] = symbol;
+          continue;
+        }
+        int value = 0, repeat;
+        if (symbol == 16) {
+          NEED_BITS(bits + 2);
+          if (inf->have == 0)
+            FAIL();
+          value = inf->lens[inf->have - 1];
+          repeat = 3 + ((bitbuf >> bits) & 3);
+          DROP_BITS(bits + 2);
+        } else if (symbol == 17) {
+          NEED_BITS(bits + 3);
+          repeat = 3 + ((bitbuf >> bits) & 7);
+          DROP_BITS(bits + 3);
+        } else {
+          NEED_BITS(bits + 7);
+          repeat = 11 + ((bitbuf >> bits) & 0x7f);
+          DROP_BITS(bits + 7);
+        }
+        if (inf->have + repeat > total)
+          FAIL();
+        while (repeat--)
+          inf->lens[inf->have++] = value;
+      }
+      if (inf->lens[256] == 0)
+        FAIL();  /* No end of block code. */
+      if (build_table(inf->litlen_table, LITLEN_BITS, LITLEN_TABLE_SIZE,
+                      TABLE_LITLEN, inf->lens, inf->nlen) != 0 ||
+          build_table(inf->dist_table, DIST_BITS, DIST_TABLE_SIZE,
+                      TABLE_DIST, inf->lens + inf->nlen, inf->ndist) != 0) {
+        FAIL();
+      }
+      inf->mode = MODE_CODES;
+      break;
+    }
+
+    case MODE_CODES: {
+      const uint32_t* litlen = inf->litlen_table;
+      const uint32_t* dist_table = inf->dist_table;
+      const int history = inf->whave;
+
+      /* Fast path: with at least 8 bytes of input left, refill the bit
+         buffer to 56 or more bits with one unaligned load, which is
+         enough for any length/distance pair. */
+      while (in_end - in >= 8 && out_end - out >= FAST_OUT_MIN) {
+        bitbuf |= load_le64(in) << bitcnt;
+        in += (63 - bitcnt) >> 3;
+        bitcnt |= 56;
+
+        uint32_t e = litlen[bitbuf & ((1 << LITLEN_BITS) - 1)];
+        if (ENTRY_KIND(e) == ENTRY_SUBTABLE) {
+          DROP_BITS(LITLEN_BITS);
+          e = litlen[ENTRY_VALUE(e) + BITS(ENTRY_FIELD(e))];
+        }
+        DROP_BITS(ENTRY_BITS(e));
+
+        const int kind = ENTRY_KIND(e);
+        if (kind == ENTRY_LITERAL2) {
+          out[0] = ENTRY_VALUE(e);
+          out[1] = ENTRY_VALUE(e) >> 8;
+          out += 2;
+          continue;
+        }
+        if (kind == ENTRY_LITERAL) {
+          *out++ = ENTRY_VALUE(e);
+          continue;
+        }
+        if (kind == ENTRY_END) {
+          inf->mode = inf->final_block ? MODE_CHECKSUM : MODE_BLOCK_HEADER;
+          break;
+        }
+        if (kind != ENTRY_LENGTH)
+          FAIL();
+
+        const int len = ENTRY_VALUE(e) + BITS(ENTRY_FIELD(e));
+        DROP_BITS(ENTRY_FIELD(e));
+        e = dist_table[bitbuf & ((1 << DIST_BITS) - 1)];
+        if (ENTRY_KIND(e) == ENTRY_SUBTABLE) {
+          DROP_BITS(DIST_BITS);
+          e = dist_table[ENTRY_VALUE(e) + BITS(ENTRY_FIELD(e))];
+        }
+        DROP_BITS(ENTRY_BITS(e));
+        if (ENTRY_KIND(e) != ENTRY_DISTANCE)
+          FAIL();
+        const int dist = ENTRY_VALUE(e) + BITS(ENTRY_FIELD(e));
+        DROP_BITS(ENTRY_FIELD(e));
+        if (dist > history + (out - out_start))
+          FAIL();  /* Reaches back before the start of the stream. */
+        out = copy_match_fast(inf, out, out_start, len, dist);
+      }
+      /* The wide refill also reads bits past bitcnt; clear them, since
+         everywhere else bits are only ever added above bitcnt. */
+      bitbuf &= ((uint64_t)1 << bitcnt) - 1;
+      if (inf->mode != MODE_CODES)
+        break;
+
+      /* Slow path: decode a symbol only once all of its bits, including
+         a match's distance, are in the bit buffer, so that running out
+         of input never leaves one half-decoded.  With the output full,
+         this still reads on to the end of the block (and so, for the
+         last block, the checksum) if that's the next symbol, as zlib
+         does. */
+      for (;;) {
+        if (in_end - in >= 8 && out_end - out >= FAST_OUT_MIN)
+          break;
+        int bits;
+        uint32_t e = lookup(litlen, LITLEN_BITS, bitbuf, &bits);
+        int kind = ENTRY_KIND(e);
+        int value = ENTRY_VALUE(e);
+        if (kind == ENTRY_LITERAL2) {
+          /* Only take the first, which may be all the input has. */
+          kind = ENTRY_LITERAL;
+          bits = ENTRY_FIELD(e);
+          value &= 0xff;
+        }
+        if (bits > bitcnt) {
+          PULL_BYTE();
+          continue;
+        }
+        if (kind == ENTRY_END) {
+          DROP_BITS(bits);
+          inf->mode = inf->final_block ? MODE_CHECKSUM : MODE_BLOCK_HEADER;
+          break;
+        }
+        if (out == out_end)
+          goto suspend;
+        if (kind == ENTRY_LITERAL) {
+          *out++ = value;
+          DROP_BITS(bits);
+          continue;
+        }
+        if (kind != ENTRY_LENGTH)
+          FAIL();
+
+        int need = bits + ENTRY_FIELD(e);
+        if (need > bitcnt) {
+          PULL_BYTE();
+          continue;
+        }
+        const int len = value +
+          ((bitbuf >> bits) & ((1u << ENTRY_FIELD(e)) - 1));
+        int dist_bits;
+        e = lookup(dist_table, DIST_BITS, bitbuf >> need, &dist_bits);
+        if (need + dist_bits + ENTRY_FIELD(e) > bitcnt) {
+          PULL_BYTE();
+          continue;
+        }
+        if (ENTRY_KIND(e) != ENTRY_DISTANCE)
+          FAIL();
+        need += dist_bits;
+        const int dist = ENTRY_VALUE(e) +
+          ((bitbuf >> need) & ((1u << ENTRY_FIELD(e)) - 1));
+        DROP_BITS(need + ENTRY_FIELD(e));
+        if (dist > history + (out - out_start))
+          FAIL();
+
+        const int n = min(len, out_end - out);
+        out = copy_match(inf, out, out_start, n, dist);
+        if (n < len) {
+          inf->copy_len = len - n;
+          inf->copy_dist = dist;
+          inf->mode = MODE_COPY;
+          break;
+        }
+      }
+      break;
+    }
+
+    case MODE_COPY: {
+      const int n = min(inf->copy_len, out_end - out);
+      out = copy_match(inf, out, out_start, n, inf->copy_dist);
+      inf->copy_len -= n;
+      if (inf->copy_len)
+        goto suspend;
+      inf->mode = MODE_CODES;
+      break;
+    }
+
+    case MODE_CHECKSUM: {
+      DROP_BITS(bitcnt & 7);
+      NEED_BITS(32);
+      /* The checksum is stored most significant byte first. */
+      inf->checksum = BITS(8) << 24 |
+                      ((bitbuf >> 8) & 0xff) << 16 |
+                      ((bitbuf >> 16) & 0xff) << 8 |
+                      ((bitbuf >> 24) & 0xff);
+      if (inf->check_adler) {
+        inf->adler = adler32(inf->adler, adler_done, out - adler_done);
+        adler_done = out;
+        if (inf->checksum != inf->adler)
+          FAIL();
+      }
+      DROP_BITS(32);
+      inf->mode = MODE_DONE;
+      break;
+    }
+
+    case MODE_DONE:
+      ret = Z_STREAM_END;
+      goto suspend;
+
+    case MODE_BAD:
+      ret = Z_DATA_ERROR;
+      goto suspend;
+    }
+  }
+
+ suspend:
+  if (inf->mode == MODE_BAD) {
+    ret = Z_DATA_ERROR;
+  } else {
+    if (inf->sum_adler)
+      inf->adler = adler32(inf->adler, adler_done, out - adler_done);
+    update_window(inf, out_start, out - out_start);
+  }
+  inf->bitbuf = bitbuf;
+  inf->bitcnt = bitcnt;
+  strm->avail_in -= in - strm->next_in;
+  strm->next_in = (uint8_t*)in;
+  strm->avail_out -= out - strm->next_out;
+  strm->next_out = out;
+  return ret;
+
+#undef NEED_BITS
+#undef PULL_BYTE
+#undef BITS
+#undef DROP_BITS
+#undef FAIL
+}
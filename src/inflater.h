@@ -0,0 +1,35 @@
+#include <stddef.h>
+#include <zlib.h>  /* z_stream */
+
+/* A zlib-format DEFLATE decoder specialized for PNG image data, as an
+   alternative to zlib's inflate.  See inflater.c. */
+typedef struct inflater inflater;
+
+/* The number of bytes to allocate for an inflater. */
+size_t inflater_size(void);
+
+/* Get ready to decode a new zlib stream.  Unless |check_adler| is set,
+   the stream's Adler-32 checksum is skipped over without being checked. */
+void inflater_reset(inflater* inf, int check_adler);
+
+/* Get ready to decode one segment of a zlib stream that was cut up with
+   full flushes, so that it refers to nothing before it: the start of the
+   stream if |at_start| is set, and otherwise the block starting just
+   after a flush.  The segment's Adler-32 is computed if |sum_adler| is
+   set, but never checked; see inflater_adler and inflater_checksum. */
+void inflater_reset_segment(inflater* inf, int at_start, int sum_adler);
+
+/* The Adler-32 of the output so far, if it's being computed. */
+uint32_t inflater_adler(const inflater* inf);
+
+/* The checksum stored at the end of the stream, once inflater_run has
+   returned Z_STREAM_END. */
+uint32_t inflater_checksum(const inflater* inf);
+
+/* Decode from strm->next_in into strm->next_out, advancing both along
+   with their avail_ counts, until either runs out or the stream ends.
+   Only the next_/avail_ fields of |strm| are used.  Returns Z_OK,
+   Z_STREAM_END once the whole stream (including its checksum) has been
+   decoded, or Z_DATA_ERROR for a bad stream, like inflate() with
+   Z_SYNC_FLUSH. */
+int inflater_run(inflater* inf, z_stream* strm);
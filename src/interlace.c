@@ -0,0 +1,184 @@
+#include "sfpng.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "decoder.h"
+#include "interlace.h"
+#include "transform.h"
+
+/* Where each pass's pixels start and how far apart they are. */
+static const int adam7_start_row[7] = { 0, 0, 4, 0, 2, 0, 1 };
+static const int adam7_start_col[7] = { 0, 4, 0, 2, 0, 1, 0 };
+static const int adam7_row_step[7]  = { 8, 8, 8, 4, 4, 2, 2 };
+static const int adam7_col_step[7]  = { 8, 8, 4, 4, 2, 2, 1 };
+
+/* The size of the block each pass's pixel stands in for when
+   previewing, which is the area not yet covered by earlier passes. */
+static const int adam7_block_width[7]  = { 8, 4, 4, 2, 2, 1, 1 };
+static const int adam7_block_height[7] = { 8, 8, 4, 4, 2, 2, 1 };
+
+int interlace_passes(const sfpng_decoder* decoder) {
+  return decoder->interlaced ? 7 : 1;
+}
+
+static int pass_extent(int size, int start, int step) {
+  return size > start ? (size - start + step - 1) / step : 0;
+}
+
+void interlace_pass_size(const sfpng_decoder* decoder, int pass,
+                         int* width, int* height) {
+  if (!decoder->interlaced) {
+    *width = decoder->width;
+    *height = decoder->height;
+    return;
+  }
+  interlace_adam7_size(decoder->width, decoder->height, pass, width, height);
+}
+
+void interlace_adam7_size(int width, int height, int pass,
+                          int* pass_width, int* pass_height) {
+  *pass_width = pass_extent(width, adam7_start_col[pass],
+                            adam7_col_step[pass]);
+  *pass_height = pass_extent(height, adam7_start_row[pass],
+                             adam7_row_step[pass]);
+}
+
+/* Copy pixel |src_x| of |src| to pixel |dst_x| of |dst|, for pixels of
+   |bits| bits. */
+static void copy_pixel(int bits, const uint8_t* src, int src_x,
+                       uint8_t* dst, int dst_x) {
+  if (bits >= 8) {
+    const int bytes = bits / 8;
+    memcpy(dst + dst_x * bytes, src + src_x * bytes, bytes);
+  } else {
+    /* Pixels are packed with the leftmost in the high bits. */
+    const int mask = (1 << bits) - 1;
+    const int src_shift = 8 - bits - (src_x * bits) % 8;
+    const int dst_shift = 8 - bits - (dst_x * bits) % 8;
+    int value = (src[src_x * bits / 8] >> src_shift) & mask;
+    uint8_t* out = &dst[dst_x * bits / 8];
+    *out = (*out & ~(mask << dst_shift)) | (value << dst_shift);
+  }
+}
+
+/* The last pass that contributes pixels to image row |y|. */
+static int last_pass_for_row(const sfpng_decoder* decoder, int y) {
+  int pass;
+  for (pass = 6; pass > 0; --pass) {
+    int width, height;
+    interlace_pass_size(decoder, pass, &width, &height);
+    if (width > 0 && y >= adam7_start_row[pass] &&
+        (y - adam7_start_row[pass]) % adam7_row_step[pass] == 0) {
+      break;
+    }
+  }
+  return pass;
+}
+
+/* Whether image row |y| has all of its pixels, given that the current
+   row of the current pass has just been placed. */
+static int row_is_complete(const sfpng_decoder* decoder, int y) {
+  int pass = last_pass_for_row(decoder, y);
+  if (pass != decoder->pass)
+    return pass < decoder->pass;
+  return (y - adam7_start_row[pass]) / adam7_row_step[pass] <=
+         decoder->scanline_row;
+}
+
+sfpng_status interlace_row(sfpng_decoder* decoder, const uint8_t* row) {
+  if (!decoder->row_func && !decoder->rows_func && !decoder->output_buf)
+    return SFPNG_SUCCESS;
+
+  /* At the first row of the image, get a cleared buffer for it, reusing
+     the one from a previous image if it's big enough. */
+  const size_t size = (size_t)decoder->height * decoder->stride;
+  if ((decoder->pass == 0 && decoder->scanline_row == 0) ||
+      size > decoder->image_buf_size) {
+    if (size > decoder->image_buf_size) {
+      decoder_free(decoder, decoder->image_buf);
+      decoder->image_buf_size = 0;
+      decoder->image_buf = decoder_alloc(decoder, size);
+      if (!decoder->image_buf)
+        return SFPNG_ERROR_ALLOC_FAILED;
+      decoder->image_buf_size = size;
+    }
+    memset(decoder->image_buf, 0, size);
+  }
+
+  const int pass = decoder->pass;
+  const int y = adam7_start_row[pass] +
+                decoder->scanline_row * adam7_row_step[pass];
+  const int stride = decoder->stride;
+  int i;
+
+  if (decoder->interlace_preview && !decoder->scale_width) {
+    /* Fill each pixel's whole block, then show every row it touched. */
+    int block_height = adam7_block_height[pass];
+    if (y + block_height > decoder->height)
+      block_height = decoder->height - y;
+    for (i = 0; i < decoder->pass_width; ++i) {
+      int x = adam7_start_col[pass] + i * adam7_col_step[pass];
+      int block_width = adam7_block_width[pass];
+      if (x + block_width > decoder->width)
+        block_width = decoder->width - x;
+      int dy, dx;
+      for (dy = 0; dy < block_height; ++dy) {
+        uint8_t* dst = decoder->image_buf + (size_t)(y + dy) * stride;
+        for (dx = 0; dx < block_width; ++dx)
+          copy_pixel(decoder->pixel_bits, row, i, dst, x + dx);
+      }
+    }
+    transform_emit_rows(decoder, y, block_height,
+                        decoder->image_buf + (size_t)y * stride, stride);
+    return SFPNG_SUCCESS;
+  }
+
+  uint8_t* dst = decoder->image_buf + (size_t)y * stride;
+  for (i = 0; i < decoder->pass_width; ++i) {
+    copy_pixel(decoder->pixel_bits, row, i,
+               dst, adam7_start_col[pass] + i * adam7_col_step[pass]);
+  }
+
+  /* Hand out rows in order as they become complete, in batches of
+     batch_rows but for the last. */
+  while (decoder->image_row < decoder->height &&
+         row_is_complete(decoder, decoder->image_row)) {
+    ++decoder->image_row;
+    const int count = decoder->image_row - decoder->image_row_emitted;
+    if (count >= decoder->batch_rows ||
+        decoder->image_row == decoder->height) {
+      transform_emit_rows(decoder, decoder->image_row_emitted, count,
+                          decoder->image_buf +
+                          (size_t)decoder->image_row_emitted * stride,
+                          stride);
+      decoder->image_row_emitted = decoder->image_row;
+    }
+  }
+  return SFPNG_SUCCESS;
+}
+
+void interlace_flush(sfpng_decoder* decoder) {
+  const int count = decoder->image_row - decoder->image_row_emitted;
+  if (count == 0)
+    return;
+  transform_emit_rows(decoder, decoder->image_row_emitted, count,
+                      decoder->image_buf +
+                      (size_t)decoder->image_row_emitted * decoder->stride,
+                      decoder->stride);
+  decoder->image_row_emitted = decoder->image_row;
+}
+
+void interlace_gather_row(int pass, int row, int pixel_bits, int pass_width,
+                          const uint8_t* image, size_t stride, uint8_t* out) {
+  const uint8_t* src =
+    image + (size_t)(adam7_start_row[pass] + row * adam7_row_step[pass]) *
+    stride;
+  int i;
+  /* Clear the padding bits at the end of a packed row. */
+  memset(out, 0, (pass_width * pixel_bits + 7) / 8);
+  for (i = 0; i < pass_width; ++i) {
+    copy_pixel(pixel_bits, src,
+               adam7_start_col[pass] + i * adam7_col_step[pass], out, i);
+  }
+}
@@ -0,0 +1,33 @@
+/* 8.2 Interlace methods: Adam7.
+
+A non-interlaced image is treated as having a single pass, pass 0,
+covering the whole image. */
+
+/* The number of passes in the image. */
+int interlace_passes(const sfpng_decoder* decoder);
+
+/* The dimensions of the reduced image for |pass|; either may be zero. */
+void interlace_pass_size(const sfpng_decoder* decoder, int pass,
+                         int* width, int* height);
+
+/* The dimensions of the reduced image for |pass| of an interlaced image
+   of |width| by |height| pixels. */
+void interlace_adam7_size(int width, int height, int pass,
+                          int* pass_width, int* pass_height);
+
+/* The reverse of interlace_row, for the encoder: gather row |row| of
+   |pass|, |pass_width| pixels of |pixel_bits| bits, from the full image
+   |image|, whose rows are |stride| bytes apart, into |out|. */
+void interlace_gather_row(int pass, int row, int pixel_bits, int pass_width,
+                          const uint8_t* image, size_t stride, uint8_t* out);
+
+/* Handle |row|, the unfiltered row number decoder->scanline_row of the
+   current pass of an interlaced image: place its pixels in the full
+   image and call the row callback for whatever rows that completes
+   (or, in preview mode, updates). */
+sfpng_status interlace_row(sfpng_decoder* decoder, const uint8_t* row)
+  SFPNG_WARN_UNUSED_RESULT;
+
+/* Hand out the complete rows still waiting to make up a batch, for when
+   the image data ends early or turns out to be bad. */
+void interlace_flush(sfpng_decoder* decoder);
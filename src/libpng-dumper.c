@@ -1,5 +1,6 @@
 #include <libpng/png.h>
 #include <setjmp.h>
+#include <stdlib.h>
 
 #include "dumper.h"
 
@@ -57,13 +58,58 @@ static void dump_png_rows(png_structp png, png_infop info) {
     dump_row(y, rows[y], stride);
 }
 
+/* The file being read, and whether it has turned out to end early. */
+typedef struct {
+  FILE* f;
+  volatile int truncated;  /* Set after setjmp. */
+} input;
+
+static void read_function(png_structp png, png_bytep data, png_size_t len) {
+  input* in = png_get_io_ptr(png);
+  if (fread(data, 1, len, in->f) != len) {
+    in->truncated = 1;
+    png_error(png, "file is truncated");
+  }
+}
+
+/* Read and dump the raw rows of an image whose info has been read into
+   |buf|.  Those of a non-interlaced image are read and dumped one at a
+   time, counting them in |*rows|, so that if the image data goes bad
+   partway the rows before that are known. */
+static void read_png_rows(png_structp png, png_infop info,
+                          png_byte* buf, volatile int* rows) {
+  int height = png_get_image_height(png, info);
+  int stride = png_get_rowbytes(png, info);
+  int y;
+  printf("raw data bytes:\n");
+  if (png_get_interlace_type(png, info) == PNG_INTERLACE_NONE) {
+    for (*rows = 0; *rows < height; ++*rows) {
+      png_read_row(png, buf, NULL);
+      dump_row(*rows, buf, stride);
+    }
+  } else {
+    png_set_interlace_handling(png);
+    png_read_update_info(png, info);
+    png_byte** row_pointers = png_malloc(png, height * sizeof(png_byte*));
+    for (y = 0; y < height; ++y)
+      row_pointers[y] = buf + (size_t)y * stride;
+    png_read_image(png, row_pointers);
+    png_free(png, row_pointers);
+    for (y = 0; y < height; ++y)
+      dump_row(y, buf + (size_t)y * stride, stride);
+  }
+  png_read_end(png, info);
+}
+
 static int dump_file(const char* filename, int transform) {
   int ret = 1;
   png_structp png;
   png_infop info = NULL;
+  png_byte* volatile buf = NULL;
+  volatile int rows = -1;
 
-  FILE* f = fopen(filename, "rb");
-  if (!f) {
+  input in = { fopen(filename, "rb"), 0 };
+  if (!in.f) {
     perror("fopen");
     return 1;
   }
@@ -75,12 +121,16 @@ static int dump_file(const char* filename, int transform) {
   if (setjmp(png_jmpbuf(png))) {
     /* Error happened. */
     printf("invalid image\n");
+    /* libpng reads the image data in large pieces, so the rows of a file
+       that ends early stop some way before where it ends. */
+    if (rows >= 0 && !in.truncated)
+      printf("rows before the error: %d\n", rows);
     ret = 1;
     goto out;
   }
   info = png_create_info_struct(png);
 
-  png_init_io(png, f);
+  png_set_read_fn(png, &in, read_function);
   if (transform) {
     /* Always dump as RGBA. */
     png_set_add_alpha(png, 0xFF, PNG_FILLER_AFTER);
@@ -90,11 +140,8 @@ static int dump_file(const char* filename, int transform) {
       | PNG_TRANSFORM_EXPAND
       | PNG_TRANSFORM_GRAY_TO_RGB;
     png_read_png(png, info, flags, NULL);
-    int interlaced = png_get_interlace_type(png, info) != PNG_INTERLACE_NONE;
-    if (!interlaced) {
-      printf("decoded bytes:\n");
-      dump_png_rows(png, info);
-    }
+    printf("decoded bytes:\n");
+    dump_png_rows(png, info);
 
     png_text* texts = NULL;
     int comments = png_get_text(png, info, &texts, NULL);
@@ -102,20 +149,22 @@ static int dump_file(const char* filename, int transform) {
     for (i = 0; i < comments; ++i)
       dump_comment(texts[i].key, texts[i].text, texts[i].text_length);
   } else {
-    png_read_png(png, info, PNG_TRANSFORM_IDENTITY, NULL);
+    png_read_info(png, info);
     dump_png_metadata(png, info);
-    int interlaced = png_get_interlace_type(png, info) != PNG_INTERLACE_NONE;
-    if (!interlaced) {
-      printf("raw data bytes:\n");
-      dump_png_rows(png, info);
-    }
+    const int interlaced =
+      png_get_interlace_type(png, info) != PNG_INTERLACE_NONE;
+    buf = malloc((size_t)png_get_rowbytes(png, info) *
+                 (interlaced ? png_get_image_height(png, info) : 1));
+    if (!interlaced)
+      rows = 0;
+    read_png_rows(png, info, buf, &rows);
   }
 
   ret = 0;
 
  out:
-  if (f)
-    fclose(f);
+  free(buf);
+  fclose(in.f);
   png_destroy_read_struct(&png, &info, NULL);
 
   return ret;
@@ -0,0 +1,462 @@
+#include "sfpng.h"
+
+#include <pthread.h>
+#include <string.h>
+
+#include "decoder.h"
+#include "filter.h"
+#include "pipeline.h"
+#include "transform.h"
+
+#define min(a, b) ((a) < (b) ? (a) : (b))
+#define max(a, b) ((a) > (b) ? (a) : (b))
+
+/* The number of blocks in the ring, which bounds how far inflate can
+   get ahead of the rows being handed out. */
+#define RING_BLOCKS 4
+
+/* About how many bytes of scanlines go in a block, unless the caller
+   set the row buffer size. */
+#define DEFAULT_BLOCK_BYTES (256 << 10)
+
+/* A block of consecutive scanlines, each with its filter byte.  Once
+   unfiltered, its rows are converted to the output buffer in |slices|
+   parts, each taken by whichever worker gets to it first. */
+typedef struct {
+  uint8_t* buf;
+  int first_row;
+  int rows;
+  int slices;
+  int next_slice;
+  int slices_done;
+  int done;
+  sfpng_status status;
+} block;
+
+struct pipeline {
+  sfpng_decoder* decoder;
+
+  /* Everything below is protected by |lock|.  work_cond is signalled
+     when there may be new work for the workers (or they should stop),
+     and done_cond when a block is done. */
+  pthread_mutex_t lock;
+  pthread_cond_t work_cond;
+  pthread_cond_t done_cond;
+  pthread_t* threads;
+  int thread_count;
+  int stop;
+
+  /* RING_BLOCKS blocks of up to block_rows scanlines, followed by the
+     last row of the most recently unfiltered block. */
+  uint8_t* ring;
+  size_t ring_size;
+  int block_rows;
+  uint8_t* prev_row;
+  block blocks[RING_BLOCKS];
+
+  /* Blocks are numbered from zero for each image, and block n lives in
+     slot n % RING_BLOCKS.  Blocks before |dispatched| have been filled
+     by inflate, those before |unfiltered| unfiltered (one block at a
+     time, in order, as each depends on the one before), and those before
+     |delivered| handed out.  inflated_rows counts the rows in dispatched
+     blocks. */
+  int dispatched;
+  int unfiltered;
+  int unfiltering;
+  int delivered;
+  int inflated_rows;
+};
+
+static uint8_t* slot_buf(const pipeline* p, int n) {
+  const int scanline_size = 1 + p->decoder->stride;
+  return p->ring +
+    (size_t)(n % RING_BLOCKS) * p->block_rows * scanline_size;
+}
+
+static sfpng_status unfilter_block(pipeline* p, block* b) {
+  const sfpng_decoder* decoder = p->decoder;
+  const int scanline_size = 1 + decoder->stride;
+  const uint8_t* prev = p->prev_row;
+  uint8_t* row = b->buf;
+  int i;
+
+  for (i = 0; i < b->rows; ++i) {
+    sfpng_status status =
+      filter_reconstruct(row[0], row + 1, prev + 1,
+                         decoder->stride, decoder->bytes_per_pixel);
+    if (status != SFPNG_SUCCESS) {
+      /* Only the rows before the bad one are left to hand out. */
+      b->rows = i;
+      return status;
+    }
+    prev = row;
+    row += scanline_size;
+  }
+  memcpy(p->prev_row, prev, scanline_size);
+  return SFPNG_SUCCESS;
+}
+
+static void convert_slice(pipeline* p, block* b, int slice) {
+  const int scanline_size = 1 + p->decoder->stride;
+  const int start = (int)((int64_t)b->rows * slice / b->slices);
+  const int end = (int)((int64_t)b->rows * (slice + 1) / b->slices);
+  transform_output_rows(p->decoder, b->first_row + start, end - start,
+                        b->buf + (size_t)start * scanline_size + 1,
+                        scanline_size);
+}
+
+/* Find an unfiltered block with a slice left to convert. */
+static block* find_slice(pipeline* p) {
+  int n;
+  for (n = p->delivered; n < p->unfiltered; ++n) {
+    block* b = &p->blocks[n % RING_BLOCKS];
+    if (b->status == SFPNG_SUCCESS && b->next_slice < b->slices)
+      return b;
+  }
+  return NULL;
+}
+
+static void* worker_main(void* arg) {
+  pipeline* p = arg;
+
+  pthread_mutex_lock(&p->lock);
+  while (!p->stop) {
+    /* Unfiltering is on the critical path, so it comes first. */
+    if (!p->unfiltering && p->unfiltered < p->dispatched) {
+      block* b = &p->blocks[p->unfiltered % RING_BLOCKS];
+      p->unfiltering = 1;
+      pthread_mutex_unlock(&p->lock);
+      sfpng_status status = unfilter_block(p, b);
+      pthread_mutex_lock(&p->lock);
+      p->unfiltering = 0;
+      ++p->unfiltered;
+      b->status = status;
+      if (status != SFPNG_SUCCESS || b->slices == 0) {
+        b->done = 1;
+        pthread_cond_broadcast(&p->done_cond);
+      }
+      pthread_cond_broadcast(&p->work_cond);
+      continue;
+    }
+
+    block* b = find_slice(p);
+    if (b) {
+      int slice = b->next_slice++;
+      pthread_mutex_unlock(&p->lock);
+      convert_slice(p, b, slice);
+      pthread_mutex_lock(&p->lock);
+      if (++b->slices_done == b->slices) {
+        b->done = 1;
+        pthread_cond_broadcast(&p->done_cond);
+      }
+      continue;
+    }
+
+    pthread_cond_wait(&p->work_cond, &p->lock);
+  }
+  pthread_mutex_unlock(&p->lock);
+  return NULL;
+}
+
+static pipeline* pipeline_create(sfpng_decoder* decoder) {
+  pipeline* p = decoder_alloc(decoder, sizeof(*p));
+  if (!p)
+    return NULL;
+  memset(p, 0, sizeof(*p));
+  p->decoder = decoder;
+  decoder->pipeline = p;
+
+  p->threads = decoder_alloc(decoder, decoder->threads * sizeof(pthread_t));
+  if (!p->threads) {
+    pipeline_free(decoder);
+    return NULL;
+  }
+  pthread_mutex_init(&p->lock, NULL);
+  pthread_cond_init(&p->work_cond, NULL);
+  pthread_cond_init(&p->done_cond, NULL);
+  for (; p->thread_count < decoder->threads; ++p->thread_count) {
+    if (pthread_create(&p->threads[p->thread_count], NULL,
+                       worker_main, p) != 0) {
+      pipeline_free(decoder);
+      return NULL;
+    }
+  }
+  return p;
+}
+
+int pipeline_wanted(const sfpng_decoder* decoder) {
+  return decoder->threads > 0 && !decoder->interlaced;
+}
+
+/* Point inflate at the block after the last dispatched one. */
+static void fill_next_block(pipeline* p) {
+  sfpng_decoder* decoder = p->decoder;
+  const int rows = min(p->block_rows, decoder->height - p->inflated_rows);
+  decoder->zlib_stream.next_out = slot_buf(p, p->dispatched);
+  decoder->zlib_stream.avail_out = rows * (1 + decoder->stride);
+}
+
+/* The rows in each block, sized as process_image_data_chunk sizes its
+   row buffer, but larger by default so that each block has enough rows
+   to spread over the workers. */
+static int block_rows(const sfpng_decoder* decoder) {
+  const int scanline_size = 1 + decoder->stride;
+  int rows = decoder->requested_rows;
+  if (rows <= 0)
+    rows = max(DEFAULT_BLOCK_BYTES / scanline_size, decoder->threads);
+  if (rows < decoder->batch_rows)
+    rows = decoder->batch_rows;
+  rows -= rows % decoder->batch_rows;
+  if (rows > decoder->height)
+    rows = decoder->height;
+  if (rows < 1)
+    rows = 1;
+  return rows;
+}
+
+uint64_t pipeline_ring_size(const sfpng_decoder* decoder) {
+  return (uint64_t)(1 + decoder->stride) *
+         (RING_BLOCKS * block_rows(decoder) + 1);
+}
+
+sfpng_status pipeline_start(sfpng_decoder* decoder) {
+  pipeline* p = decoder->pipeline;
+  if (p && p->thread_count != decoder->threads) {
+    pipeline_free(decoder);
+    p = NULL;
+  }
+  if (!p) {
+    p = pipeline_create(decoder);
+    if (!p)
+      return SFPNG_ERROR_ALLOC_FAILED;
+  }
+
+  const int scanline_size = 1 + decoder->stride;
+  const int rows = block_rows(decoder);
+  size_t size = pipeline_ring_size(decoder);
+  if (size > p->ring_size) {
+    decoder_free(decoder, p->ring);
+    p->ring_size = 0;
+    p->ring = decoder_alloc(decoder, size);
+    if (!p->ring)
+      return SFPNG_ERROR_ALLOC_FAILED;
+    p->ring_size = size;
+  }
+
+  pthread_mutex_lock(&p->lock);
+  p->block_rows = rows;
+  p->prev_row = p->ring + (size_t)scanline_size * RING_BLOCKS * rows;
+  memset(p->prev_row, 0, scanline_size);
+  p->dispatched = 0;
+  p->unfiltered = 0;
+  p->delivered = 0;
+  p->inflated_rows = 0;
+  pthread_mutex_unlock(&p->lock);
+
+  fill_next_block(p);
+  return SFPNG_SUCCESS;
+}
+
+/* Hand the first |rows| rows of the block being inflated to the workers. */
+static void dispatch(pipeline* p, int rows) {
+  const sfpng_decoder* decoder = p->decoder;
+
+  pthread_mutex_lock(&p->lock);
+  block* b = &p->blocks[p->dispatched % RING_BLOCKS];
+  b->buf = slot_buf(p, p->dispatched);
+  b->first_row = p->inflated_rows;
+  b->rows = rows;
+  /* Rows that have to be converted in order are left to deliver. */
+  b->slices = transform_output_unordered(decoder) ?
+    min(rows, p->thread_count) : 0;
+  b->next_slice = 0;
+  b->slices_done = 0;
+  b->done = 0;
+  b->status = SFPNG_SUCCESS;
+  ++p->dispatched;
+  p->inflated_rows += rows;
+  pthread_cond_broadcast(&p->work_cond);
+  pthread_mutex_unlock(&p->lock);
+}
+
+/* Pass the oldest undelivered block to the callbacks, waiting for it to
+   be done if |wait| is set.  Sets |*delivered| if it was.  A block with
+   a bad filter passes on its rows before that and then its error. */
+static sfpng_status deliver(pipeline* p, int wait, int* delivered) {
+  sfpng_decoder* decoder = p->decoder;
+  const int scanline_size = 1 + decoder->stride;
+
+  *delivered = 0;
+  pthread_mutex_lock(&p->lock);
+  block* b = &p->blocks[p->delivered % RING_BLOCKS];
+  if (p->delivered == p->dispatched || (!b->done && !wait)) {
+    pthread_mutex_unlock(&p->lock);
+    return SFPNG_SUCCESS;
+  }
+  while (!b->done)
+    pthread_cond_wait(&p->done_cond, &p->lock);
+  pthread_mutex_unlock(&p->lock);
+
+  /* As in process_image_data_chunk, but a batch at a time.  The workers
+     don't convert the rows of a block with a bad filter. */
+  const int converted = b->slices && b->status == SFPNG_SUCCESS;
+  int i, j;
+  for (i = 0; i < b->rows; i += decoder->batch_rows) {
+    const int count = min(decoder->batch_rows, b->rows - i);
+    const int row = b->first_row + i;
+    const uint8_t* buf = b->buf + (size_t)i * scanline_size + 1;
+    if (decoder->pass_row_func) {
+      for (j = 0; j < count; ++j) {
+        decoder->pass_row_func(decoder, 0, row + j,
+                               buf + j * scanline_size, decoder->stride);
+      }
+    }
+    if (converted)
+      transform_emit_output_rows(decoder, row, count, buf, scanline_size);
+    else
+      transform_emit_rows(decoder, row, count, buf, scanline_size);
+  }
+  decoder->scanline_row += b->rows;
+  if (b->status != SFPNG_SUCCESS) {
+    /* The block stays undelivered, with only its error left. */
+    b->rows = 0;
+    return b->status;
+  }
+  if (decoder->scanline_row == decoder->height)
+    ++decoder->pass;  /* The image is done. */
+
+  pthread_mutex_lock(&p->lock);
+  ++p->delivered;
+  pthread_mutex_unlock(&p->lock);
+  *delivered = 1;
+  return SFPNG_SUCCESS;
+}
+
+/* Deliver every dispatched block, waiting for each in turn. */
+static sfpng_status deliver_all(pipeline* p) {
+  int delivered;
+  do {
+    sfpng_status status = deliver(p, 1, &delivered);
+    if (status != SFPNG_SUCCESS)
+      return status;
+  } while (delivered);
+  return SFPNG_SUCCESS;
+}
+
+sfpng_status pipeline_write(sfpng_decoder* decoder) {
+  pipeline* p = decoder->pipeline;
+  z_stream* zlib = &decoder->zlib_stream;
+  const int scanline_size = 1 + decoder->stride;
+  sfpng_status status;
+  int delivered;
+
+  while (zlib->avail_in) {
+    if (p->inflated_rows == decoder->height) {
+      /* Extra data after the last row is ignored, as in
+         process_image_data_chunk. */
+      zlib->avail_in = 0;
+      break;
+    }
+
+    int zstatus = decoder_inflate(decoder);
+    const int inflate_failed = zstatus != Z_OK && zstatus != Z_STREAM_END;
+
+    if (decoder->chunk_state != CHUNK_STATE_IDAT &&
+        zlib->next_out - slot_buf(p, p->dispatched) >= scanline_size) {
+      /* Past all the metadata, as in process_image_data_chunk.  This
+         comes before the first block is dispatched, so that an output
+         buffer set from the info callback is used for it. */
+      transform_select(decoder);
+      if (decoder->info_func)
+        decoder->info_func(decoder);
+      decoder->chunk_state = CHUNK_STATE_IDAT;
+    }
+
+    if (inflate_failed) {
+      /* The rows before the bad data go out first, as they do from
+         inflate_image_data, or the error in them if they have one. */
+      status = pipeline_finish(decoder);
+      return status != SFPNG_SUCCESS ? status : SFPNG_ERROR_ZLIB_ERROR;
+    }
+
+    if (zlib->avail_out == 0) {
+      dispatch(p, (zlib->next_out - slot_buf(p, p->dispatched)) /
+                  scanline_size);
+      if (p->inflated_rows == decoder->height) {
+        status = deliver_all(p);
+        if (status != SFPNG_SUCCESS)
+          return status;
+      } else {
+        /* Wait for the next slot to be free. */
+        while (p->dispatched - p->delivered == RING_BLOCKS) {
+          status = deliver(p, 1, &delivered);
+          if (status != SFPNG_SUCCESS)
+            return status;
+        }
+        fill_next_block(p);
+      }
+    }
+
+    if (zstatus == Z_STREAM_END) {
+      /* Anything after the end of the zlib stream is ignored. */
+      zlib->avail_in = 0;
+    }
+  }
+
+  /* Hand out whatever is ready without waiting. */
+  do {
+    status = deliver(p, 0, &delivered);
+    if (status != SFPNG_SUCCESS)
+      return status;
+  } while (delivered);
+  return SFPNG_SUCCESS;
+}
+
+sfpng_status pipeline_finish(sfpng_decoder* decoder) {
+  pipeline* p = decoder->pipeline;
+  const int scanline_size = 1 + decoder->stride;
+  if (p->inflated_rows < decoder->height) {
+    int rows = (decoder->zlib_stream.next_out - slot_buf(p, p->dispatched)) /
+               scanline_size;
+    if (rows > 0) {
+      dispatch(p, rows);
+      fill_next_block(p);
+    }
+  }
+  return deliver_all(p);
+}
+
+void pipeline_abort(sfpng_decoder* decoder) {
+  pipeline* p = decoder->pipeline;
+  if (!p)
+    return;
+  pthread_mutex_lock(&p->lock);
+  for (; p->delivered < p->dispatched; ++p->delivered) {
+    block* b = &p->blocks[p->delivered % RING_BLOCKS];
+    while (!b->done)
+      pthread_cond_wait(&p->done_cond, &p->lock);
+  }
+  pthread_mutex_unlock(&p->lock);
+}
+
+void pipeline_free(sfpng_decoder* decoder) {
+  pipeline* p = decoder->pipeline;
+  int i;
+  if (!p)
+    return;
+  if (p->threads) {
+    pthread_mutex_lock(&p->lock);
+    p->stop = 1;
+    pthread_cond_broadcast(&p->work_cond);
+    pthread_mutex_unlock(&p->lock);
+    for (i = 0; i < p->thread_count; ++i)
+      pthread_join(p->threads[i], NULL);
+    pthread_cond_destroy(&p->done_cond);
+    pthread_cond_destroy(&p->work_cond);
+    pthread_mutex_destroy(&p->lock);
+  }
+  decoder_free(decoder, p->threads);
+  decoder_free(decoder, p->ring);
+  decoder_free(decoder, p);
+  decoder->pipeline = NULL;
+}
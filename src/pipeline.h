@@ -0,0 +1,32 @@
+/* Pipelined decoding of non-interlaced images across threads, as set up
+   by sfpng_decoder_set_threads.  The calling thread inflates rows into a
+   ring of blocks; worker threads unfilter each block in turn and convert
+   the unfiltered rows to the output buffer in parallel; and the calling
+   thread then passes the finished blocks to the callbacks in order. */
+typedef struct pipeline pipeline;
+
+/* Whether the image whose data is starting should use the pipeline. */
+int pipeline_wanted(const sfpng_decoder* decoder);
+
+/* The size of the ring pipeline_start would allocate for the current
+   image. */
+uint64_t pipeline_ring_size(const sfpng_decoder* decoder);
+
+/* Get ready to decode the current image, starting the worker threads
+   and allocating the ring if needed. */
+sfpng_status pipeline_start(sfpng_decoder* decoder) SFPNG_WARN_UNUSED_RESULT;
+
+/* Inflate all of decoder->zlib_stream's input, handing out any finished
+   rows along the way. */
+sfpng_status pipeline_write(sfpng_decoder* decoder) SFPNG_WARN_UNUSED_RESULT;
+
+/* Hand out whatever complete rows have been inflated, once the image
+   data has ended. */
+sfpng_status pipeline_finish(sfpng_decoder* decoder) SFPNG_WARN_UNUSED_RESULT;
+
+/* Wait for the workers to finish with the current image and drop any
+   rows not handed out yet.  Does nothing if there's no pipeline. */
+void pipeline_abort(sfpng_decoder* decoder);
+
+/* Stop the worker threads and free the pipeline, if any. */
+void pipeline_free(sfpng_decoder* decoder);
@@ -6,22 +6,24 @@
 
 uint8_t* g_transform_buf = NULL;
 
+static void info_func(sfpng_decoder* decoder) {
+  printf("P3\n");
+  printf("%d %d\n",
+         sfpng_decoder_get_width(decoder),
+         sfpng_decoder_get_height(decoder));
+  printf("255\n");
+
+  /* Every row is converted into the same buffer, and printed from the
+     row callback before the next one arrives. */
+  g_transform_buf = malloc(sfpng_decoder_get_width(decoder) * 4);
+  sfpng_decoder_set_output(decoder, g_transform_buf, 0,
+                           SFPNG_FORMAT_RGBA8888);
+}
+
 static void row_func(sfpng_decoder* decoder,
                      int row,
                      const uint8_t* buf,
                      int len) {
-  if (row == 0) {
-    printf("P3\n");
-    printf("%d %d\n",
-           sfpng_decoder_get_width(decoder),
-           sfpng_decoder_get_height(decoder));
-    printf("255\n");
-
-    g_transform_buf = malloc(sfpng_decoder_get_width(decoder) * 4);
-  }
-
-  sfpng_decoder_transform(decoder, row, buf, g_transform_buf);
-
   int x;
   for (x = 0; x < sfpng_decoder_get_width(decoder) * 4; x += 4) {
     printf("%d %d %d ",
@@ -41,6 +43,7 @@ int main(int argc, char* argv[]) {
   FILE* f = fopen(argv[1], "rb");
 
   sfpng_decoder* decoder = sfpng_decoder_new();
+  sfpng_decoder_set_info_func(decoder, info_func);
   sfpng_decoder_set_row_func(decoder, row_func);
 
   char buf[4096];
@@ -55,6 +58,7 @@ int main(int argc, char* argv[]) {
       break;
   }
   sfpng_decoder_free(decoder);
+  free(g_transform_buf);
 
   return 0;
 }
@@ -0,0 +1,145 @@
+#include "sfpng.h"
+
+#include <string.h>
+
+#include "decoder.h"
+#include "scale.h"
+
+#ifndef min
+#define min(a, b) ((a) < (b) ? (a) : (b))
+#endif
+
+/* Image rows are converted this many pixels at a time, which at any
+   depth starts each piece on a byte. */
+#define PIECE_PIXELS 256
+
+sfpng_status sfpng_decoder_set_output_size(sfpng_decoder* decoder,
+                                           int width, int height) {
+  if (decoder->width == 0 || width < 1 || height < 1 ||
+      width > decoder->width || height > decoder->height) {
+    return SFPNG_ERROR_BAD_ATTRIBUTE;
+  }
+  decoder->scale_width = 0;
+  if (width == decoder->width && height == decoder->height)
+    return SFPNG_SUCCESS;  /* Nothing to scale. */
+
+  /* Keep the sums of premultiplied color over a box within 64 bits. */
+  const uint64_t box_pixels = (uint64_t)(decoder->width / width + 1) *
+                              (decoder->height / height + 1);
+  if (box_pixels > (uint64_t)1 << 40)
+    return SFPNG_ERROR_LIMIT_EXCEEDED;
+
+  const size_t size = (size_t)width * (4 * sizeof(uint64_t) +
+                                       sizeof(uint32_t));
+  if (size > decoder->scale_buf_size) {
+    decoder_free(decoder, decoder->scale_buf);
+    decoder->scale_buf_size = 0;
+    decoder->scale_buf = decoder_alloc(decoder, size);
+    if (!decoder->scale_buf)
+      return SFPNG_ERROR_ALLOC_FAILED;
+    decoder->scale_buf_size = size;
+  }
+  decoder->scale_sums = decoder->scale_buf;
+  decoder->scale_ends = (uint32_t*)(decoder->scale_sums + 4 * width);
+  memset(decoder->scale_sums, 0, 4 * width * sizeof(uint64_t));
+
+  /* Image column x goes to output column x * width / image width, so
+     the box of output column i ends where that reaches i + 1. */
+  int i;
+  for (i = 0; i < width; ++i) {
+    decoder->scale_ends[i] =
+      ((uint64_t)(i + 1) * decoder->width + width - 1) / width;
+  }
+  decoder->scale_rows = 0;
+  decoder->scale_width = width;
+  decoder->scale_height = height;
+  return SFPNG_SUCCESS;
+}
+
+/* Write the averages of the boxes summed so far to output row |row|,
+   and start the sums over. */
+static void emit_row(sfpng_decoder* decoder, int row) {
+  uint8_t* out = decoder->output_buf + row * decoder->output_stride;
+  const int red = decoder->output_format == SFPNG_FORMAT_BGRA8888 ? 2 : 0;
+  const uint64_t* sums = decoder->scale_sums;
+  uint32_t start = 0;
+  int i;
+  for (i = 0; i < decoder->scale_width; ++i) {
+    const uint64_t pixels =
+      (uint64_t)(decoder->scale_ends[i] - start) * decoder->scale_rows;
+    const uint64_t alpha = sums[3];
+    start = decoder->scale_ends[i];
+    /* Color is weighted by alpha, so that the color of transparent
+       pixels doesn't bleed into their neighbors.  Dividing takes most of
+       the time here, so it's done in 32 bits when the sums fit, as they
+       do for any box of up to 65793 pixels. */
+    if (alpha == 0) {
+      out[0] = out[1] = out[2] = out[3] = 0;
+    } else if (pixels <= UINT32_MAX / 256 / 255) {
+      const uint32_t a = alpha;
+      out[red] = ((uint32_t)sums[0] + a / 2) / a;
+      out[1] = ((uint32_t)sums[1] + a / 2) / a;
+      out[2 - red] = ((uint32_t)sums[2] + a / 2) / a;
+      out[3] = (a + (uint32_t)pixels / 2) / (uint32_t)pixels;
+    } else {
+      out[red] = (sums[0] + alpha / 2) / alpha;
+      out[1] = (sums[1] + alpha / 2) / alpha;
+      out[2 - red] = (sums[2] + alpha / 2) / alpha;
+      out[3] = (alpha + pixels / 2) / pixels;
+    }
+    sums += 4;
+    out += 4;
+  }
+  memset(decoder->scale_sums, 0,
+         4 * decoder->scale_width * sizeof(uint64_t));
+  decoder->scale_rows = 0;
+}
+
+void scale_row(sfpng_decoder* decoder, int row, const uint8_t* in) {
+  uint8_t rgba[4 * PIECE_PIXELS];
+  const uint32_t* ends = decoder->scale_ends;
+  int x = 0;
+  int i = 0;
+  while (x < decoder->width) {
+    const int count = min(PIECE_PIXELS, decoder->width - x);
+    decoder->transform_func(decoder,
+                            in + (size_t)x * decoder->pixel_bits / 8,
+                            rgba, count);
+    const uint8_t* p = rgba;
+    const int end = x + count;
+    while (x < end) {
+      /* Sum the run of pixels in this piece that's in column i's box.
+         No run is longer than a piece, so the sums fit in 32 bits. */
+      const int run_end = min(end, (int)ends[i]);
+      uint32_t red = 0, green = 0, blue = 0, alpha = 0;
+      for (; x < run_end; ++x, p += 4) {
+        const uint32_t a = p[3];
+        red += p[0] * a;
+        green += p[1] * a;
+        blue += p[2] * a;
+        alpha += a;
+      }
+      uint64_t* sums = decoder->scale_sums + 4 * i;
+      sums[0] += red;
+      sums[1] += green;
+      sums[2] += blue;
+      sums[3] += alpha;
+      if (x == ends[i])
+        ++i;
+    }
+  }
+  ++decoder->scale_rows;
+
+  /* As with columns, the image row goes to output row
+     row * height / image height, whose box this may be the last of. */
+  const int height = decoder->scale_height;
+  const int out_row = (uint64_t)row * height / decoder->height;
+  const uint32_t out_end =
+    ((uint64_t)(out_row + 1) * decoder->height + height - 1) / height;
+  if (row + 1 == out_end)
+    emit_row(decoder, out_row);
+}
+
+void scale_free(sfpng_decoder* decoder) {
+  decoder_free(decoder, decoder->scale_buf);
+}
@@ -0,0 +1,13 @@
+/* Scaled-down output, as set up by sfpng_decoder_set_output_size.  Each
+   image row is converted to RGBA a few hundred pixels at a time and
+   summed into a box filter's accumulator, which holds a sum per channel
+   for each pixel of one output row.  Once the last image row of an
+   output row's box is in, the averages are written to the output buffer
+   and the sums start over, so the memory needed depends only on the
+   output width.  Rows have to come in order, on the calling thread. */
+
+/* Add image row |row|, in raw format, to the scaled output. */
+void scale_row(sfpng_decoder* decoder, int row, const uint8_t* in);
+
+/* Free the accumulator, if any. */
+void scale_free(sfpng_decoder* decoder);
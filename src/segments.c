@@ -0,0 +1,535 @@
+#include "sfpng.h"
+
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "decoder.h"
+#include "filter.h"
+#include "inflater.h"
+#include "stream.h"
+#include "segments.h"
+#include "transform.h"
+
+/* The image data between two restart points (or the start or end of the
+   data), and what became of it.  |start| and |end| are offsets into the
+   image data; the last segment's end isn't known until the data ends, so
+   until then it's as far as the data could go. */
+typedef struct {
+  int first_row;
+  int full_rows;
+  size_t start;
+  size_t end;
+  int last;
+
+  /* The segment's data so far, in a buffer of its own that grows as the
+     data arrives and is kept for the next image. */
+  uint8_t* buf;
+  size_t buf_size;
+  size_t len;
+
+  /* Set by the worker that decoded it.  A segment that fails in any way
+     is taken to mean that the index doesn't match the data. */
+  int done;
+  sfpng_status status;
+  size_t out_len;
+  uint32_t adler;
+  int stream_end;
+  uint32_t checksum;
+} segment;
+
+/* A worker thread, with an inflater of its own. */
+typedef struct {
+  struct segments* segments;
+  pthread_t thread;
+  inflater* inflater;
+} worker;
+
+struct segments {
+  sfpng_decoder* decoder;
+
+  /* Everything below is protected by |lock|.  work_cond is signalled
+     when there may be new work for the workers (or they should stop),
+     and done_cond when a segment is done. */
+  pthread_mutex_t lock;
+  pthread_cond_t work_cond;
+  pthread_cond_t done_cond;
+  worker* workers;
+  int worker_count;
+  int thread_count;
+  int stop;
+
+  /* The current image's segments.  Those before |dispatched| have all
+     their data, those before |taken| have been picked up by a worker,
+     and those before |delivered| handed out.  |mismatched| is set once
+     a segment fails, after which none are handed out. */
+  segment* segs;
+  int seg_count;
+  int segs_size;
+  int dispatched;
+  int taken;
+  int delivered;
+  int mismatched;
+
+  /* How many bytes of image data have arrived so far. */
+  size_t received;
+
+  /* The whole image's scanlines, each with its filter byte, followed by
+     a row of zeros to stand in for the row before each segment's
+     first. */
+  uint8_t* image;
+  size_t image_size;
+};
+
+static uint8_t* segment_out(const segments* s, const segment* sg) {
+  return s->image + (size_t)sg->first_row * (1 + s->decoder->stride);
+}
+
+/* The most image data there can be for the rows with |restarts| restart
+   points, compressed as badly as any deflate encoder would: fixed Huffman
+   codes take at most nine bits a byte, and each restart a few bytes
+   more. */
+static uint64_t max_data_size(const sfpng_decoder* decoder, int restarts) {
+  const uint64_t raw = (uint64_t)decoder->height * (1 + decoder->stride);
+  return raw + raw / 8 + 16 * ((uint64_t)restarts + 1);
+}
+
+sfpng_status segments_read_index(sfpng_decoder* decoder, stream* src) {
+  const int count = src->len / 8;
+  uint32_t prev_row = 0;
+  uint32_t prev_offset = 0;
+  int i;
+
+  decoder->restart_count = 0;
+  if (src->len % 8 != 0 || count == 0)
+    return SFPNG_SUCCESS;
+
+  /* The segments are decoded into a buffer holding the whole image,
+     which has to fit in the decoded size limit. */
+  const int scanline_size = 1 + decoder->stride;
+  if (!decoder_within_budget(decoder, ((uint64_t)decoder->height + 1) *
+                                      scanline_size)) {
+    return SFPNG_SUCCESS;
+  }
+
+  /* The data before the last restart point is all kept until the end of
+     the image, so the offsets mustn't go past the chunk size limit, nor
+     past all the data there can be. */
+  uint64_t max_offset = max_data_size(decoder, count);
+  if (decoder->max_chunk_size && max_offset > decoder->max_chunk_size)
+    max_offset = decoder->max_chunk_size;
+
+  if (count > decoder->restarts_size) {
+    decoder_free(decoder, decoder->restarts);
+    decoder->restarts_size = 0;
+    decoder->restarts = decoder_alloc(decoder, count * 2 * sizeof(uint32_t));
+    if (!decoder->restarts)
+      return SFPNG_ERROR_ALLOC_FAILED;
+    decoder->restarts_size = count;
+  }
+  for (i = 0; i < count; ++i) {
+    uint32_t row = stream_read_uint32(src);
+    uint32_t offset = stream_read_uint32(src);
+    if (row <= prev_row || row >= decoder->height ||
+        offset <= prev_offset || offset > max_offset) {
+      return SFPNG_SUCCESS;
+    }
+    decoder->restarts[2 * i] = row;
+    decoder->restarts[2 * i + 1] = offset;
+    prev_row = row;
+    prev_offset = offset;
+  }
+  decoder->restart_count = count;
+  return SFPNG_SUCCESS;
+}
+
+int segments_wanted(const sfpng_decoder* decoder) {
+  return decoder->threads > 0 && !decoder->interlaced &&
+    decoder->restart_count > 0;
+}
+
+/* Inflate, unfilter and convert |sg| into the image buffer. */
+static sfpng_status decode_segment(segments* s, worker* w, segment* sg) {
+  const sfpng_decoder* decoder = s->decoder;
+  const int scanline_size = 1 + decoder->stride;
+  uint8_t* out = segment_out(s, sg);
+  z_stream strm;
+  int i;
+
+  strm.next_in = sg->buf;
+  strm.avail_in = sg->len;
+  strm.next_out = out;
+  strm.avail_out = (size_t)sg->full_rows * scanline_size;
+  inflater_reset_segment(w->inflater, sg->first_row == 0,
+                         (decoder->verify & SFPNG_VERIFY_ADLER32) != 0);
+  int zstatus = inflater_run(w->inflater, &strm);
+  if (zstatus != Z_OK && zstatus != Z_STREAM_END)
+    return SFPNG_ERROR_ZLIB_ERROR;
+  sg->stream_end = zstatus == Z_STREAM_END;
+  sg->adler = inflater_adler(w->inflater);
+  sg->checksum = inflater_checksum(w->inflater);
+  sg->out_len = strm.next_out - out;
+
+  /* A segment has to come to exactly its rows, and one before the last
+     has to use up exactly its data without ending the stream.  Anything
+     else means that the index doesn't match the data, or that the data
+     is bad or ended early, which the decoder finds out for itself when
+     it starts over without the index. */
+  if (sg->out_len != (size_t)sg->full_rows * scanline_size ||
+      (!sg->last && (sg->stream_end || strm.avail_in != 0))) {
+    return SFPNG_ERROR_ZLIB_ERROR;
+  }
+
+  const uint8_t* prev = s->image + (size_t)decoder->height * scanline_size;
+  uint8_t* row = out;
+  if (sg->first_row > 0 && row[0] != FILTER_NONE && row[0] != FILTER_SUB)
+    return SFPNG_ERROR_BAD_FILTER;  /* Depends on the previous segment. */
+  for (i = 0; i < sg->full_rows; ++i) {
+    sfpng_status status =
+      filter_reconstruct(row[0], row + 1, prev + 1,
+                         decoder->stride, decoder->bytes_per_pixel);
+    if (status != SFPNG_SUCCESS)
+      return status;
+    prev = row;
+    row += scanline_size;
+  }
+
+  /* Rows that have to be converted in order are left to deliver. */
+  if (transform_output_unordered(decoder)) {
+    transform_output_rows(s->decoder, sg->first_row, sg->full_rows,
+                          out + 1, scanline_size);
+  }
+  return SFPNG_SUCCESS;
+}
+
+static void* worker_main(void* arg) {
+  worker* w = arg;
+  segments* s = w->segments;
+
+  pthread_mutex_lock(&s->lock);
+  while (!s->stop) {
+    if (s->taken < s->dispatched) {
+      segment* sg = &s->segs[s->taken++];
+      pthread_mutex_unlock(&s->lock);
+      sfpng_status status = decode_segment(s, w, sg);
+      pthread_mutex_lock(&s->lock);
+      sg->status = status;
+      sg->done = 1;
+      pthread_cond_broadcast(&s->done_cond);
+      continue;
+    }
+    pthread_cond_wait(&s->work_cond, &s->lock);
+  }
+  pthread_mutex_unlock(&s->lock);
+  return NULL;
+}
+
+static segments* segments_create(sfpng_decoder* decoder) {
+  segments* s = decoder_alloc(decoder, sizeof(*s));
+  int i;
+  if (!s)
+    return NULL;
+  memset(s, 0, sizeof(*s));
+  s->decoder = decoder;
+  decoder->segments = s;
+
+  s->workers = decoder_alloc(decoder, decoder->threads * sizeof(worker));
+  if (!s->workers) {
+    segments_free(decoder);
+    return NULL;
+  }
+  memset(s->workers, 0, decoder->threads * sizeof(worker));
+  s->worker_count = decoder->threads;
+  pthread_mutex_init(&s->lock, NULL);
+  pthread_cond_init(&s->work_cond, NULL);
+  pthread_cond_init(&s->done_cond, NULL);
+  for (i = 0; i < s->worker_count; ++i) {
+    s->workers[i].segments = s;
+    s->workers[i].inflater = decoder_alloc(decoder, inflater_size());
+    if (!s->workers[i].inflater) {
+      segments_free(decoder);
+      return NULL;
+    }
+  }
+  for (; s->thread_count < decoder->threads; ++s->thread_count) {
+    worker* w = &s->workers[s->thread_count];
+    if (pthread_create(&w->thread, NULL, worker_main, w) != 0) {
+      segments_free(decoder);
+      return NULL;
+    }
+  }
+  return s;
+}
+
+/* Make |*buf| hold at least |size| bytes, keeping the first |keep|. */
+static sfpng_status reserve(sfpng_decoder* decoder, uint8_t** buf,
+                            size_t* buf_size, size_t size, size_t keep) {
+  if (size <= *buf_size)
+    return SFPNG_SUCCESS;
+  uint8_t* new_buf = decoder_alloc(decoder, size);
+  if (!new_buf)
+    return SFPNG_ERROR_ALLOC_FAILED;
+  if (keep)
+    memcpy(new_buf, *buf, keep);
+  decoder_free(decoder, *buf);
+  *buf = new_buf;
+  *buf_size = size;
+  return SFPNG_SUCCESS;
+}
+
+sfpng_status segments_start(sfpng_decoder* decoder) {
+  segments* s = decoder->segments;
+  const int scanline_size = 1 + decoder->stride;
+  int i;
+
+  if (s && s->thread_count != decoder->threads) {
+    segments_free(decoder);
+    s = NULL;
+  }
+  if (!s) {
+    s = segments_create(decoder);
+    if (!s)
+      return SFPNG_ERROR_ALLOC_FAILED;
+  }
+
+  const int count = decoder->restart_count + 1;
+  if (count > s->segs_size) {
+    /* The segments' buffers move along with them. */
+    segment* segs = decoder_alloc(decoder, count * sizeof(segment));
+    if (!segs)
+      return SFPNG_ERROR_ALLOC_FAILED;
+    memset(segs, 0, count * sizeof(segment));
+    if (s->segs_size)
+      memcpy(segs, s->segs, s->segs_size * sizeof(segment));
+    decoder_free(decoder, s->segs);
+    s->segs = segs;
+    s->segs_size = count;
+  }
+  for (i = 0; i < count; ++i) {
+    segment* sg = &s->segs[i];
+    uint8_t* buf = sg->buf;
+    const size_t buf_size = sg->buf_size;
+    memset(sg, 0, sizeof(*sg));
+    sg->buf = buf;
+    sg->buf_size = buf_size;
+    sg->first_row = i == 0 ? 0 : decoder->restarts[2 * (i - 1)];
+    sg->full_rows =
+      (i + 1 < count ? decoder->restarts[2 * i] : decoder->height) -
+      sg->first_row;
+    sg->start = i == 0 ? 0 : decoder->restarts[2 * (i - 1) + 1];
+    sg->end = i + 1 < count ? decoder->restarts[2 * i + 1] :
+      (size_t)min(max_data_size(decoder, count - 1), SIZE_MAX);
+    sg->last = i + 1 == count;
+  }
+
+  sfpng_status status = reserve(decoder, &s->image, &s->image_size,
+                                ((size_t)decoder->height + 1) *
+                                scanline_size, 0);
+  if (status != SFPNG_SUCCESS)
+    return status;
+  memset(s->image + (size_t)decoder->height * scanline_size, 0,
+         scanline_size);
+
+  pthread_mutex_lock(&s->lock);
+  s->seg_count = count;
+  s->dispatched = 0;
+  s->taken = 0;
+  s->delivered = 0;
+  s->mismatched = 0;
+  pthread_mutex_unlock(&s->lock);
+  s->received = 0;
+  return SFPNG_SUCCESS;
+}
+
+/* Hand the next segment to the workers with what there is of its data. */
+static void dispatch(segments* s) {
+  pthread_mutex_lock(&s->lock);
+  ++s->dispatched;
+  pthread_cond_broadcast(&s->work_cond);
+  pthread_mutex_unlock(&s->lock);
+}
+
+/* Pass the oldest undelivered segment to the callbacks, waiting for it
+   to be done if |wait| is set.  Returns whether it was; if it failed,
+   sets s->mismatched instead. */
+static int deliver(segments* s, int wait) {
+  sfpng_decoder* decoder = s->decoder;
+  const int scanline_size = 1 + decoder->stride;
+
+  pthread_mutex_lock(&s->lock);
+  segment* sg = &s->segs[s->delivered];
+  if (s->mismatched || s->delivered == s->dispatched ||
+      (!sg->done && !wait)) {
+    pthread_mutex_unlock(&s->lock);
+    return 0;
+  }
+  while (!sg->done)
+    pthread_cond_wait(&s->done_cond, &s->lock);
+  pthread_mutex_unlock(&s->lock);
+  if (sg->status != SFPNG_SUCCESS) {
+    s->mismatched = 1;
+    return 0;
+  }
+
+  /* As in process_image_data_chunk, but a batch at a time. */
+  const uint8_t* out = segment_out(s, sg) + 1;
+  int i, j;
+  for (i = 0; i < sg->full_rows; i += decoder->batch_rows) {
+    const int count = min(decoder->batch_rows, sg->full_rows - i);
+    const int row = sg->first_row + i;
+    const uint8_t* buf = out + (size_t)i * scanline_size;
+    if (decoder->pass_row_func) {
+      for (j = 0; j < count; ++j) {
+        decoder->pass_row_func(decoder, 0, row + j,
+                               buf + j * scanline_size, decoder->stride);
+      }
+    }
+    if (transform_output_unordered(decoder))
+      transform_emit_output_rows(decoder, row, count, buf, scanline_size);
+    else
+      transform_emit_rows(decoder, row, count, buf, scanline_size);
+  }
+  decoder->scanline_row += sg->full_rows;
+  if (decoder->scanline_row == decoder->height)
+    ++decoder->pass;  /* The image is done. */
+
+  pthread_mutex_lock(&s->lock);
+  ++s->delivered;
+  pthread_mutex_unlock(&s->lock);
+  return 1;
+}
+
+sfpng_status segments_write(sfpng_decoder* decoder, stream* src,
+                            int* mismatched) {
+  segments* s = decoder->segments;
+  const size_t image_size =
+    ((size_t)decoder->height + 1) * (1 + decoder->stride);
+
+  *mismatched = 0;
+  if (src->len == 0)
+    return SFPNG_SUCCESS;
+  if (decoder->chunk_state != CHUNK_STATE_IDAT) {
+    /* Past all the metadata, as in process_image_data_chunk, and before
+       any segment is dispatched, so that an output buffer set from the
+       info callback is used for all of them. */
+    transform_select(decoder);
+    if (decoder->info_func)
+      decoder->info_func(decoder);
+    decoder->chunk_state = CHUNK_STATE_IDAT;
+  }
+
+  while (src->len) {
+    /* The data goes to the first segment not yet dispatched, which is
+       dispatched as soon as it has all of its data.  Its buffer grows
+       by doubling, but no further than its end.  Data past the last
+       segment's, or that the decoded size limit has no room for along
+       with the image, isn't kept: the segments are given up on, and the
+       data left in |src| is for the decoder to go on with without them. */
+    segment* sg = &s->segs[s->dispatched];
+    const size_t n = min((size_t)src->len, sg->end - s->received);
+    if (n == 0) {
+      s->mismatched = 1;
+      break;
+    }
+    if (sg->len + n > sg->buf_size) {
+      size_t size = sg->buf_size ? sg->buf_size : 4096;
+      while (size < sg->len + n)
+        size *= 2;
+      size = min(size, sg->end - sg->start);
+      if (!decoder_within_budget(decoder, (uint64_t)image_size +
+                                          s->received - sg->len + size)) {
+        s->mismatched = 1;
+        break;
+      }
+      sfpng_status status =
+        reserve(decoder, &sg->buf, &sg->buf_size, size, sg->len);
+      if (status != SFPNG_SUCCESS)
+        return status;
+    }
+    memcpy(sg->buf + sg->len, src->buf, n);
+    sg->len += n;
+    s->received += n;
+    stream_consume(src, n);
+    if (!sg->last && s->received == sg->end)
+      dispatch(s);
+  }
+
+  /* Hand out whatever is ready without waiting. */
+  while (deliver(s, 0))
+    ;
+  *mismatched = s->mismatched;
+  return SFPNG_SUCCESS;
+}
+
+void segments_finish(sfpng_decoder* decoder, int* mismatched) {
+  segments* s = decoder->segments;
+  int i;
+
+  while (s->dispatched < s->seg_count)
+    dispatch(s);
+  while (deliver(s, 1))
+    ;
+
+  /* The zlib stream's Adler-32 covers all of the segments, so it's
+     checked here rather than by an inflater, if the stream got that
+     far. */
+  const segment* last = &s->segs[s->seg_count - 1];
+  if (!s->mismatched && (decoder->verify & SFPNG_VERIFY_ADLER32) &&
+      last->stream_end) {
+    uint32_t adler = s->segs[0].adler;
+    for (i = 1; i < s->seg_count; ++i)
+      adler = adler32_combine(adler, s->segs[i].adler, s->segs[i].out_len);
+    s->mismatched = adler != last->checksum;
+  }
+  *mismatched = s->mismatched;
+}
+
+int segments_data(const sfpng_decoder* decoder, int i,
+                  const uint8_t** buf, size_t* len) {
+  const segments* s = decoder->segments;
+  if (i >= s->seg_count)
+    return 0;
+  *buf = s->segs[i].buf;
+  *len = s->segs[i].len;
+  return 1;
+}
+
+void segments_abort(sfpng_decoder* decoder) {
+  segments* s = decoder->segments;
+  if (!s)
+    return;
+  pthread_mutex_lock(&s->lock);
+  for (; s->delivered < s->dispatched; ++s->delivered) {
+    while (!s->segs[s->delivered].done)
+      pthread_cond_wait(&s->done_cond, &s->lock);
+  }
+  pthread_mutex_unlock(&s->lock);
+}
+
+void segments_free(sfpng_decoder* decoder) {
+  segments* s = decoder->segments;
+  int i;
+  if (!s)
+    return;
+  if (s->workers) {
+    pthread_mutex_lock(&s->lock);
+    s->stop = 1;
+    pthread_cond_broadcast(&s->work_cond);
+    pthread_mutex_unlock(&s->lock);
+    for (i = 0; i < s->thread_count; ++i)
+      pthread_join(s->workers[i].thread, NULL);
+    pthread_cond_destroy(&s->done_cond);
+    pthread_cond_destroy(&s->work_cond);
+    pthread_mutex_destroy(&s->lock);
+    for (i = 0; i < s->worker_count; ++i)
+      decoder_free(decoder, s->workers[i].inflater);
+  }
+  decoder_free(decoder, s->workers);
+  for (i = 0; i < s->segs_size; ++i)
+    decoder_free(decoder, s->segs[i].buf);
+  decoder_free(decoder, s->segs);
+  decoder_free(decoder, s->image);
+  decoder_free(decoder, s);
+  decoder->segments = NULL;
+}
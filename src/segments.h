@@ -0,0 +1,65 @@
+/* Parallel decoding of non-interlaced images whose image data comes with
+   restart points, as set up by sfpng_decoder_set_threads.
+
+   sfpng's own ancillary chunk sfRS, which must come before the first
+   IDAT, lists the points where an encoder restarted its zlib stream with
+   a full flush, so that the data after each point is a run of complete
+   DEFLATE blocks that refer to nothing before it.  Each entry is eight
+   bytes, both big-endian like the rest of PNG: the row that starts there,
+   and the byte offset of the restart within the concatenated IDAT data.
+   Entries are in increasing order of both.  The row at each restart point
+   must use filter None or Sub, so that it needs nothing of the row
+   before either.
+
+   The segments between restart points are collected as they arrive,
+   each in a buffer that grows with its data, and handed to worker
+   threads, which inflate, unfilter and convert each
+   one on its own into a buffer holding the whole image.  The calling
+   thread passes the finished segments to the callbacks in order, and
+   checks the stream's Adler-32 against the segments' combined.
+
+   Since the index is only a hint, a segment that doesn't decode to just
+   its rows (or, past the first, starts with a row that depends on the
+   one before) stops the handing out, and the decoder then starts over
+   without the segments from the data they kept. */
+typedef struct segments segments;
+
+/* Validate and store the restart points of an sfRS chunk.  An index that
+   doesn't make sense for the image, whose offsets go past the decoder's
+   chunk size limit, or whose image buffer would go past its decoded size
+   limit, is ignored, as it's only a hint. */
+sfpng_status segments_read_index(sfpng_decoder* decoder, stream* src)
+  SFPNG_WARN_UNUSED_RESULT;
+
+/* Whether the image whose data is starting should be decoded by
+   segments. */
+int segments_wanted(const sfpng_decoder* decoder);
+
+/* Get ready to decode the current image, starting the worker threads
+   and allocating the buffers if needed. */
+sfpng_status segments_start(sfpng_decoder* decoder) SFPNG_WARN_UNUSED_RESULT;
+
+/* Take the next piece of image data, handing out any segments that it
+   completes and that have been decoded.  Sets |*mismatched| if one of
+   them turned out not to match the index, or if the data goes past what
+   the segments may keep, leaving what they didn't in |src|. */
+sfpng_status segments_write(sfpng_decoder* decoder, stream* src,
+                            int* mismatched) SFPNG_WARN_UNUSED_RESULT;
+
+/* Decode whatever is left once the image data has ended, and hand out
+   all the rows, or set |*mismatched| as segments_write does, which here
+   includes the segments' Adler-32 not adding up. */
+void segments_finish(sfpng_decoder* decoder, int* mismatched);
+
+/* The image data received so far, in pieces: sets |*buf| and |*len| to
+   the |i|th piece and returns nonzero, or returns zero past the last.
+   Only for after segments_abort, as the workers may be using them. */
+int segments_data(const sfpng_decoder* decoder, int i,
+                  const uint8_t** buf, size_t* len);
+
+/* Wait for the workers to finish with the current image and drop any
+   rows not handed out yet.  Does nothing if there are no workers. */
+void segments_abort(sfpng_decoder* decoder);
+
+/* Stop the worker threads and free everything, if any. */
+void segments_free(sfpng_decoder* decoder);
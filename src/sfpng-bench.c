@@ -0,0 +1,463 @@
+/* Throughput comparison of sfpng and libpng, decoding a corpus of PNGs
+   held in memory over and over in the same process, so that the numbers
+   are about the decoders rather than about files and forks.
+
+   Each image is decoded to its raw rows, as the dumpers do, or with
+   --rgba to 8-bit RGBA, into a buffer for the whole image.  The results
+   are broken down by color type and bit depth, and if sfpng was built
+   with SFPNG_STATS, sfpng's time is broken down by phase too.  "make
+   bench" runs it on a corpus of large images from
+   testsuite/make_bench_pngs.py. */
+
+#include <libpng/png.h>
+#include <setjmp.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+
+#include "sfpng.h"
+
+#include "dumper.h"
+
+typedef struct {
+  const char* filename;
+  uint8_t* data;
+  size_t len;
+
+  /* From the IHDR chunk. */
+  int width;
+  int height;
+  int depth;
+  int color_type;
+  int interlaced;
+
+  /* The decoded image: stride bytes per row, as decoded by each. */
+  size_t stride;
+  uint8_t* sfpng_out;
+  uint8_t* libpng_out;
+} bench_image;
+
+/* How the decoders are run. */
+typedef struct {
+  int rgba;
+  int threads;
+  int builtin_inflate;
+} bench_options;
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* The process's peak resident set size so far, in megabytes. */
+static double peak_rss_mb(void) {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_maxrss / 1024.0;  /* Linux reports kilobytes. */
+}
+
+static uint32_t load_be32(const uint8_t* p) {
+  return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 |
+         (uint32_t)p[2] << 8 | p[3];
+}
+
+/* Read |filename| into |im|, and its header from the IHDR chunk that has
+   to come first.  Returns zero on success. */
+static int load_image(const char* filename, bench_image* im) {
+  static const uint8_t signature[8] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+  char buf[1 << 16];
+  size_t len;
+
+  memset(im, 0, sizeof(*im));
+  im->filename = filename;
+  FILE* f = fopen(filename, "rb");
+  if (!f) {
+    perror(filename);
+    return 1;
+  }
+  while ((len = fread(buf, 1, sizeof(buf), f)) > 0) {
+    im->data = realloc(im->data, im->len + len);
+    memcpy(im->data + im->len, buf, len);
+    im->len += len;
+  }
+  fclose(f);
+
+  if (im->len < 8 + 8 + 13 || memcmp(im->data, signature, 8) != 0 ||
+      memcmp(im->data + 12, "IHDR", 4) != 0) {
+    return 1;
+  }
+  const uint8_t* ihdr = im->data + 16;
+  im->width = load_be32(ihdr);
+  im->height = load_be32(ihdr + 4);
+  im->depth = ihdr[8];
+  im->color_type = ihdr[9];
+  im->interlaced = ihdr[12];
+  if (im->width <= 0 || im->height <= 0 || im->color_type > 6 ||
+      !dumper_color_type_names[im->color_type]) {
+    return 1;
+  }
+  return 0;
+}
+
+static void bench_info_func(sfpng_decoder* decoder) {
+  bench_image* im = sfpng_decoder_get_context(decoder);
+  sfpng_decoder_set_output(decoder, im->sfpng_out, im->stride,
+                           SFPNG_FORMAT_RGBA8888);
+}
+
+static void bench_row_func(sfpng_decoder* decoder,
+                           int row,
+                           const uint8_t* buf,
+                           int len) {
+  bench_image* im = sfpng_decoder_get_context(decoder);
+  memcpy(im->sfpng_out + row * im->stride, buf, len);
+}
+
+/* Decode |im| with |decoder|.  Returns zero on success. */
+static int decode_sfpng(sfpng_decoder* decoder, const bench_options* opts,
+                        bench_image* im) {
+  sfpng_decoder_reset(decoder);
+  sfpng_decoder_set_context(decoder, im);
+  if (opts->rgba) {
+    sfpng_decoder_set_info_func(decoder, bench_info_func);
+    sfpng_decoder_set_row_func(decoder, NULL);
+  } else {
+    sfpng_decoder_set_info_func(decoder, NULL);
+    sfpng_decoder_set_row_func(decoder, bench_row_func);
+  }
+  if (sfpng_decoder_write(decoder, im->data, im->len) != SFPNG_SUCCESS ||
+      sfpng_decoder_write(decoder, NULL, 0) != SFPNG_SUCCESS) {
+    return 1;
+  }
+  return 0;
+}
+
+typedef struct {
+  const bench_image* im;
+  size_t pos;
+} libpng_reader;
+
+static void libpng_read_func(png_structp png, png_bytep buf, png_size_t len) {
+  libpng_reader* r = png_get_io_ptr(png);
+  if (len > r->im->len - r->pos)
+    png_error(png, "read past end");
+  memcpy(buf, r->im->data + r->pos, len);
+  r->pos += len;
+}
+
+static void libpng_warning_func(png_structp png, png_const_charp msg) {
+  /* Ignore. */
+}
+
+static void libpng_error_func(png_structp png, png_const_charp msg) {
+  longjmp(png_jmpbuf(png), 1);
+}
+
+/* Decode |im| with libpng.  |rows| has room for a pointer to each row.
+   Returns zero on success. */
+static int decode_libpng(const bench_options* opts, bench_image* im,
+                         png_bytep* rows) {
+  libpng_reader reader = { im, 0 };
+  png_infop info = NULL;
+  int y;
+
+  png_structp png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL,
+                                           libpng_error_func,
+                                           libpng_warning_func);
+  if (!png)
+    return 1;
+  if (setjmp(png_jmpbuf(png))) {
+    png_destroy_read_struct(&png, &info, NULL);
+    return 1;
+  }
+  info = png_create_info_struct(png);
+  png_set_read_fn(png, &reader, libpng_read_func);
+  png_read_info(png, info);
+  if (opts->rgba) {
+    png_set_expand(png);
+    png_set_strip_16(png);
+    png_set_gray_to_rgb(png);
+    png_set_add_alpha(png, 0xff, PNG_FILLER_AFTER);
+  }
+  png_set_interlace_handling(png);
+  png_read_update_info(png, info);
+  for (y = 0; y < im->height; ++y)
+    rows[y] = im->libpng_out + y * im->stride;
+  png_read_image(png, rows);
+  png_read_end(png, NULL);
+  png_destroy_read_struct(&png, &info, NULL);
+  return 0;
+}
+
+/* Timings of one decoder on one group of images. */
+typedef struct {
+  double* latencies;
+  int count;
+  double seconds;
+  double bytes;
+  double pixels;
+} timing;
+
+/* The images of one color type and depth, or all of them. */
+typedef struct {
+  int color_type;
+  int depth;
+  timing sfpng;
+  timing libpng;
+} group;
+
+static int compare_doubles(const void* a, const void* b) {
+  const double x = *(const double*)a, y = *(const double*)b;
+  return x < y ? -1 : x > y;
+}
+
+/* The |p|th percentile of the sorted |values|, by nearest rank. */
+static double percentile(const double* values, int count, int p) {
+  int rank = (count * p + 99) / 100;
+  return values[rank > 0 ? rank - 1 : 0];
+}
+
+static void add_timing(timing* t, const bench_image* im, double seconds) {
+  t->latencies[t->count++] = seconds;
+  t->seconds += seconds;
+  t->bytes += im->len;
+  t->pixels += (double)im->width * im->height;
+}
+
+static void print_timing(const char* name, timing* t) {
+  if (t->count == 0)
+    return;
+  qsort(t->latencies, t->count, sizeof(double), compare_doubles);
+  printf("  %-7s %8.1f MB/s %8.1f Mpx/s   "
+         "p50 %8.3f  p90 %8.3f  p99 %8.3f ms\n",
+         name, t->bytes / t->seconds / 1e6, t->pixels / t->seconds / 1e6,
+         percentile(t->latencies, t->count, 50) * 1e3,
+         percentile(t->latencies, t->count, 90) * 1e3,
+         percentile(t->latencies, t->count, 99) * 1e3);
+}
+
+/* Print where sfpng's time in the timed runs went, per phase. */
+static void print_phase(const char* name, uint64_t bytes, uint64_t ns,
+                        double total_ns) {
+  printf("  %-9s %8.1f MB %8.1f ms %5.1f%% %8.1f MB/s\n",
+         name, bytes / 1e6, ns / 1e6, 100 * ns / total_ns,
+         ns ? bytes * 1e3 / ns : 0.0);
+}
+static void print_stats(const sfpng_stats* st, double seconds) {
+  static const char* filter_names[] = {
+    "none", "sub", "up", "average", "paeth"
+  };
+  const double total_ns = seconds * 1e9;
+  int f;
+  printf("sfpng phases, of %.1f ms decoding:\n", total_ns / 1e6);
+  print_phase("chunks", st->chunk_bytes, st->chunk_ns, total_ns);
+  print_phase("crc", st->crc_bytes, st->crc_ns, total_ns);
+  print_phase("inflate", st->inflate_out_bytes, st->inflate_ns, total_ns);
+  for (f = 0; f < 5; ++f) {
+    if (st->filter_rows[f])
+      print_phase(filter_names[f], st->filter_bytes[f], st->filter_ns[f],
+                  total_ns);
+  }
+  printf("  %-9s %8llu rows %6.1f ms %5.1f%%\n", "transform",
+         (unsigned long long)st->transform_rows, st->transform_ns / 1e6,
+         100 * st->transform_ns / total_ns);
+  printf("  %llu inflate calls taking %.1f MB; rows by filter:",
+         (unsigned long long)st->inflate_calls, st->inflate_in_bytes / 1e6);
+  for (f = 0; f < 5; ++f)
+    printf(" %llu", (unsigned long long)st->filter_rows[f]);
+  printf("\n  %llu allocations of %.1f MB; peak chunk buffer %llu, "
+         "row buffer %llu, image buffer %llu\n",
+         (unsigned long long)st->alloc_calls, st->alloc_bytes / 1e6,
+         (unsigned long long)st->peak_chunk_buf,
+         (unsigned long long)st->peak_row_buf,
+         (unsigned long long)st->peak_image_buf);
+}
+
+static void usage(const char* argv0) {
+  fprintf(stderr,
+          "usage: %s [--iterations n] [--rgba] [--threads n] "
+          "[--builtin-inflate]\n"
+          "       [--only sfpng|libpng] pngfile...\n", argv0);
+}
+
+int main(int argc, char* argv[]) {
+  bench_options opts = { 0, 0, 0 };
+  int iterations = 10;
+  const char* only = NULL;
+  int i, j, k;
+
+  for (i = 1; i < argc && argv[i][0] == '-'; ++i) {
+    if (strcmp(argv[i], "--iterations") == 0 && i + 1 < argc) {
+      iterations = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--rgba") == 0) {
+      opts.rgba = 1;
+    } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+      opts.threads = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--builtin-inflate") == 0) {
+      opts.builtin_inflate = 1;
+    } else if (strcmp(argv[i], "--only") == 0 && i + 1 < argc) {
+      only = argv[++i];
+    } else {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (i == argc || iterations < 1 ||
+      (only && strcmp(only, "sfpng") != 0 && strcmp(only, "libpng") != 0)) {
+    usage(argv[0]);
+    return 1;
+  }
+  const int run_sfpng = !only || strcmp(only, "sfpng") == 0;
+  const int run_libpng = !only || strcmp(only, "libpng") == 0;
+
+  /* Load the corpus, then decode each image once with each decoder,
+     both to drop those that don't decode and to warm up. */
+  bench_image* images = calloc(argc - i, sizeof(bench_image));
+  int max_height = 0;
+  int image_count = 0;
+  for (; i < argc; ++i) {
+    bench_image* im = &images[image_count];
+    if (load_image(argv[i], im) != 0) {
+      fprintf(stderr, "%s: not a PNG, skipped\n", argv[i]);
+      free(im->data);
+      continue;
+    }
+    static const int channels[] = { 1, 0, 3, 1, 2, 0, 4 };
+    im->stride = opts.rgba ? (size_t)im->width * 4 :
+      ((size_t)im->width * channels[im->color_type] * im->depth + 7) / 8;
+    if (im->height > max_height)
+      max_height = im->height;
+    ++image_count;
+  }
+  const double corpus_rss = peak_rss_mb();
+
+  sfpng_decoder* decoder = sfpng_decoder_new();
+  sfpng_decoder_set_threads(decoder, opts.threads);
+  sfpng_decoder_set_builtin_inflate(decoder, opts.builtin_inflate);
+  png_bytep* rows = calloc(max_height, sizeof(png_bytep));
+  int differ = 0;
+  for (i = j = 0; i < image_count; ++i) {
+    bench_image* im = &images[i];
+    im->sfpng_out = calloc(im->height, im->stride);
+    im->libpng_out = calloc(im->height, im->stride);
+    if (!im->sfpng_out || !im->libpng_out ||
+        (run_sfpng && decode_sfpng(decoder, &opts, im) != 0) ||
+        (run_libpng && decode_libpng(&opts, im, rows) != 0)) {
+      fprintf(stderr, "%s: failed to decode, skipped\n", im->filename);
+      free(im->data);
+      free(im->sfpng_out);
+      free(im->libpng_out);
+      continue;
+    }
+    if (run_sfpng && run_libpng &&
+        memcmp(im->sfpng_out, im->libpng_out,
+               (size_t)im->height * im->stride) != 0) {
+      fprintf(stderr, "%s: decoded images differ\n", im->filename);
+      differ = 1;
+    }
+    images[j++] = *im;
+  }
+  image_count = j;
+  if (image_count == 0) {
+    fprintf(stderr, "no images to decode\n");
+    return 1;
+  }
+
+  /* Group the images by color type and depth, after a group for all. */
+  group* groups = calloc(image_count + 1, sizeof(group));
+  int* image_group = calloc(image_count, sizeof(int));
+  int group_count = 1;
+  groups[0].color_type = -1;
+  for (j = 0; j < image_count; ++j) {
+    const bench_image* im = &images[j];
+    for (k = 1; k < group_count; ++k) {
+      if (groups[k].color_type == im->color_type &&
+          groups[k].depth == im->depth) {
+        break;
+      }
+    }
+    if (k == group_count) {
+      groups[k].color_type = im->color_type;
+      groups[k].depth = im->depth;
+      ++group_count;
+    }
+    image_group[j] = k;
+  }
+  for (k = 0; k < group_count; ++k) {
+    groups[k].sfpng.latencies = calloc(image_count * iterations,
+                                       sizeof(double));
+    groups[k].libpng.latencies = calloc(image_count * iterations,
+                                        sizeof(double));
+  }
+
+  /* Time each decoder over the whole corpus in turn. */
+  if (run_sfpng) {
+    sfpng_decoder_clear_stats(decoder);
+    for (i = 0; i < iterations; ++i) {
+      for (j = 0; j < image_count; ++j) {
+        const double start = now();
+        decode_sfpng(decoder, &opts, &images[j]);
+        const double seconds = now() - start;
+        add_timing(&groups[0].sfpng, &images[j], seconds);
+        add_timing(&groups[image_group[j]].sfpng, &images[j], seconds);
+      }
+    }
+  }
+  if (run_libpng) {
+    for (i = 0; i < iterations; ++i) {
+      for (j = 0; j < image_count; ++j) {
+        const double start = now();
+        decode_libpng(&opts, &images[j], rows);
+        const double seconds = now() - start;
+        add_timing(&groups[0].libpng, &images[j], seconds);
+        add_timing(&groups[image_group[j]].libpng, &images[j], seconds);
+      }
+    }
+  }
+
+  printf("%d images, %d iterations, decoding to %s%s; "
+         "MB/s is of PNG data\n", image_count, iterations,
+         opts.rgba ? "RGBA" : "raw rows", opts.threads ? " with threads" : "");
+  for (k = 0; k < group_count; ++k) {
+    if (k == 0) {
+      printf("all:\n");
+    } else {
+      printf("%s, depth %d:\n",
+             dumper_color_type_names[groups[k].color_type],
+             groups[k].depth);
+    }
+    print_timing("sfpng", &groups[k].sfpng);
+    print_timing("libpng", &groups[k].libpng);
+    if (groups[k].sfpng.count && groups[k].libpng.count) {
+      printf("  sfpng/libpng speed %.2fx\n",
+             groups[k].libpng.seconds / groups[k].sfpng.seconds);
+    }
+  }
+  sfpng_stats stats;
+  if (run_sfpng && sfpng_decoder_get_stats(decoder, &stats))
+    print_stats(&stats, groups[0].sfpng.seconds);
+  /* Peak RSS only ever grows, so that of a decoder on its own takes a
+     run with --only. */
+  printf("peak RSS: %.1f MB with the corpus loaded, %.1f MB in all\n",
+         corpus_rss, peak_rss_mb());
+
+  sfpng_decoder_free(decoder);
+  for (j = 0; j < image_count; ++j) {
+    free(images[j].data);
+    free(images[j].sfpng_out);
+    free(images[j].libpng_out);
+  }
+  for (k = 0; k < group_count; ++k) {
+    free(groups[k].sfpng.latencies);
+    free(groups[k].libpng.latencies);
+  }
+  free(groups);
+  free(image_group);
+  free(images);
+  free(rows);
+  return differ;
+}
@@ -17,10 +17,24 @@ typedef struct _comment {
   struct _comment* next;
 } comment;
 
+/* The image header as seen from the info callback, to check that probing
+   finds the same one as a full decode. */
 typedef struct {
+  int valid;
+  int width, height, depth, color_type, interlaced, palette_entries;
+} header;
+
+typedef struct {
+  int probe;
+  header* probed;
+  int batch_rows;
+
   int transform;
   uint8_t* transform_buf;
 
+  /* The raw rows dumped so far. */
+  int rows;
+
   comment* comments;
 } decode_context;
 
@@ -67,32 +81,56 @@ static void raw_row_func(sfpng_decoder* decoder,
   if (row == 0)
     printf("raw data bytes:\n");
   dump_row(row, buf, len);
+  ++context->rows;
 }
 
-static void transform_row_func(sfpng_decoder* decoder,
-                               int row,
-                               const uint8_t* buf,
-                               int len) {
-  decode_context* context = (decode_context*)sfpng_decoder_get_context(decoder);
-  sfpng_decoder_transform(decoder, row, buf, context->transform_buf);
+static void get_header(sfpng_decoder* decoder, header* h) {
+  h->valid = 1;
+  h->width = sfpng_decoder_get_width(decoder);
+  h->height = sfpng_decoder_get_height(decoder);
+  h->depth = sfpng_decoder_get_depth(decoder);
+  h->color_type = sfpng_decoder_get_color_type(decoder);
+  h->interlaced = sfpng_decoder_get_interlaced(decoder);
+  h->palette_entries = sfpng_decoder_get_palette_entries(decoder);
+}
+
+static void raw_rows_func(sfpng_decoder* decoder,
+                          int row,
+                          int count,
+                          const uint8_t* buf,
+                          ptrdiff_t stride,
+                          int len) {
+  int i;
+  for (i = 0; i < count; ++i)
+    raw_row_func(decoder, row + i, buf + i * stride, len);
 }
 
 static void info_func(sfpng_decoder* decoder) {
   decode_context* context = (decode_context*)sfpng_decoder_get_context(decoder);
 
+  if (context->probe) {
+    get_header(decoder, context->probed);
+    return;
+  }
+  if (context->probed && context->probed->valid) {
+    header h;
+    get_header(decoder, &h);
+    if (memcmp(&h, context->probed, sizeof(h)) != 0)
+      printf("probe found a different header\n");
+  }
+
   if (context->transform) {
-    if (sfpng_decoder_get_interlaced(decoder))
-      return;
     int transform_len =
       sfpng_decoder_get_width(decoder) * sfpng_decoder_get_height(decoder) * 4;
     context->transform_buf = malloc(transform_len);
-    int depth = sfpng_decoder_get_depth(decoder);
-    sfpng_decoder_set_row_func(decoder, transform_row_func);
+    sfpng_decoder_set_row_func(decoder, NULL);
+    sfpng_decoder_set_output(decoder, context->transform_buf,
+                             sfpng_decoder_get_width(decoder) * 4,
+                             SFPNG_FORMAT_RGBA8888);
   } else {
     dump_attrs(decoder);
-    if (sfpng_decoder_get_interlaced(decoder))
-      return;
-    sfpng_decoder_set_row_func(decoder, raw_row_func);
+    if (!context->batch_rows)
+      sfpng_decoder_set_row_func(decoder, raw_row_func);
   }
 }
 
@@ -131,7 +169,13 @@ static void unknown_chunk(sfpng_decoder* decoder,
   printf("\n");
 }
 
-static int dump_file(const char* filename, int transform) {
+/* Decode |filename|, dumping its pixels either raw or, with |transform|,
+   as RGBA.  With |probe| set it only probes the header into |probed|,
+   and otherwise the header is checked against |probed|.  Raw pixels come
+   from the batched row callback if |batch_rows| is set. */
+static int dump_file(sfpng_decoder* decoder, const char* filename,
+                     int probe, header* probed, int batch_rows,
+                     int transform) {
   int ret = 1;
   FILE* f = fopen(filename, "rb");
   if (!f) {
@@ -140,9 +184,17 @@ static int dump_file(const char* filename, int transform) {
   }
 
   decode_context context = {0};
+  context.probe = probe;
+  context.probed = probed;
+  context.batch_rows = batch_rows;
   context.transform = transform;
 
-  sfpng_decoder* decoder = sfpng_decoder_new();
+  sfpng_decoder_reset(decoder);
+  sfpng_decoder_set_probe(decoder, probe);
+  if (batch_rows && !probe && !transform)
+    sfpng_decoder_set_rows_func(decoder, raw_rows_func, batch_rows);
+  else
+    sfpng_decoder_set_rows_func(decoder, NULL, 0);
   sfpng_decoder_set_context(decoder, &context);
   sfpng_decoder_set_info_func(decoder, info_func);
   sfpng_decoder_set_text_func(decoder, text_func);
@@ -153,13 +205,17 @@ static int dump_file(const char* filename, int transform) {
   while ((len = fread(buf, 1, sizeof(buf), f)) >= 0) {
     sfpng_status status = sfpng_decoder_write(decoder, buf, len);
     if (status != SFPNG_SUCCESS) {
-      if (status == SFPNG_ERROR_ALLOC_FAILED)
+      if (probe)
+        ;  /* The full decode reports it. */
+      else if (status == SFPNG_ERROR_ALLOC_FAILED)
         printf("alloc failed\n");
-      else if (status == SFPNG_ERROR_BAD_FILTER &&
-               sfpng_decoder_get_interlaced(decoder))
-        /* XXX ignore unimpl interlaced bits for now */;
       else
         printf("invalid image\n");
+      /* As libpng-dumper, which reads such images a row at a time. */
+      if (!probe && !transform && sfpng_decoder_get_width(decoder) &&
+          !sfpng_decoder_get_interlaced(decoder)) {
+        printf("rows before the error: %d\n", context.rows);
+      }
       goto out;
     }
     if (len == 0)
@@ -187,7 +243,6 @@ static int dump_file(const char* filename, int transform) {
   ret = 0;
 
  out:
-  sfpng_decoder_free(decoder);
   if (context.transform_buf)
     free(context.transform_buf);
 
@@ -202,16 +257,463 @@ static int dump_file(const char* filename, int transform) {
   return ret;
 }
 
+/* A decoded image's header and raw rows, collected quietly to check a
+   round trip through the encoder or batched rows, how many rows came
+   out, and the status decoding ended with. */
+typedef struct {
+  header h;
+  uint8_t palette[3 * 256];
+  int stride;
+  uint8_t* rows;
+  int row_count;
+  sfpng_status status;
+} image;
+
+static void image_info_func(sfpng_decoder* decoder) {
+  image* im = (image*)sfpng_decoder_get_context(decoder);
+  get_header(decoder, &im->h);
+  if (im->h.palette_entries) {
+    memcpy(im->palette, sfpng_decoder_get_palette(decoder),
+           3 * im->h.palette_entries);
+  }
+  im->stride = (im->h.width * im->h.depth *
+                (im->h.color_type == SFPNG_COLOR_TRUECOLOR ? 3 :
+                 im->h.color_type == SFPNG_COLOR_GRAYSCALE_ALPHA ? 2 :
+                 im->h.color_type == SFPNG_COLOR_TRUECOLOR_ALPHA ? 4 : 1) +
+                7) / 8;
+  im->rows = calloc(im->h.height, im->stride);
+}
+
+static void image_row_func(sfpng_decoder* decoder,
+                           int row,
+                           const uint8_t* buf,
+                           int len) {
+  image* im = (image*)sfpng_decoder_get_context(decoder);
+  memcpy(im->rows + (size_t)row * im->stride, buf, len);
+  ++im->row_count;
+}
+
+static void image_rows_func(sfpng_decoder* decoder,
+                            int row,
+                            int count,
+                            const uint8_t* buf,
+                            ptrdiff_t stride,
+                            int len) {
+  int i;
+  for (i = 0; i < count; ++i)
+    image_row_func(decoder, row + i, buf + i * stride, len);
+}
+
+/* Decode the |len| bytes of PNG in |buf| into |im|, with rows passed in
+   batches of |batch_rows| if set, returning zero on success.  Any rows
+   that came out are kept even if not. */
+static int decode_image(sfpng_decoder* decoder, const uint8_t* buf,
+                        size_t len, int batch_rows, image* im) {
+  memset(im, 0, sizeof(*im));
+  sfpng_decoder_reset(decoder);
+  sfpng_decoder_set_probe(decoder, 0);
+  sfpng_decoder_set_rows_func(decoder, batch_rows ? image_rows_func : NULL,
+                              batch_rows);
+  sfpng_decoder_set_context(decoder, im);
+  sfpng_decoder_set_info_func(decoder, image_info_func);
+  sfpng_decoder_set_row_func(decoder, batch_rows ? NULL : image_row_func);
+  sfpng_decoder_set_text_func(decoder, NULL);
+  sfpng_decoder_set_unknown_chunk_func(decoder, NULL);
+  im->status = sfpng_decoder_write(decoder, buf, len);
+  if (im->status == SFPNG_SUCCESS)
+    im->status = sfpng_decoder_write(decoder, buf, 0);
+  if (im->status != SFPNG_SUCCESS || !im->rows)
+    return 1;
+  return 0;
+}
+
+typedef struct {
+  uint8_t* buf;
+  size_t len;
+  size_t size;
+} memory;
+
+static void memory_write_func(sfpng_encoder* encoder,
+                              const uint8_t* buf,
+                              int len) {
+  memory* m = (memory*)sfpng_encoder_get_context(encoder);
+  if (m->len + len > m->size) {
+    m->size = (m->len + len) * 2;
+    m->buf = realloc(m->buf, m->size);
+  }
+  memcpy(m->buf + m->len, buf, len);
+  m->len += len;
+}
+
+/* Read all of |filename| into |file|, returning zero on success. */
+static int read_file(const char* filename, memory* file) {
+  char buf[4096];
+  size_t len;
+
+  FILE* f = fopen(filename, "rb");
+  if (!f)
+    return 1;
+  while ((len = fread(buf, 1, sizeof(buf), f)) > 0) {
+    file->buf = realloc(file->buf, file->len + len);
+    memcpy(file->buf + file->len, buf, len);
+    file->len += len;
+  }
+  fclose(f);
+  return 0;
+}
+
+/* Encode what |filename| decodes to with |encoder| and check that it
+   decodes to the same again.  Says so if not, and otherwise prints
+   nothing, so that the output still matches libpng's. */
+static void check_reencode(sfpng_decoder* decoder, sfpng_encoder* encoder,
+                           const char* filename) {
+  memory file = {0}, encoded = {0};
+  image original, reencoded;
+
+  if (read_file(filename, &file) != 0)
+    return;
+  if (decode_image(decoder, file.buf, file.len, 0, &original) != 0)
+    goto out;  /* The full decode reports it. */
+
+  sfpng_encoder_reset(encoder);
+  sfpng_encoder_set_context(encoder, &encoded);
+  sfpng_encoder_set_write_func(encoder, memory_write_func);
+  const header* h = &original.h;
+  if (sfpng_encoder_set_header(encoder, h->width, h->height, h->depth,
+                               h->color_type, h->interlaced) != SFPNG_SUCCESS ||
+      (h->palette_entries &&
+       sfpng_encoder_set_palette(encoder, original.palette,
+                                 h->palette_entries, NULL, 0) !=
+       SFPNG_SUCCESS) ||
+      sfpng_encoder_write_rows(encoder, original.rows, original.stride,
+                               h->height + 1) != SFPNG_ERROR_BAD_ATTRIBUTE ||
+      sfpng_encoder_write_rows(encoder, original.rows, original.stride,
+                               -1) != SFPNG_ERROR_BAD_ATTRIBUTE ||
+      encoded.len != 0 ||
+      sfpng_encoder_write_rows(encoder, original.rows, original.stride,
+                               h->height) != SFPNG_SUCCESS) {
+    printf("reencoding failed\n");
+    goto out;
+  }
+
+  if (decode_image(decoder, encoded.buf, encoded.len, 0, &reencoded) != 0 ||
+      memcmp(&original.h, &reencoded.h, sizeof(header)) != 0 ||
+      memcmp(original.palette, reencoded.palette, sizeof(original.palette)) ||
+      memcmp(original.rows, reencoded.rows,
+             (size_t)h->height * original.stride) != 0) {
+    printf("reencoded image differs\n");
+  }
+  free(reencoded.rows);
+
+ out:
+  free(original.rows);
+  free(encoded.buf);
+  free(file.buf);
+}
+
+/* Check that |filename| decoded with rows in batches of |batch_rows|
+   and with |threads| gets the same rows and status as one at a time on
+   the calling thread, including when it's invalid, as then only some of
+   them come out.  Says so if not, and returns nonzero, as the output
+   isn't compared with libpng's for an invalid image. */
+static int check_rows(sfpng_decoder* decoder, const char* filename,
+                      int batch_rows, int threads) {
+  memory file = {0};
+  image single, batched;
+  int ret = 0;
+
+  if (read_file(filename, &file) != 0)
+    return 0;
+  sfpng_decoder_set_threads(decoder, 0);
+  decode_image(decoder, file.buf, file.len, 0, &single);
+  sfpng_decoder_set_threads(decoder, threads);
+  decode_image(decoder, file.buf, file.len, batch_rows, &batched);
+  /* Batches and threads take more memory, and so can go over the
+     decoded size limit where rows one at a time don't. */
+  if (batched.status != SFPNG_ERROR_LIMIT_EXCEEDED &&
+      (single.row_count != batched.row_count ||
+       single.status != batched.status ||
+       (single.rows && batched.rows &&
+        memcmp(single.rows, batched.rows,
+               (size_t)single.h.height * single.stride) != 0))) {
+    printf("rows differ: %d rows and status %d, not %d and %d\n",
+           batched.row_count, batched.status,
+           single.row_count, single.status);
+    ret = 1;
+  }
+  free(single.rows);
+  free(batched.rows);
+  free(file.buf);
+  return ret;
+}
+
+/* An image decoded to RGBA, shrunk by a factor of |scale| each way,
+   and what it should come out as if the image says, in hex. */
+typedef struct {
+  int scale;
+  int width, height;
+  uint8_t* pixels;
+  char* expected;
+  int expected_len;
+} rgba_image;
+
+/* Test images can give their scaled-down pixels, worked out on their
+   own, in a text chunk keyed "sfpng scaled" and the factor. */
+static void rgba_text_func(sfpng_decoder* decoder,
+                           const char* keyword,
+                           const uint8_t* text,
+                           int text_len) {
+  rgba_image* im = (rgba_image*)sfpng_decoder_get_context(decoder);
+  char key[32];
+  snprintf(key, sizeof(key), "sfpng scaled %d", im->scale);
+  if (strcmp(keyword, key) == 0 && !im->expected) {
+    im->expected = malloc(text_len + 1);
+    memcpy(im->expected, text, text_len);
+    im->expected[text_len] = '\0';
+    im->expected_len = text_len;
+  }
+}
+
+static void rgba_info_func(sfpng_decoder* decoder) {
+  rgba_image* im = (rgba_image*)sfpng_decoder_get_context(decoder);
+  im->width = (sfpng_decoder_get_width(decoder) + im->scale - 1) / im->scale;
+  im->height =
+    (sfpng_decoder_get_height(decoder) + im->scale - 1) / im->scale;
+  im->pixels = calloc(im->height, im->width * 4);
+  sfpng_decoder_set_output(decoder, im->pixels, im->width * 4,
+                           SFPNG_FORMAT_RGBA8888);
+  if (sfpng_decoder_set_output_size(decoder, im->width, im->height) !=
+      SFPNG_SUCCESS) {
+    printf("setting the output size failed\n");
+  }
+}
+
+/* Decode |file| into |im|, returning zero on success. */
+static int decode_rgba(sfpng_decoder* decoder, const memory* file,
+                       rgba_image* im) {
+  sfpng_decoder_reset(decoder);
+  sfpng_decoder_set_probe(decoder, 0);
+  sfpng_decoder_set_rows_func(decoder, NULL, 0);
+  sfpng_decoder_set_context(decoder, im);
+  sfpng_decoder_set_info_func(decoder, rgba_info_func);
+  sfpng_decoder_set_row_func(decoder, NULL);
+  sfpng_decoder_set_text_func(decoder, rgba_text_func);
+  sfpng_decoder_set_unknown_chunk_func(decoder, NULL);
+  if (sfpng_decoder_write(decoder, file->buf, file->len) != SFPNG_SUCCESS ||
+      sfpng_decoder_write(decoder, file->buf, 0) != SFPNG_SUCCESS ||
+      !im->pixels) {
+    return 1;
+  }
+  return 0;
+}
+
+/* Check that |filename| decoded with a scaled output comes out as the
+   full image does when box-filtered the slow way, weighting color by
+   alpha, and as the image says it should if it does.  Prints nothing if
+   so, as check_reencode. */
+static void check_scale(sfpng_decoder* decoder, const char* filename,
+                        int scale) {
+  memory file = {0};
+  rgba_image full = { 1 }, scaled = { scale };
+  if (read_file(filename, &file) != 0 ||
+      decode_rgba(decoder, &file, &full) != 0 ||
+      decode_rgba(decoder, &file, &scaled) != 0) {
+    goto out;  /* The full decode reports it. */
+  }
+
+  int x, y, ox, oy, c;
+  if (scaled.expected) {
+    const int len = scaled.width * scaled.height * 4;
+    if (scaled.expected_len != 2 * len) {
+      printf("expected scaled image is the wrong size\n");
+      goto out;
+    }
+    for (x = 0; x < len; ++x) {
+      unsigned int expected;
+      if (sscanf(scaled.expected + 2 * x, "%2x", &expected) != 1 ||
+          expected != scaled.pixels[x]) {
+        printf("scaled image isn't as expected at %d,%d\n",
+               x / 4 % scaled.width, x / 4 / scaled.width);
+        goto out;
+      }
+    }
+  }
+
+  for (oy = 0; oy < scaled.height; ++oy) {
+    const int y0 = ((int64_t)oy * full.height + scaled.height - 1) /
+                   scaled.height;
+    const int y1 = ((int64_t)(oy + 1) * full.height + scaled.height - 1) /
+                   scaled.height;
+    for (ox = 0; ox < scaled.width; ++ox) {
+      const int x0 = ((int64_t)ox * full.width + scaled.width - 1) /
+                     scaled.width;
+      const int x1 = ((int64_t)(ox + 1) * full.width + scaled.width - 1) /
+                     scaled.width;
+      uint64_t sums[4] = { 0 };
+      for (y = y0; y < y1; ++y) {
+        for (x = x0; x < x1; ++x) {
+          const uint8_t* p = full.pixels + ((size_t)y * full.width + x) * 4;
+          for (c = 0; c < 3; ++c)
+            sums[c] += p[c] * p[3];
+          sums[3] += p[3];
+        }
+      }
+      const uint64_t pixels = (uint64_t)(x1 - x0) * (y1 - y0);
+      uint8_t expected[4];
+      for (c = 0; c < 3; ++c)
+        expected[c] = sums[3] ? (sums[c] + sums[3] / 2) / sums[3] : 0;
+      expected[3] = (sums[3] + pixels / 2) / pixels;
+      if (memcmp(expected,
+                 scaled.pixels + ((size_t)oy * scaled.width + ox) * 4,
+                 4) != 0) {
+        printf("scaled image differs at %d,%d\n", ox, oy);
+        goto out;
+      }
+    }
+  }
+
+ out:
+  free(full.pixels);
+  free(full.expected);
+  free(scaled.pixels);
+  free(scaled.expected);
+  free(file.buf);
+}
+
+/* The decoded size limit the decoder is given, low enough that test
+   images can go over it without a lot of data.  Nothing else the
+   decoder allocates comes near it, so anything bigger means a buffer
+   that the limit should have counted. */
+#define MAX_DECODED_SIZE (16 << 20)
+
+typedef struct {
+  int count;
+  size_t largest;
+} allocations;
+
+/* Allocator hooks that count outstanding allocations, to check that
+   everything the decoder allocates goes through them and is freed, and
+   that note the largest. */
+static void* counting_alloc(void* opaque, size_t size) {
+  allocations* a = (allocations*)opaque;
+  void* ptr = malloc(size);
+  if (ptr)
+    ++a->count;
+  if (size > a->largest)
+    a->largest = size;
+  return ptr;
+}
+
+static void counting_free(void* opaque, void* ptr) {
+  --((allocations*)opaque)->count;
+  free(ptr);
+}
+
+static const char* const filter_names[] = {
+  "none", "sub", "up", "average", "paeth", "min-sum", "min-entropy",
+  "default", NULL
+};
+
+static const char* const strategy_names[] = {
+  "default", "rle", "huffman-only", NULL
+};
+
+/* The index of |name| in |names|, or -1. */
+static int find_name(const char* const* names, const char* name) {
+  int i;
+  for (i = 0; names[i]; ++i) {
+    if (strcmp(names[i], name) == 0)
+      return i;
+  }
+  return -1;
+}
+
 int main(int argc, char* argv[]) {
-  const char* filename = argv[1];
+  int builtin_inflate = 0;
+  int batch_rows = 0;
+  int threads = 0;
+  int row_buffer_rows = 0;
+  int reencode_filter = -1;
+  int level = -1;
+  int strategy = SFPNG_STRATEGY_DEFAULT;
+  int band_rows = 0;
+  int scale = 0;
+  int i;
+  for (i = 1; i < argc && argv[i][0] == '-'; ++i) {
+    if (strcmp(argv[i], "--builtin-inflate") == 0) {
+      builtin_inflate = 1;
+    } else if (strcmp(argv[i], "--batch-rows") == 0 && i + 1 < argc) {
+      batch_rows = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+      threads = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--row-buffer-rows") == 0 && i + 1 < argc) {
+      row_buffer_rows = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--reencode") == 0 && i + 1 < argc &&
+               (reencode_filter = find_name(filter_names, argv[++i])) >= 0) {
+    } else if (strcmp(argv[i], "--level") == 0 && i + 1 < argc) {
+      level = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--strategy") == 0 && i + 1 < argc &&
+               (strategy = find_name(strategy_names, argv[++i])) >= 0) {
+    } else if (strcmp(argv[i], "--band-rows") == 0 && i + 1 < argc) {
+      band_rows = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--scale") == 0 && i + 1 < argc) {
+      scale = atoi(argv[++i]);
+    } else {
+      fprintf(stderr, "%s: unknown option %s\n", argv[0], argv[i]);
+      return 1;
+    }
+  }
+  const char* filename = argv[i];
   if (!filename) {
-    fprintf(stderr, "usage: %s pngfile\n", argv[0]);
+    fprintf(stderr, "usage: %s [--builtin-inflate] [--batch-rows n] "
+            "[--threads n] [--row-buffer-rows n]\n"
+            "       [--reencode filter [--level n] [--strategy s] "
+            "[--band-rows n]] [--scale n] pngfile\n", argv[0]);
     return 1;
   }
 
-  int status = dump_file(filename, 0);
-  if (status != 0)
-    return status;
-  status = dump_file(filename, 1);
+  /* All the decodes share a decoder, to exercise sfpng_decoder_reset.
+     The probe's own status doesn't matter, as an image with a bad header
+     fails the full decode too. */
+  allocations allocations = {0};
+  sfpng_decoder* decoder =
+    sfpng_decoder_new_with_allocator(counting_alloc, counting_free,
+                                     &allocations);
+  sfpng_decoder_set_builtin_inflate(decoder, builtin_inflate);
+  sfpng_decoder_set_threads(decoder, threads);
+  sfpng_decoder_set_row_buffer_rows(decoder, row_buffer_rows);
+  sfpng_decoder_set_max_decoded_size(decoder, MAX_DECODED_SIZE);
+  header probed = {0};
+  dump_file(decoder, filename, 1, &probed, 0, 0);
+  int status = dump_file(decoder, filename, 0, &probed, batch_rows, 0);
+  if (status == 0 && reencode_filter >= 0) {
+    sfpng_encoder* encoder =
+      sfpng_encoder_new_with_allocator(counting_alloc, counting_free,
+                                       &allocations);
+    sfpng_encoder_set_filter(encoder, reencode_filter);
+    sfpng_encoder_set_level(encoder, level);
+    sfpng_encoder_set_strategy(encoder, strategy);
+    sfpng_encoder_set_threads(encoder, threads);
+    sfpng_encoder_set_band_rows(encoder, band_rows);
+    check_reencode(decoder, encoder, filename);
+    sfpng_encoder_free(encoder);
+  }
+  if (status == 0 && scale > 1)
+    check_scale(decoder, filename, scale);
+  if ((batch_rows || threads) &&
+      check_rows(decoder, filename, batch_rows, threads) != 0) {
+    status = 2;
+  }
+  if (status == 0)
+    status = dump_file(decoder, filename, 0, NULL, 0, 1);
+  sfpng_decoder_free(decoder);
+  if (allocations.count != 0) {
+    printf("%d allocations not freed\n", allocations.count);
+    return 2;
+  }
+  if (allocations.largest > MAX_DECODED_SIZE) {
+    printf("allocated %zu bytes at once\n", allocations.largest);
+    return 2;
+  }
   return status;
 }
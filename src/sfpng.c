@@ -1,14 +1,24 @@
 #include "sfpng.h"
 
 #include <assert.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <arpa/inet.h>
 #include <stdint.h>
 
+#include "crc.h"
 #include "decoder.h"
+#include "filter.h"
+#include "inflater.h"
+#include "interlace.h"
+#include "pipeline.h"
+#include "scale.h"
 #include "stream.h"
+#include "segments.h"
+#include "stats.h"
+#include "transform.h"
 
 #define PNG_TAG(a,b,c,d) ((uint32_t)((a<<24)|(b<<16)|(c<<8)|d))
 
@@ -16,19 +26,145 @@ static const char png_signature[8] = {
   137, 80, 78, 71, 13, 10, 26, 10
 };
 
+static void* default_alloc(void* opaque, size_t size) {
+  return malloc(size);
+}
+
+static void default_free(void* opaque, void* ptr) {
+  free(ptr);
+}
+
+void* decoder_alloc(sfpng_decoder* decoder, size_t size) {
+  STATS_ADD(decoder, alloc_calls, 1);
+  STATS_ADD(decoder, alloc_bytes, size);
+  return decoder->alloc_func(decoder->alloc_opaque, size);
+}
+
+void decoder_free(const sfpng_decoder* decoder, void* ptr) {
+  if (ptr)
+    decoder->free_func(decoder->alloc_opaque, ptr);
+}
+
+int decoder_within_budget(const sfpng_decoder* decoder, uint64_t bytes) {
+  const uint64_t row_buf =
+    (uint64_t)(1 + decoder->stride) * (decoder->row_buf_rows + 1);
+  return !decoder->max_decoded_size ||
+         row_buf + bytes <= decoder->max_decoded_size;
+}
+
+/* zlib's allocator hooks, with the decoder as zlib's opaque pointer. */
+static voidpf zlib_alloc(voidpf opaque, uInt items, uInt size) {
+  if (size && items > SIZE_MAX / size)
+    return Z_NULL;
+  return decoder_alloc(opaque, (size_t)items * size);
+}
+
+static void zlib_free(voidpf opaque, voidpf ptr) {
+  decoder_free(opaque, ptr);
+}
+
+int decoder_inflate(sfpng_decoder* decoder) {
+  z_stream* zlib = &decoder->zlib_stream;
+  int status;
+  STATS_SAVE(avail_in, zlib->avail_in);
+  STATS_SAVE(avail_out, zlib->avail_out);
+  STATS_START(inflate);
+  if (decoder->inflater_active)
+    status = inflater_run(decoder->inflater, zlib);
+  else
+    status = inflate(zlib, Z_SYNC_FLUSH);
+  STATS_STOP(decoder, inflate, inflate_ns);
+  STATS_ADD(decoder, inflate_calls, 1);
+  STATS_ADD(decoder, inflate_in_bytes, STATS_SAVED(avail_in) - zlib->avail_in);
+  STATS_ADD(decoder, inflate_out_bytes,
+            STATS_SAVED(avail_out) - zlib->avail_out);
+  return status;
+}
+
+static void zlib_use_allocator(sfpng_decoder* decoder, z_stream* zlib) {
+  zlib->zalloc = zlib_alloc;
+  zlib->zfree = zlib_free;
+  zlib->opaque = decoder;
+}
+
+/* Have an initialized zlib stream check its Adler-32 or not, as the
+   decoder is set up to.  zlib before 1.2.9 always checks it. */
+static void zlib_use_verify(sfpng_decoder* decoder, z_stream* zlib) {
+#if ZLIB_VERNUM >= 0x1290
+  inflateValidate(zlib, (decoder->verify & SFPNG_VERIFY_ADLER32) != 0);
+#endif
+}
+
 sfpng_decoder* sfpng_decoder_new() {
+  return sfpng_decoder_new_with_allocator(NULL, NULL, NULL);
+}
+
+sfpng_decoder* sfpng_decoder_new_with_allocator(sfpng_alloc_func alloc_func,
+                                                sfpng_free_func free_func,
+                                                void* opaque) {
   sfpng_decoder* decoder;
 
-  decoder = malloc(sizeof(*decoder));
+  if (!alloc_func || !free_func) {
+    alloc_func = default_alloc;
+    free_func = default_free;
+    opaque = NULL;
+  }
+
+  decoder = alloc_func(opaque, sizeof(*decoder));
   if (!decoder)
     return NULL;
 
   memset(decoder, 0, sizeof(*decoder));
-  crc_init_table(decoder->crc_table);
+  decoder->alloc_func = alloc_func;
+  decoder->free_func = free_func;
+  decoder->alloc_opaque = opaque;
+  decoder->verify = SFPNG_VERIFY_ALL;
+  decoder->batch_rows = 1;
+  decoder->max_width = 1000000;
+  decoder->max_height = 1000000;
+  decoder->max_chunk_size = 8000000;
+  decoder->max_metadata_size = 8000000;
+  decoder->max_decoded_size = (uint64_t)1 << 30;
+#ifdef SFPNG_BUILTIN_INFLATE
+  decoder->use_inflater = 1;
+#endif
 
   return decoder;
 }
 
+void sfpng_decoder_reset(sfpng_decoder* decoder) {
+  pipeline_abort(decoder);
+  segments_abort(decoder);
+  decoder->state = STATE_SIGNATURE;
+  decoder->in_len = 0;
+  decoder->chunk_state = CHUNK_STATE_NONE;
+
+  decoder->width = 0;
+  decoder->height = 0;
+  decoder->bit_depth = 0;
+  decoder->color_type = 0;
+  decoder->interlaced = 0;
+  decoder->has_palette = 0;
+  decoder->palette.entries = 0;
+  decoder->gamma = 0;
+  decoder->metadata_size = 0;
+  decoder->restart_count = 0;
+  decoder->has_trans = 0;
+  memset(&decoder->trans, 0, sizeof(decoder->trans));
+  decoder->transform_func = NULL;
+  decoder->output_buf = NULL;
+  decoder->scale_width = 0;
+
+  /* The zlib stream gets an inflateReset when the next image's data
+     starts. */
+  decoder->zlib_active = 0;
+  decoder->row_buf_done = 0;
+  decoder->scanline_row = 0;
+  decoder->pass = 0;
+  decoder->image_row = 0;
+  decoder->image_row_emitted = 0;
+}
+
 void sfpng_decoder_set_context(sfpng_decoder* decoder, void* context) {
   decoder->context = context;
 }
@@ -37,70 +173,22 @@ void* sfpng_decoder_get_context(sfpng_decoder* decoder) {
   return decoder->context;
 }
 
-enum filter_type {
-  FILTER_NONE = 0,
-  FILTER_SUB,
-  FILTER_UP,
-  FILTER_AVERAGE,
-  FILTER_PAETH
-};
-
-static int paeth(int a, int b, int c) {
-  int p = a + b - c;
-  int pa = abs(p - a);
-  int pb = abs(p - b);
-  int pc = abs(p - c);
-  if (pa <= pb && pa <= pc)
-    return a;
-  else if (pb <= pc)
-    return b;
-  else
-    return c;
-}
-
-static sfpng_status reconstruct_filter(sfpng_decoder* decoder)
+static sfpng_status reconstruct_filter(sfpng_decoder* decoder,
+                                       uint8_t* row, const uint8_t* prev)
   SFPNG_WARN_UNUSED_RESULT;
-static sfpng_status reconstruct_filter(sfpng_decoder* decoder) {
+static sfpng_status reconstruct_filter(sfpng_decoder* decoder,
+                                       uint8_t* row, const uint8_t* prev) {
   /* 9.2 Filter types for filter method 0 */
-  int filter_type = decoder->scanline_buf[0];
-  uint8_t* buf = decoder->scanline_buf + 1;
-  uint8_t* prev = decoder->scanline_prev_buf + 1;
-  int i;
-  int bpp = decoder->bytes_per_pixel;
-
-  switch (filter_type) {
-  case FILTER_NONE:
-    break;
-  case FILTER_SUB:
-    for (i = bpp; i < decoder->stride; ++i)
-      buf[i] = buf[i] + buf[i - bpp];
-    break;
-  case FILTER_UP:
-    for (i = 0; i < decoder->stride; ++i)
-      buf[i] = buf[i] + prev[i];
-    break;
-  case FILTER_AVERAGE:
-    for (i = 0; i < decoder->stride; ++i) {
-      int last = i - bpp;
-      int a = last >= 0 ? buf[last] : 0;
-      int b = prev[i];
-      int avg = (a + b) / 2;
-      buf[i] = buf[i] + avg;
-    }
-    break;
-  case FILTER_PAETH:
-    for (i = 0; i < decoder->stride; ++i) {
-      int last = i - bpp;
-      int a = last >= 0 ? buf[last] : 0;
-      int b = prev[i];
-      int c = last >= 0 ? prev[last] : 0;
-      buf[i] = buf[i] + paeth(a, b, c);
-    }
-    break;
-  default:
-    return SFPNG_ERROR_BAD_FILTER;
+  STATS_START(filter);
+  sfpng_status status = filter_reconstruct(row[0], row + 1, prev + 1,
+                                           decoder->pass_stride,
+                                           decoder->bytes_per_pixel);
+  if (status == SFPNG_SUCCESS) {
+    STATS_STOP(decoder, filter, filter_ns[row[0]]);
+    STATS_ADD(decoder, filter_rows[row[0]], 1);
+    STATS_ADD(decoder, filter_bytes[row[0]], decoder->pass_stride);
   }
-  return SFPNG_SUCCESS;
+  return status;
 }
 
 static sfpng_status parse_color(sfpng_decoder* decoder,
@@ -153,36 +241,79 @@ static sfpng_status parse_color(sfpng_decoder* decoder,
 static sfpng_status update_header_derived_values(sfpng_decoder* decoder)
   SFPNG_WARN_UNUSED_RESULT;
 static sfpng_status update_header_derived_values(sfpng_decoder* decoder) {
-  int scanline_bits;
+  int channels;
   switch (decoder->color_type) {
   case SFPNG_COLOR_GRAYSCALE:
   case SFPNG_COLOR_INDEXED:
-    scanline_bits = decoder->width * decoder->bit_depth;
-    decoder->bytes_per_pixel =
-      decoder->bit_depth < 8 ? 1 : (decoder->bit_depth / 8);
+    channels = 1;
     break;
   case SFPNG_COLOR_TRUECOLOR:
-    scanline_bits = decoder->width * decoder->bit_depth * 3;
-    decoder->bytes_per_pixel = 3 * (decoder->bit_depth / 8);
+    channels = 3;
     break;
   case SFPNG_COLOR_GRAYSCALE_ALPHA:
-    scanline_bits = decoder->width * decoder->bit_depth * 2;
-    decoder->bytes_per_pixel = 2 * (decoder->bit_depth / 8);
+    channels = 2;
     break;
   case SFPNG_COLOR_TRUECOLOR_ALPHA:
-    scanline_bits = decoder->width * decoder->bit_depth * 4;
-    decoder->bytes_per_pixel = 4 * (decoder->bit_depth / 8);
+  default:
+    channels = 4;
     break;
   }
-  /* Round scanline_bits up to the nearest byte. */
-  decoder->stride = ((scanline_bits + 7) / 8);
+  decoder->pixel_bits = channels * decoder->bit_depth;
+  decoder->bytes_per_pixel =
+    decoder->pixel_bits < 8 ? 1 : decoder->pixel_bits / 8;
+  /* Round the bits in a row up to the nearest byte, in 64 bits as a
+     row of 2^31 pixels of 64 bits is 16gb, and make sure a scanline
+     with its filter byte still fits in an int. */
+  const uint64_t stride =
+    ((uint64_t)decoder->width * decoder->pixel_bits + 7) / 8;
+  if (stride >= INT_MAX)
+    return SFPNG_ERROR_LIMIT_EXCEEDED;
+  decoder->stride = stride;
+
+  /* A probe never gets to the image data, so it needs no row buffer. */
+  if (decoder->probe)
+    return SFPNG_SUCCESS;
 
-  /* Allocate scanline buffers, with extra byte for filter tag. */
+  /* Allocate the row buffer plus the previous-row buffer, each row with
+     an extra byte for the filter tag.  By default the row buffer holds
+     about as much as the zlib window. */
   int scanline_size = 1 + decoder->stride;
-  decoder->scanline_buf = malloc(scanline_size * 2);
-  if (!decoder->scanline_buf)
-    return SFPNG_ERROR_ALLOC_FAILED;
-  decoder->scanline_prev_buf = decoder->scanline_buf + scanline_size;
+  int rows = decoder->requested_rows;
+  if (rows <= 0)
+    rows = (32 << 10) / scanline_size;
+  /* Make it a whole number of batches, so batches never span a refill. */
+  if (rows < decoder->batch_rows)
+    rows = decoder->batch_rows;
+  rows -= rows % decoder->batch_rows;
+  if (rows > decoder->height)
+    rows = decoder->height;
+  if (rows < 1)
+    rows = 1;
+  decoder->row_buf_rows = rows;
+
+  /* The other buffers the image needs are sized once its data starts,
+     but are all known by now, so the limit is checked for them here,
+     before any of them are allocated.  An interlaced image is kept
+     whole; otherwise with threads there's the pipeline's ring, and any
+     segments are checked once their index is read. */
+  uint64_t more = 0;
+  if (decoder->interlaced)
+    more = (uint64_t)decoder->height * decoder->stride;
+  else if (pipeline_wanted(decoder))
+    more = pipeline_ring_size(decoder);
+  if (!decoder_within_budget(decoder, more))
+    return SFPNG_ERROR_LIMIT_EXCEEDED;
+
+  size_t size = (size_t)scanline_size * (rows + 1);
+  if (size > decoder->row_buf_size) {
+    decoder_free(decoder, decoder->row_buf);
+    decoder->row_buf_size = 0;
+    decoder->row_buf = decoder_alloc(decoder, size);
+    if (!decoder->row_buf)
+      return SFPNG_ERROR_ALLOC_FAILED;
+    decoder->row_buf_size = size;
+  }
+  decoder->scanline_prev_buf = decoder->row_buf + scanline_size * rows;
   memset(decoder->scanline_prev_buf, 0, scanline_size);
 
   return SFPNG_SUCCESS;
@@ -201,10 +332,16 @@ static sfpng_status process_header_chunk(sfpng_decoder* decoder,
 
   decoder->width = stream_read_uint32(src);
   decoder->height = stream_read_uint32(src);
-  if (decoder->width == 0 ||
-      decoder->height == 0) {
+  if (decoder->width == 0 || decoder->width > INT32_MAX ||
+      decoder->height == 0 || decoder->height > INT32_MAX) {
     return SFPNG_ERROR_BAD_ATTRIBUTE;
   }
+  if ((decoder->max_width && decoder->width > decoder->max_width) ||
+      (decoder->max_height && decoder->height > decoder->max_height) ||
+      (decoder->max_pixels &&
+       (uint64_t)decoder->width * decoder->height > decoder->max_pixels)) {
+    return SFPNG_ERROR_LIMIT_EXCEEDED;
+  }
 
   int bit_depth = stream_read_byte(src);
   int color_type = stream_read_byte(src);
@@ -239,49 +376,127 @@ static sfpng_status process_palette_chunk(sfpng_decoder* decoder,
     return SFPNG_ERROR_BAD_ATTRIBUTE;  /* Must be after IHDR. */
   if (src->len > 3*256 || src->len % 3 != 0)
     return SFPNG_ERROR_BAD_ATTRIBUTE;
-  if (decoder->palette.bytes)
+  if (decoder->has_palette)
     return SFPNG_ERROR_BAD_ATTRIBUTE;  /* Multiple palettes? */
-  decoder->palette.bytes = malloc(src->len);
-  if (!decoder->palette.bytes)
-    return SFPNG_ERROR_ALLOC_FAILED;
+  decoder->has_palette = 1;
   memcpy(decoder->palette.bytes, src->buf, src->len);
   decoder->palette.entries = src->len / 3;
   decoder->chunk_state = CHUNK_STATE_PLTE;
   return SFPNG_SUCCESS;
 }
 
-static sfpng_status process_image_data_chunk(sfpng_decoder* decoder,
-                                             stream* src)
-  SFPNG_WARN_UNUSED_RESULT;
-static sfpng_status process_image_data_chunk(sfpng_decoder* decoder,
-                                             stream* src) {
-  if (decoder->chunk_state != CHUNK_STATE_IDAT) {
-    /* Verify we were in the proper prior state upon entry.
-       For a paletted image, we should have seen the palette. */
-    const decode_chunk_state expected_chunk_state =
-      decoder->color_type == SFPNG_COLOR_INDEXED ?
-      CHUNK_STATE_PLTE : CHUNK_STATE_IHDR;
-
-    /* The pngsuite mysteriously contains an image that has truecolor data
-       but includes a palette too, so allow that (by using < instead of ==). */
-    if (decoder->chunk_state < expected_chunk_state)
-      return SFPNG_ERROR_BAD_ATTRIBUTE;
+/* Move to the first pass, starting with decoder->pass, that has any
+   pixels, and get ready to decode its rows. */
+static void start_pass(sfpng_decoder* decoder) {
+  for (; decoder->pass < interlace_passes(decoder); ++decoder->pass) {
+    interlace_pass_size(decoder, decoder->pass,
+                        &decoder->pass_width, &decoder->pass_height);
+    if (decoder->pass_width > 0 && decoder->pass_height > 0)
+      break;
   }
+  decoder->pass_stride = (decoder->pass_width * decoder->pixel_bits + 7) / 8;
+  decoder->scanline_row = 0;
+  /* 9.2: the first row of each pass has an all-zero previous row. */
+  memset(decoder->scanline_prev_buf, 0, 1 + decoder->pass_stride);
+}
 
-  int needs_init = !decoder->zlib_stream.next_in;
+static int image_done(const sfpng_decoder* decoder) {
+  return decoder->pass == interlace_passes(decoder);
+}
 
-  decoder->zlib_stream.next_in = (uint8_t*)src->buf;
-  decoder->zlib_stream.avail_in = src->len;
-  if (needs_init) {
-    if (inflateInit(&decoder->zlib_stream) != Z_OK)
-      return SFPNG_ERROR_ZLIB_ERROR;
+/* Point inflate at the start of the row buffer, limited to the rows the
+   current pass still has left so that each pass starts at the top. */
+static void reset_row_buf(sfpng_decoder* decoder) {
+  int rows = min(decoder->row_buf_rows,
+                 decoder->pass_height - decoder->scanline_row);
+  decoder->zlib_stream.next_out = decoder->row_buf;
+  decoder->zlib_stream.avail_out = rows * (1 + decoder->pass_stride);
+  decoder->row_buf_done = 0;
+  decoder->row_buf_emitted = 0;
+}
+
+/* Pass the rows of a non-interlaced image that have been unfiltered in
+   row_buf but not yet passed on to the output.  (Interlaced images go
+   through interlace_row instead.) */
+static void emit_rows(sfpng_decoder* decoder) {
+  const int scanline_size = 1 + decoder->pass_stride;
+  const int count = decoder->row_buf_done - decoder->row_buf_emitted;
+  if (decoder->interlaced || count == 0)
+    return;
+  transform_emit_rows(decoder, decoder->scanline_row - count, count,
+                      decoder->row_buf +
+                      decoder->row_buf_emitted * scanline_size + 1,
+                      scanline_size);
+  decoder->row_buf_emitted = decoder->row_buf_done;
+}
+
+/* Hand out the rows still waiting to make up a batch, when the image
+   data ends early or turns out to be bad, so that every row decoded
+   reaches the callbacks as it would were rows passed one at a time. */
+static void flush_rows(sfpng_decoder* decoder) {
+  if (decoder->interlaced)
+    interlace_flush(decoder);
+  else
+    emit_rows(decoder);
+}
+
+/* Check that the image data may start here. */
+static sfpng_status check_image_data_order(sfpng_decoder* decoder)
+  SFPNG_WARN_UNUSED_RESULT;
+static sfpng_status check_image_data_order(sfpng_decoder* decoder) {
+  /* For a paletted image, we should have seen the palette. */
+  const decode_chunk_state expected_chunk_state =
+    decoder->color_type == SFPNG_COLOR_INDEXED ?
+    CHUNK_STATE_PLTE : CHUNK_STATE_IHDR;
+
+  /* The pngsuite mysteriously contains an image that has truecolor data
+     but includes a palette too, so allow that (by using < instead of ==). */
+  if (decoder->chunk_state < expected_chunk_state)
+    return SFPNG_ERROR_BAD_ATTRIBUTE;
+  return SFPNG_SUCCESS;
+}
 
-    decoder->zlib_stream.next_out = decoder->scanline_buf;
-    decoder->zlib_stream.avail_out = 1 + decoder->stride;
+/* Get the current image's inflater ready for its data: the built-in one
+   or zlib, whichever the decoder is set up to use. */
+static sfpng_status start_inflate(sfpng_decoder* decoder)
+  SFPNG_WARN_UNUSED_RESULT;
+static sfpng_status start_inflate(sfpng_decoder* decoder) {
+  decoder->inflater_active = decoder->use_inflater;
+  if (decoder->inflater_active) {
+    /* The built-in inflater still uses zlib_stream for its input and
+       output pointers. */
+    if (!decoder->inflater) {
+      decoder->inflater = decoder_alloc(decoder, inflater_size());
+      if (!decoder->inflater)
+        return SFPNG_ERROR_ALLOC_FAILED;
+    }
+    inflater_reset(decoder->inflater,
+                   (decoder->verify & SFPNG_VERIFY_ADLER32) != 0);
+  } else {
+    if (!decoder->zlib_initialized) {
+      zlib_use_allocator(decoder, &decoder->zlib_stream);
+      if (inflateInit(&decoder->zlib_stream) != Z_OK)
+        return SFPNG_ERROR_ZLIB_ERROR;
+      decoder->zlib_initialized = 1;
+    } else if (inflateReset(&decoder->zlib_stream) != Z_OK) {
+      return SFPNG_ERROR_ZLIB_ERROR;
+    }
+    zlib_use_verify(decoder, &decoder->zlib_stream);
   }
+  return SFPNG_SUCCESS;
+}
 
+/* Inflate, unfilter and hand out the rows of |len| bytes of image data,
+   one row buffer at a time, without threads. */
+static sfpng_status inflate_image_data(sfpng_decoder* decoder,
+                                       const uint8_t* buf, size_t len)
+  SFPNG_WARN_UNUSED_RESULT;
+static sfpng_status inflate_image_data(sfpng_decoder* decoder,
+                                       const uint8_t* buf, size_t len) {
+  decoder->zlib_stream.next_in = (uint8_t*)buf;
+  decoder->zlib_stream.avail_in = len;
   while (decoder->zlib_stream.avail_in) {
-    if (decoder->scanline_row == decoder->height) {
+    if (image_done(decoder)) {
       /* We're done with the image, but we still have more data.
          This may be an error, but libpng appears to just ignore it.
          XXX should we call this an error?
@@ -290,44 +505,196 @@ static sfpng_status process_image_data_chunk(sfpng_decoder* decoder,
       return SFPNG_SUCCESS;
     }
 
-    int status = inflate(&decoder->zlib_stream, Z_SYNC_FLUSH);
-    if (status != Z_OK && status != Z_STREAM_END)
-      return SFPNG_ERROR_ZLIB_ERROR;
-    if (decoder->zlib_stream.avail_out == 0) {
-      /* Decoded line. */
-      sfpng_status status = reconstruct_filter(decoder);
-      if (status != SFPNG_SUCCESS)
+    int status = decoder_inflate(decoder);
+    const int inflate_failed = status != Z_OK && status != Z_STREAM_END;
+
+    /* Process all the rows completed by this inflate call, including
+       those before any bad data, which would have come out had the
+       data been inflated a row at a time. */
+    const int scanline_size = 1 + decoder->pass_stride;
+    int complete =
+      (decoder->zlib_stream.next_out - decoder->row_buf) / scanline_size;
+    while (decoder->row_buf_done < complete) {
+      uint8_t* row = decoder->row_buf + decoder->row_buf_done * scanline_size;
+      const uint8_t* prev = decoder->row_buf_done == 0 ?
+        decoder->scanline_prev_buf : row - scanline_size;
+      sfpng_status status = reconstruct_filter(decoder, row, prev);
+      if (status != SFPNG_SUCCESS) {
+        flush_rows(decoder);
         return status;
+      }
 
-      if (decoder->scanline_row == 0 && decoder->info_func) {
+      if (decoder->chunk_state != CHUNK_STATE_IDAT) {
         /* 5.6 Chunk ordering says that all metadata chunks (other than comments)
            must appear before IDAT.  So we know that we're past all the metadata
            at this point. */
-        decoder->info_func(decoder);
+        transform_select(decoder);
+        if (decoder->info_func)
+          decoder->info_func(decoder);
       }
-      if (decoder->row_func) {
-        decoder->row_func(decoder, decoder->scanline_row,
-                          decoder->scanline_buf + 1, decoder->stride);
+      /* Rows that the segments already handed out (see unsegment) are
+         only decoded again to get to the rest. */
+      const int replayed = decoder->scanline_row < decoder->replayed_rows;
+      if (decoder->pass_row_func && !replayed) {
+        decoder->pass_row_func(decoder, decoder->pass, decoder->scanline_row,
+                               row + 1, decoder->pass_stride);
+      }
+      if (decoder->interlaced) {
+        status = interlace_row(decoder, row + 1);
+        if (status != SFPNG_SUCCESS)
+          return status;
       }
       ++decoder->scanline_row;
-
-      /* Swap buffers, so prev points at the row we just finished. */
-      uint8_t* tmp = decoder->scanline_prev_buf;
-      decoder->scanline_prev_buf = decoder->scanline_buf;
-      decoder->scanline_buf = tmp;
-
-      /* Set up for next line. */
-      decoder->zlib_stream.next_out = decoder->scanline_buf;
-      decoder->zlib_stream.avail_out = 1 + decoder->stride;
+      ++decoder->row_buf_done;
+      if (replayed) {
+        decoder->row_buf_emitted = decoder->row_buf_done;
+      } else if (decoder->row_buf_done - decoder->row_buf_emitted >=
+                 decoder->batch_rows) {
+        emit_rows(decoder);
+      }
 
       /* Mark that we've sucessfully processed at least some of the IDAT. */
       decoder->chunk_state = CHUNK_STATE_IDAT;
     }
+    if (inflate_failed) {
+      flush_rows(decoder);
+      return SFPNG_ERROR_ZLIB_ERROR;
+    }
+
+    if (decoder->scanline_row == decoder->pass_height) {
+      emit_rows(decoder);
+      ++decoder->pass;
+      start_pass(decoder);
+      if (!image_done(decoder))
+        reset_row_buf(decoder);
+    } else if (decoder->zlib_stream.avail_out == 0) {
+      /* The buffer is full; keep its last row as the previous row and
+         start filling it again from the top. */
+      emit_rows(decoder);
+      memcpy(decoder->scanline_prev_buf,
+             decoder->row_buf + (complete - 1) * scanline_size,
+             scanline_size);
+      reset_row_buf(decoder);
+    }
+
+    if (status == Z_STREAM_END) {
+      /* Anything after the end of the zlib stream is ignored, as with
+         extra data after the last row above. */
+      decoder->zlib_stream.avail_in = 0;
+    }
+  }
+
+  return SFPNG_SUCCESS;
+}
+
+/* The segments' restart points turned out not to match the image data,
+   or the data is bad or ended early, so start over from the beginning
+   of the data the segments kept and decode it without them, which gets
+   that sorted out as it would be without threads.  The rows that the
+   segments already handed out aren't handed out again. */
+static sfpng_status unsegment(sfpng_decoder* decoder)
+  SFPNG_WARN_UNUSED_RESULT;
+static sfpng_status unsegment(sfpng_decoder* decoder) {
+  const uint8_t* buf;
+  size_t len;
+  int i;
+
+  segments_abort(decoder);
+  decoder->segmented = 0;
+  sfpng_status status = start_inflate(decoder);
+  if (status != SFPNG_SUCCESS)
+    return status;
+  decoder->replayed_rows = decoder->scanline_row;
+  decoder->pass = 0;
+  start_pass(decoder);
+  reset_row_buf(decoder);
+  for (i = 0; segments_data(decoder, i, &buf, &len); ++i) {
+    while (len) {
+      /* In pieces that zlib's avail_in can take. */
+      const size_t n = min(len, (size_t)1 << 30);
+      status = inflate_image_data(decoder, buf, n);
+      if (status != SFPNG_SUCCESS)
+        return status;
+      buf += n;
+      len -= n;
+    }
   }
+  return SFPNG_SUCCESS;
+}
 
+/* The image data has ended, perhaps early: hand out every row decoded
+   from it that hasn't been yet, including those still with the worker
+   threads. */
+static sfpng_status end_image_data(sfpng_decoder* decoder)
+  SFPNG_WARN_UNUSED_RESULT;
+static sfpng_status end_image_data(sfpng_decoder* decoder) {
+  if (decoder->segmented) {
+    int mismatched;
+    segments_finish(decoder, &mismatched);
+    if (!mismatched)
+      return SFPNG_SUCCESS;
+    sfpng_status status = unsegment(decoder);
+    if (status != SFPNG_SUCCESS)
+      return status;
+  }
+  if (decoder->pipelined)
+    return pipeline_finish(decoder);
+  flush_rows(decoder);
   return SFPNG_SUCCESS;
 }
 
+static sfpng_status process_image_data_chunk(sfpng_decoder* decoder,
+                                             stream* src)
+  SFPNG_WARN_UNUSED_RESULT;
+static sfpng_status process_image_data_chunk(sfpng_decoder* decoder,
+                                             stream* src) {
+  if (decoder->chunk_state != CHUNK_STATE_IDAT) {
+    /* Verify we were in the proper prior state upon entry. */
+    sfpng_status status = check_image_data_order(decoder);
+    if (status != SFPNG_SUCCESS)
+      return status;
+  }
+
+  if (!decoder->zlib_active) {
+    /* The segments have inflaters of their own. */
+    decoder->segmented = segments_wanted(decoder);
+    if (!decoder->segmented) {
+      sfpng_status status = start_inflate(decoder);
+      if (status != SFPNG_SUCCESS)
+        return status;
+    }
+    decoder->zlib_active = 1;
+    decoder->replayed_rows = 0;
+    start_pass(decoder);
+    reset_row_buf(decoder);
+    decoder->pipelined = !decoder->segmented && pipeline_wanted(decoder);
+    if (decoder->segmented || decoder->pipelined) {
+      sfpng_status status = decoder->segmented ?
+        segments_start(decoder) : pipeline_start(decoder);
+      if (status != SFPNG_SUCCESS)
+        return status;
+    }
+  }
+
+  if (decoder->segmented) {
+    int mismatched;
+    sfpng_status status = segments_write(decoder, src, &mismatched);
+    if (status != SFPNG_SUCCESS || !mismatched)
+      return status;
+    status = unsegment(decoder);
+    if (status != SFPNG_SUCCESS)
+      return status;
+    /* Whatever of the piece the segments didn't keep. */
+    return inflate_image_data(decoder, src->buf, src->len);
+  }
+  if (decoder->pipelined) {
+    decoder->zlib_stream.next_in = (uint8_t*)src->buf;
+    decoder->zlib_stream.avail_in = src->len;
+    return pipeline_write(decoder);
+  }
+  return inflate_image_data(decoder, src->buf, src->len);
+}
+
 static sfpng_status process_iend_chunk(sfpng_decoder* decoder,
                                        stream* src)
   SFPNG_WARN_UNUSED_RESULT;
@@ -338,12 +705,11 @@ static sfpng_status process_iend_chunk(sfpng_decoder* decoder,
 
   if (src->len != 0)
     return SFPNG_ERROR_BAD_ATTRIBUTE;
-  if (decoder->zlib_stream.next_in) {
-    int status = inflateEnd(&decoder->zlib_stream);
-    decoder->zlib_stream.next_in = NULL;
-    if (status != Z_OK)
-      return SFPNG_ERROR_ZLIB_ERROR;
-  }
+  sfpng_status status = end_image_data(decoder);
+  if (status != SFPNG_SUCCESS)
+    return status;
+  /* The zlib stream is kept for reuse by sfpng_decoder_reset; it's
+     released by sfpng_decoder_free. */
 
   decoder->chunk_state = CHUNK_STATE_IEND;
 
@@ -359,13 +725,13 @@ static sfpng_status process_trns_chunk(sfpng_decoder* decoder,
     return SFPNG_ERROR_BAD_ATTRIBUTE; /* XXX handle chunk ordering deps */
 
   if (decoder->color_type == SFPNG_COLOR_INDEXED) {
-    if (decoder->trans.palette.bytes)
+    if (decoder->has_trans)
       return SFPNG_ERROR_BAD_ATTRIBUTE;  /* Multiple trns chunks? */
-    decoder->trans.palette.entries = src->len;
-    decoder->trans.palette.bytes = malloc(src->len);
-    if (!decoder->trans.palette.bytes)
-      return SFPNG_ERROR_ALLOC_FAILED;
-    memcpy(decoder->trans.palette.bytes, src->buf, src->len);
+    /* There can't be more alpha values than palette entries; any extra
+       would never be looked up, so drop them. */
+    decoder->trans.palette.entries = min(src->len, 256);
+    memcpy(decoder->trans.palette.bytes, src->buf,
+           decoder->trans.palette.entries);
   } else {
     /* 16-bit color value; either rgb or grayscale. */
     if (decoder->color_type & SFPNG_COLOR_MASK_COLOR) {
@@ -386,41 +752,69 @@ static sfpng_status process_trns_chunk(sfpng_decoder* decoder,
   return SFPNG_SUCCESS;
 }
 
-/* zlib-inflate a buffer, mallocing a buffer for the output. */
-static sfpng_status inflate_fully(stream* src, uint8_t** out_buf, int* out_len) {
+/* zlib-inflate a buffer, allocating a buffer for the output.  The
+   buffer grows as needed, but no further than what's left of the
+   image's metadata budget. */
+static sfpng_status inflate_fully(sfpng_decoder* decoder, stream* src,
+                                  uint8_t** out_buf, int* out_len) {
   int ret = SFPNG_SUCCESS;
-  uint8_t buf[8 << 10];
+  uint8_t* buf = NULL;
+  size_t size = 0;
   z_stream zlib = {};
 
+  size_t budget = INT_MAX;
+  if (decoder->max_metadata_size) {
+    budget = min(budget,
+                 decoder->max_metadata_size - decoder->metadata_size);
+  }
+
   *out_buf = NULL;
   *out_len = 0;
+  zlib_use_allocator(decoder, &zlib);
   zlib.next_in = (uint8_t*)src->buf;
   zlib.avail_in = src->len;
   if (inflateInit(&zlib) != Z_OK)
     return SFPNG_ERROR_ZLIB_ERROR;
-  zlib.next_out = buf;
-  zlib.avail_out = sizeof(buf);
+  zlib_use_verify(decoder, &zlib);
 
-  while (zlib.avail_in) {
-    int status = inflate(&zlib, Z_SYNC_FLUSH);
+  int status = Z_OK;
+  while (status != Z_STREAM_END && zlib.avail_in) {
+    if (zlib.avail_out == 0) {
+      /* Out of room: check the budget before allocating any more, and
+         then copy into a buffer twice the size, as the allocator hooks
+         have no realloc. */
+      if (size == budget) {
+        ret = SFPNG_ERROR_LIMIT_EXCEEDED;
+        goto out;
+      }
+      size_t new_size = min(budget, size ? 2 * size : 8 << 10);
+      uint8_t* new_buf = decoder_alloc(decoder, new_size);
+      if (!new_buf) {
+        ret = SFPNG_ERROR_ALLOC_FAILED;
+        goto out;
+      }
+      if (buf)
+        memcpy(new_buf, buf, zlib.total_out);
+      decoder_free(decoder, buf);
+      buf = new_buf;
+      size = new_size;
+      zlib.next_out = buf + zlib.total_out;
+      zlib.avail_out = size - zlib.total_out;
+    }
+    status = inflate(&zlib, Z_SYNC_FLUSH);
     if (status != Z_OK && status != Z_STREAM_END) {
       ret = SFPNG_ERROR_ZLIB_ERROR;
       goto out;
     }
-    if (zlib.avail_out == 0) {
-      /* XXX ran out of buffer.
-         TODO: grow a buffer manually?  ugh.
-       */
-      ret = SFPNG_ERROR_NOT_IMPLEMENTED;
-      goto out;
-    }
   }
 
+  decoder->metadata_size += zlib.total_out;
+  *out_buf = buf;
   *out_len = zlib.total_out;
-  *out_buf = malloc(*out_len);
-  memcpy(*out_buf, buf, *out_len);
+  buf = NULL;
 
  out:
+  decoder_free(decoder, buf);
   inflateEnd(&zlib);
   return ret;
 }
@@ -443,6 +837,9 @@ static sfpng_status process_text_chunk(sfpng_decoder* decoder,
   stream_consume(src, nul - src->buf + 1);
 
   if (compressed) {
+    /* Probing never inflates anything. */
+    if (decoder->probe)
+      return SFPNG_SUCCESS;
     if (src->len < 1)
       return SFPNG_ERROR_BAD_ATTRIBUTE;
     int compression = stream_read_byte(src);
@@ -456,11 +853,11 @@ static sfpng_status process_text_chunk(sfpng_decoder* decoder,
 
     uint8_t* buf;
     int len;
-    sfpng_status status = inflate_fully(src, &buf, &len);
+    sfpng_status status = inflate_fully(decoder, src, &buf, &len);
     if (status != SFPNG_SUCCESS)
       return status;
     decoder->text_func(decoder, keyword, buf, len);
-    free(buf);
+    decoder_free(decoder, buf);
     return SFPNG_SUCCESS;
   } else {
     decoder->text_func(decoder, keyword, src->buf, src->len);
@@ -485,9 +882,14 @@ static sfpng_status process_chunk(sfpng_decoder* decoder) {
   case PNG_TAG('P', 'L', 'T', 'E'):
     /* 11.2.3 PLTE Palette */
     return process_palette_chunk(decoder, &src);
-  case PNG_TAG('I','D','A','T'):
+  case PNG_TAG('I','D','A','T'): {
     /* 11.2.4 IDAT Image data */
-    return process_image_data_chunk(decoder, &src);
+    /* The data itself was already fed to inflate as it arrived (see
+       sfpng_decoder_write), so this only checks the ordering of an
+       empty IDAT. */
+    stream empty = { NULL, 0 };
+    return process_image_data_chunk(decoder, &empty);
+  }
   case PNG_TAG('I', 'E', 'N', 'D'):
     /* 11.2.5 IEND Image trailer */
     return process_iend_chunk(decoder, &src);
@@ -537,6 +939,12 @@ static sfpng_status process_chunk(sfpng_decoder* decoder) {
     /* 11.3.6.1 tIME Image last-modification time */
     /* Don't care.  TODO: expose this info to users?  */
     break;
+  case PNG_TAG('s','f','R','S'):
+    /* sfpng's restart points, see segments.h.  Only useful before the
+       image data starts. */
+    if (decoder->chunk_state >= CHUNK_STATE_IDAT)
+      break;
+    return segments_read_index(decoder, &src);
   default:
     if (decoder->unknown_chunk_func) {
       decoder->unknown_chunk_func(decoder,
@@ -549,6 +957,54 @@ static sfpng_status process_chunk(sfpng_decoder* decoder) {
   return SFPNG_SUCCESS;
 }
 
+/* Whether the current chunk's CRC is to be checked. */
+static int chunk_crc_checked(const sfpng_decoder* decoder) {
+  if (!(decoder->verify & SFPNG_VERIFY_CRC))
+    return 0;
+  return !(decoder->chunk_skipped && decoder->skip_ignore_crc);
+}
+
+/* Whether the current chunk can be skipped without being buffered: an
+   ancillary chunk the caller asked to skip, or one that process_chunk
+   would drop anyway. */
+static int chunk_skippable(const sfpng_decoder* decoder) {
+  uint32_t type = PNG_TAG(decoder->chunk_type[0],
+                          decoder->chunk_type[1],
+                          decoder->chunk_type[2],
+                          decoder->chunk_type[3]);
+  int i;
+
+  /* 5.4 Chunk naming conventions: bit 5 of the first byte is set for
+     ancillary chunks.  Critical chunks are never skipped. */
+  if (!(decoder->chunk_type[0] & 0x20))
+    return 0;
+
+  for (i = 0; i < decoder->skip_types_count; ++i) {
+    if (decoder->skip_types[i] == type)
+      return 1;
+  }
+
+  switch (type) {
+  case PNG_TAG('t','R','N','S'):
+  case PNG_TAG('g', 'A', 'M', 'A'):
+  case PNG_TAG('p','H','Y','s'):
+    return 0;
+  case PNG_TAG('t', 'E', 'X', 't'):
+  case PNG_TAG('z', 'T', 'X', 't'):
+    return !decoder->text_func;
+  case PNG_TAG('c', 'H', 'R', 'M'):
+  case PNG_TAG('s','B','I','T'):
+  case PNG_TAG('b','K','G','D'):
+  case PNG_TAG('h','I','S','T'):
+  case PNG_TAG('t','I','M','E'):
+    return 1;
+  case PNG_TAG('s','f','R','S'):
+    return decoder->threads == 0;
+  default:
+    return !decoder->unknown_chunk_func;
+  }
+}
+
 void sfpng_decoder_set_info_func(sfpng_decoder* decoder,
                                  sfpng_info_func info_func) {
   decoder->info_func = info_func;
@@ -557,6 +1013,12 @@ void sfpng_decoder_set_row_func(sfpng_decoder* decoder,
                                 sfpng_row_func row_func) {
   decoder->row_func = row_func;
 }
+void sfpng_decoder_set_rows_func(sfpng_decoder* decoder,
+                                 sfpng_rows_func rows_func,
+                                 int batch_rows) {
+  decoder->rows_func = rows_func;
+  decoder->batch_rows = rows_func && batch_rows > 1 ? batch_rows : 1;
+}
 void sfpng_decoder_set_text_func(sfpng_decoder* decoder,
                                  sfpng_text_func text_func) {
   decoder->text_func = text_func;
@@ -565,6 +1027,86 @@ void sfpng_decoder_set_unknown_chunk_func(sfpng_decoder* decoder,
                                           sfpng_unknown_chunk_func chunk_func) {
   decoder->unknown_chunk_func = chunk_func;
 }
+void sfpng_decoder_set_pass_row_func(sfpng_decoder* decoder,
+                                     sfpng_pass_row_func pass_row_func) {
+  decoder->pass_row_func = pass_row_func;
+}
+void sfpng_decoder_set_interlace_preview(sfpng_decoder* decoder,
+                                         int preview) {
+  decoder->interlace_preview = preview;
+}
+sfpng_status sfpng_decoder_set_skip_chunk(sfpng_decoder* decoder,
+                                          const char chunk_type[4],
+                                          int skip) {
+  uint32_t type = PNG_TAG(chunk_type[0], chunk_type[1],
+                          chunk_type[2], chunk_type[3]);
+  int i;
+
+  for (i = 0; i < decoder->skip_types_count; ++i) {
+    if (decoder->skip_types[i] == type)
+      break;
+  }
+  if (!skip) {
+    if (i < decoder->skip_types_count)
+      decoder->skip_types[i] = decoder->skip_types[--decoder->skip_types_count];
+    return SFPNG_SUCCESS;
+  }
+  if (i < decoder->skip_types_count)
+    return SFPNG_SUCCESS;  /* Already skipped. */
+
+  if (decoder->skip_types_count == decoder->skip_types_size) {
+    int size = decoder->skip_types_size ? 2 * decoder->skip_types_size : 8;
+    uint32_t* types = decoder_alloc(decoder, size * sizeof(*types));
+    if (!types)
+      return SFPNG_ERROR_ALLOC_FAILED;
+    if (decoder->skip_types_count) {
+      memcpy(types, decoder->skip_types,
+             decoder->skip_types_count * sizeof(*types));
+    }
+    decoder_free(decoder, decoder->skip_types);
+    decoder->skip_types = types;
+    decoder->skip_types_size = size;
+  }
+  decoder->skip_types[decoder->skip_types_count++] = type;
+  return SFPNG_SUCCESS;
+}
+void sfpng_decoder_set_skipped_chunk_crc(sfpng_decoder* decoder, int check) {
+  decoder->skip_ignore_crc = !check;
+}
+void sfpng_decoder_set_verify(sfpng_decoder* decoder, int verify) {
+  decoder->verify = verify;
+}
+void sfpng_decoder_set_probe(sfpng_decoder* decoder, int probe) {
+  decoder->probe = probe;
+}
+void sfpng_decoder_set_builtin_inflate(sfpng_decoder* decoder, int enable) {
+  decoder->use_inflater = enable;
+}
+void sfpng_decoder_set_threads(sfpng_decoder* decoder, int threads) {
+  decoder->threads = threads > 0 ? threads : 0;
+}
+void sfpng_decoder_set_max_size(sfpng_decoder* decoder,
+                                uint32_t width, uint32_t height,
+                                uint64_t pixels) {
+  decoder->max_width = width;
+  decoder->max_height = height;
+  decoder->max_pixels = pixels;
+}
+void sfpng_decoder_set_max_chunk_size(sfpng_decoder* decoder,
+                                      uint32_t bytes) {
+  decoder->max_chunk_size = bytes;
+}
+void sfpng_decoder_set_max_metadata_size(sfpng_decoder* decoder,
+                                         size_t bytes) {
+  decoder->max_metadata_size = bytes;
+}
+void sfpng_decoder_set_max_decoded_size(sfpng_decoder* decoder,
+                                        uint64_t bytes) {
+  decoder->max_decoded_size = bytes;
+}
+void sfpng_decoder_set_row_buffer_rows(sfpng_decoder* decoder, int rows) {
+  decoder->requested_rows = rows;
+}
 
 
 int sfpng_decoder_get_width(const sfpng_decoder* decoder) {
@@ -584,7 +1126,7 @@ int sfpng_decoder_get_interlaced(const sfpng_decoder* decoder) {
 }
 
 const uint8_t* sfpng_decoder_get_palette(const sfpng_decoder* decoder) {
-  return decoder->palette.bytes;
+  return decoder->has_palette ? decoder->palette.bytes : NULL;
 }
 int sfpng_decoder_get_palette_entries(const sfpng_decoder* decoder) {
   return decoder->palette.entries;
@@ -597,15 +1139,46 @@ float sfpng_decoder_get_gamma(const sfpng_decoder* decoder) {
   return decoder->gamma / (float)100000;
 }
 
+int sfpng_decoder_get_stats(const sfpng_decoder* decoder, sfpng_stats* stats) {
+  int kept = 0;
+#ifdef SFPNG_STATS
+  *stats = decoder->stats;
+  kept = 1;
+#else
+  memset(stats, 0, sizeof(*stats));
+#endif
+  /* The buffers never shrink, so their sizes are their peaks. */
+  stats->peak_chunk_buf = decoder->chunk_buf_size;
+  stats->peak_row_buf = decoder->row_buf_size;
+  stats->peak_image_buf = decoder->image_buf_size;
+  return kept;
+}
+void sfpng_decoder_clear_stats(sfpng_decoder* decoder) {
+#ifdef SFPNG_STATS
+  memset(&decoder->stats, 0, sizeof(decoder->stats));
+#endif
+}
+
 static sfpng_status finish(sfpng_decoder* decoder) {
-  if (decoder->chunk_state != CHUNK_STATE_IEND)
+  if (decoder->chunk_state != CHUNK_STATE_IEND) {
+    /* Even so, the rows that did arrive go out.  An error in them, which
+       with threads may only be found now, comes before the file being
+       short, as it would have without threads. */
+    if (decoder->zlib_active) {
+      sfpng_status status = end_image_data(decoder);
+      if (status != SFPNG_SUCCESS)
+        return status;
+    }
     return SFPNG_ERROR_EOF;
+  }
   return SFPNG_SUCCESS;
 }
 
 sfpng_status sfpng_decoder_write(sfpng_decoder* decoder,
                                  const void* buf,
                                  size_t bytes) {
+  if (decoder->state == STATE_PROBED)
+    return SFPNG_SUCCESS;
   if (bytes == 0)
     return finish(decoder);
 
@@ -640,11 +1213,37 @@ sfpng_status sfpng_decoder_write(sfpng_decoder* decoder,
 
       memcpy(&decoder->chunk_type, decoder->in_buf + 4, 4);
 
-      if (chunk_len) {
-        if (decoder->chunk_len < chunk_len)
-          decoder->chunk_buf = realloc(decoder->chunk_buf, chunk_len);
+      if (decoder->probe && memcmp(decoder->chunk_type, "IDAT", 4) == 0) {
+        /* All the metadata we care about comes before the image data,
+           so a probe is done. */
+        sfpng_status status = check_image_data_order(decoder);
+        if (status != SFPNG_SUCCESS)
+          return status;
+        decoder->state = STATE_PROBED;
+        if (decoder->info_func)
+          decoder->info_func(decoder);
+        return SFPNG_SUCCESS;
+      }
+
+      /* Image data is streamed rather than buffered, so IDAT chunks
+         don't need to fit in chunk_buf, and neither do skipped chunks. */
+      decoder->chunk_skipped = chunk_skippable(decoder);
+      decoder->chunk_streamed = decoder->chunk_skipped ||
+        memcmp(decoder->chunk_type, "IDAT", 4) == 0;
+      if (decoder->chunk_streamed) {
+        decoder->chunk_crc = crc_begin(decoder->chunk_type);
+      } else if (decoder->max_chunk_size &&
+                 (uint32_t)chunk_len > decoder->max_chunk_size) {
+        return SFPNG_ERROR_LIMIT_EXCEEDED;
+      } else if (chunk_len > decoder->chunk_buf_size) {
+        /* The old contents aren't needed, so there's no need for a
+           realloc (which the allocator hooks don't offer). */
+        decoder_free(decoder, decoder->chunk_buf);
+        decoder->chunk_buf_size = 0;
+        decoder->chunk_buf = decoder_alloc(decoder, chunk_len);
         if (!decoder->chunk_buf)
           return SFPNG_ERROR_ALLOC_FAILED;
+        decoder->chunk_buf_size = chunk_len;
       }
       decoder->chunk_len = chunk_len;
 
@@ -653,8 +1252,35 @@ sfpng_status sfpng_decoder_write(sfpng_decoder* decoder,
       /* Fall through. */
     }
     case STATE_CHUNK_DATA: {
-      stream_fill_buffer(&src, decoder->chunk_buf,
-                         &decoder->chunk_ofs, decoder->chunk_len);
+      if (decoder->chunk_streamed) {
+        /* Hand inflate whatever part of the chunk we have straight from
+           the caller's buffer, accumulating the CRC as it goes by. */
+        const int left = decoder->chunk_len - decoder->chunk_ofs;
+        stream piece = { src.buf, min(src.len, left) };
+        if (chunk_crc_checked(decoder)) {
+          STATS_START(crc);
+          decoder->chunk_crc = crc_update(decoder->chunk_crc,
+                                          piece.buf, piece.len);
+          STATS_STOP(decoder, crc, crc_ns);
+          STATS_ADD(decoder, crc_bytes, piece.len);
+        }
+        stream_consume(&src, piece.len);
+        decoder->chunk_ofs += piece.len;
+
+        if (!decoder->chunk_skipped) {
+          sfpng_status status = process_image_data_chunk(decoder, &piece);
+          if (status != SFPNG_SUCCESS)
+            return status;
+        }
+      } else {
+        STATS_SAVE(chunk_ofs, decoder->chunk_ofs);
+        STATS_START(chunk);
+        stream_fill_buffer(&src, decoder->chunk_buf,
+                           &decoder->chunk_ofs, decoder->chunk_len);
+        STATS_STOP(decoder, chunk, chunk_ns);
+        STATS_ADD(decoder, chunk_bytes,
+                  decoder->chunk_ofs - STATS_SAVED(chunk_ofs));
+      }
       if (decoder->chunk_ofs < decoder->chunk_len)
         return SFPNG_SUCCESS;
 
@@ -667,25 +1293,38 @@ sfpng_status sfpng_decoder_write(sfpng_decoder* decoder,
       if (decoder->in_len < 4)
         return SFPNG_SUCCESS;
 
-      uint32_t expected_crc;
-      memcpy(&expected_crc, decoder->in_buf, 4);
-      expected_crc = ntohl(expected_crc);
-
-      uint32_t actual_crc =
-          crc_compute(decoder->crc_table, decoder->chunk_type,
-                      decoder->chunk_buf, decoder->chunk_len);
-
-      if (actual_crc != expected_crc)
-        return SFPNG_ERROR_BAD_CRC;
+      if (chunk_crc_checked(decoder)) {
+        uint32_t expected_crc;
+        memcpy(&expected_crc, decoder->in_buf, 4);
+        expected_crc = ntohl(expected_crc);
+
+        uint32_t actual_crc;
+        if (decoder->chunk_streamed) {
+          actual_crc = crc_end(decoder->chunk_crc);
+        } else {
+          STATS_START(crc);
+          actual_crc = crc_compute(decoder->chunk_type,
+                                   decoder->chunk_buf, decoder->chunk_len);
+          STATS_STOP(decoder, crc, crc_ns);
+          STATS_ADD(decoder, crc_bytes, decoder->chunk_len);
+        }
+
+        if (actual_crc != expected_crc)
+          return SFPNG_ERROR_BAD_CRC;
+      }
 
-      sfpng_status status = process_chunk(decoder);
-      if (status != SFPNG_SUCCESS)
-        return status;
+      if (!decoder->chunk_skipped) {
+        sfpng_status status = process_chunk(decoder);
+        if (status != SFPNG_SUCCESS)
+          return status;
+      }
 
       decoder->state = STATE_CHUNK_HEADER;
       decoder->in_len = 0;
       break;
     }
+    case STATE_PROBED:
+      return SFPNG_SUCCESS;
     }
   }
 
@@ -693,17 +1332,18 @@ sfpng_status sfpng_decoder_write(sfpng_decoder* decoder,
 }
 
 void sfpng_decoder_free(sfpng_decoder* decoder) {
-  if (decoder->chunk_buf)
-    free(decoder->chunk_buf);
-  if (decoder->scanline_buf)
-    free(min(decoder->scanline_buf, decoder->scanline_prev_buf));
-  if (decoder->zlib_stream.next_in) {
+  pipeline_free(decoder);
+  segments_free(decoder);
+  scale_free(decoder);
+  decoder_free(decoder, decoder->chunk_buf);
+  decoder_free(decoder, decoder->row_buf);
+  decoder_free(decoder, decoder->image_buf);
+  decoder_free(decoder, decoder->inflater);
+  decoder_free(decoder, decoder->skip_types);
+  decoder_free(decoder, decoder->restarts);
+  if (decoder->zlib_initialized) {
     int status = inflateEnd(&decoder->zlib_stream);
     /* We don't care about a bad status at this point. */
   }
-  if (decoder->palette.bytes)
-    free(decoder->palette.bytes);
-  if (decoder->trans.palette.bytes)
-    free(decoder->trans.palette.bytes);
-  free(decoder);
+  decoder->free_func(decoder->alloc_opaque, decoder);
 }
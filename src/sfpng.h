@@ -29,6 +29,10 @@ typedef enum {
   SFPNG_ERROR_EOF,
   SFPNG_ERROR_ZLIB_ERROR,
   SFPNG_ERROR_BAD_FILTER,
+
+  /* The file may be fine, but decoding it would go over one of the
+     limits set by sfpng_decoder_set_max_size() and friends. */
+  SFPNG_ERROR_LIMIT_EXCEEDED,
 } sfpng_status;
 
 /** Possible types of color spaces used by png files.
@@ -53,9 +57,35 @@ enum {
 
 /** Allocate and initialize a new decoder. */
 sfpng_decoder* sfpng_decoder_new();
+
+/** The types of the allocator hooks given to _new_with_allocator(). */
+typedef void* (*sfpng_alloc_func)(void* opaque, size_t size);
+typedef void (*sfpng_free_func)(void* opaque, void* ptr);
+
+/** Allocate and initialize a new decoder that uses a custom allocator.
+
+Every allocation made by the decoder, including the decoder itself and
+zlib's internal state, goes through |alloc_func|, and is released
+through |free_func|; both are passed |opaque|.  The decoder never
+reallocates, so a free function that does nothing is fine for arena or
+bump allocators that are released all at once after the decoder is
+done with.  If either function is NULL, malloc and free are used. */
+sfpng_decoder* sfpng_decoder_new_with_allocator(sfpng_alloc_func alloc_func,
+                                                sfpng_free_func free_func,
+                                                void* opaque);
 /** Free a decoder. */
 void sfpng_decoder_free(sfpng_decoder* decoder);
 
+/** Get a decoder ready to decode another image.
+
+This can be called at any point, including after an error, and discards
+everything about the current image.  The callbacks, context and options
+set on the decoder are kept, as are its buffers and zlib state, so
+decoding a series of images with one decoder stops allocating once it
+has seen the largest of them.  The output buffer, which belongs to a
+particular image, is cleared. */
+void sfpng_decoder_reset(sfpng_decoder* decoder);
+
 /** Set an arbitrary pointer on a decoder.
 
 This is useful when hooking up callbacks back into application data
@@ -80,6 +110,63 @@ typedef void (*sfpng_row_func)(sfpng_decoder* decoder,
 void sfpng_decoder_set_row_func(sfpng_decoder* decoder,
                                 sfpng_row_func row_func);
 
+/** The type of the callback per batch of rows of image pixels.
+
+|count| consecutive rows, starting at |row|, are passed at once: row
+|row| + i is at |buf| + i * |stride|, and each is |len| bytes long, in
+the same raw format as the row callback. */
+typedef void (*sfpng_rows_func)(sfpng_decoder* decoder,
+                                int row,
+                                int count,
+                                const uint8_t* buf,
+                                ptrdiff_t stride,
+                                int len);
+/** Set the callback called per batch of rows of image pixels.
+
+Rows are passed |batch_rows| at a time, except that the last batch of
+the image may be smaller, as may the last before the image data turns
+out to be bad or the file ends early, and with interlace preview
+enabled each call has the rows updated by one pixel of a pass.  The
+rows are passed straight from the decoder's buffers, without copying.
+For a non-interlaced image the row buffer (see _set_row_buffer_rows())
+is grown to a whole number of batches if needed.  This can be used
+along with the row callback, which is called for each row of a batch
+just before the batch is passed.  Must be called before the image
+header is decoded to take effect. */
+void sfpng_decoder_set_rows_func(sfpng_decoder* decoder,
+                                 sfpng_rows_func rows_func,
+                                 int batch_rows);
+
+/** The type of the callback per row of an interlace pass.
+
+|pass| is the Adam7 pass, from 0 to 6, and |row| and |buf| are a row of
+that pass's reduced image in the same raw format as the row callback.
+A non-interlaced image is decoded as a single pass 0 covering the whole
+image, so for those this is called with the same rows as the row
+callback. */
+typedef void (*sfpng_pass_row_func)(sfpng_decoder* decoder,
+                                    int pass,
+                                    int row,
+                                    const uint8_t* buf,
+                                    int len);
+/** Set the callback called per row of each interlace pass. */
+void sfpng_decoder_set_pass_row_func(sfpng_decoder* decoder,
+                                     sfpng_pass_row_func pass_row_func);
+
+/** Set whether interlaced images are shown progressively.
+
+Normally, for an interlaced image the row callback is called once per
+full-resolution row, in order, as soon as all the passes contributing to
+that row are decoded.  (This requires the decoder to hold on to the
+whole image.)  With preview enabled, each decoded pixel is instead
+replicated over the area that later passes will fill in, and the row
+callback is called for every row that changed, so a blocky version of
+the whole image is available after the first pass and is refined by
+each subsequent one.  The row callback may then see the same row many
+times; the last call for each row has its final contents. */
+void sfpng_decoder_set_interlace_preview(sfpng_decoder* decoder,
+                                         int preview);
+
 /** The type of the callback for the various PNG comment metadata.
 
 TODO: add a param distinguishing between the latin-1 and UTF-8
@@ -101,6 +188,138 @@ typedef void (*sfpng_unknown_chunk_func)(sfpng_decoder* decoder,
 void sfpng_decoder_set_unknown_chunk_func(sfpng_decoder* decoder,
                                           sfpng_unknown_chunk_func chunk_func);
 
+/** Set whether chunks of a given type are skipped.
+
+A skipped chunk is read past without being buffered or looked at, so
+large metadata chunks cost neither memory nor copying.  Only ancillary
+chunks (those whose type starts with a lowercase letter) can be skipped;
+asking to skip a critical chunk has no effect.  Chunks nothing would
+look at, such as text chunks when there's no text callback or unknown
+chunks when there's no unknown chunk callback, are always skipped.
+Passing zero for |skip| undoes an earlier call.  Returns
+SFPNG_ERROR_ALLOC_FAILED if the type couldn't be added to the list. */
+sfpng_status sfpng_decoder_set_skip_chunk(sfpng_decoder* decoder,
+                                          const char chunk_type[4],
+                                          int skip);
+
+/** Set whether the CRCs of skipped chunks are checked.
+
+By default they are, as the data goes by; turning this off lets a
+corrupted chunk through as long as it is one that gets skipped. */
+void sfpng_decoder_set_skipped_chunk_crc(sfpng_decoder* decoder, int check);
+
+/** Checksums the decoder can verify, for _set_verify(). */
+enum {
+  SFPNG_VERIFY_CRC     = 1 << 0,  /** Each chunk's CRC-32. */
+  SFPNG_VERIFY_ADLER32 = 1 << 1,  /** The Adler-32 of compressed data. */
+  SFPNG_VERIFY_ALL     = SFPNG_VERIFY_CRC | SFPNG_VERIFY_ADLER32,
+};
+
+/** Set which checksums the decoder verifies.
+
+|verify| is a combination of the SFPNG_VERIFY_* flags.  By default all
+of them are checked, and a mismatch is an error.  Checksums left out are
+not computed at all, which saves some time on input that is known to be
+intact, such as images stored by the same program that wrote them; don't
+do this for untrusted input.  (With zlib older than 1.2.9, zlib always
+checks the Adler-32 itself.) */
+void sfpng_decoder_set_verify(sfpng_decoder* decoder, int verify);
+
+/** Set whether the decoder only probes the image metadata.
+
+When probing, decoding stops at the start of the image data: the info
+callback is called as soon as the first IDAT chunk's header is read,
+and any input after that is ignored, with sfpng_decoder_write returning
+success.  Everything before the image data is still checked and reported
+through the usual callbacks and getters, except that compressed text
+chunks are skipped, as a probe never inflates anything (and never
+allocates the buffers needed to decode the pixels).  This makes it cheap
+to validate an image's size and format after reading only its first few
+hundred bytes. */
+void sfpng_decoder_set_probe(sfpng_decoder* decoder, int probe);
+
+/** Set how many rows the decoder inflates at a time.
+
+Image data is inflated into a buffer of this many rows, which are then
+unfiltered and passed to the row callback together.  Larger values mean
+fewer, larger inflate calls; the buffer is allocated once per image, so
+memory stays fixed at about rows times the row size.  Zero (the default)
+picks a buffer of about 32kb.  Must be called before the image header is
+decoded to take effect. */
+void sfpng_decoder_set_row_buffer_rows(sfpng_decoder* decoder, int rows);
+
+/** Set the largest image the decoder will decode.
+
+An image wider than |width| pixels, taller than |height|, or with more
+than |pixels| pixels in all fails with SFPNG_ERROR_LIMIT_EXCEEDED as soon
+as its header is read, before anything is allocated for it.  Zero means
+no limit.  The defaults are a million pixels each way, as libpng's, and
+no limit on the total. */
+void sfpng_decoder_set_max_size(sfpng_decoder* decoder,
+                                uint32_t width, uint32_t height,
+                                uint64_t pixels);
+
+/** Set the largest chunk the decoder will buffer.
+
+Chunks other than the image data are collected whole before they're
+handled, so a bigger one fails with SFPNG_ERROR_LIMIT_EXCEEDED when its
+header is read.  Image data, and chunks that are skipped, are streamed
+and so aren't limited.  Zero means no limit; the default is 8000000
+bytes, as libpng's. */
+void sfpng_decoder_set_max_chunk_size(sfpng_decoder* decoder,
+                                      uint32_t bytes);
+
+/** Set how much compressed metadata the decoder will inflate per image.
+
+Once the text in an image's zTXt chunks inflates to more than |bytes| in
+all, decoding fails with SFPNG_ERROR_LIMIT_EXCEEDED, before the decoder
+allocates past it.  Zero means no limit; the default is 8000000 bytes. */
+void sfpng_decoder_set_max_metadata_size(sfpng_decoder* decoder,
+                                         size_t bytes);
+
+/** Set how much memory the decoder will use for an image's pixels.
+
+This covers the row buffer, the whole image that an interlaced image is
+decoded into, and the buffers that decoding with threads uses.  An
+image that would need more than |bytes| of them fails with
+SFPNG_ERROR_LIMIT_EXCEEDED as soon as its header is read, before any of
+them are allocated, except that restart points that would need too much
+are ignored instead.  Zero means no limit; the default is 1 << 30 bytes.
+Must be called before the image header is decoded to take effect. */
+void sfpng_decoder_set_max_decoded_size(sfpng_decoder* decoder,
+                                        uint64_t bytes);
+
+/** Set how many worker threads decode non-interlaced images.
+
+With threads, decoding is pipelined: the thread calling
+sfpng_decoder_write only inflates, while the workers unfilter the rows
+(which has to be done in order) and convert them into the output buffer
+(which they share out).  This pays off for large images.  The callbacks
+are still called in order on the calling thread, but rows reach them a
+little later than they otherwise would, and the info callback is called
+just before the first row is unfiltered rather than after.  The output
+buffer must be set from the info callback, if at all, and then left
+alone until the image is done.  Interlaced images, and all images when
+|threads| is zero (the default), are decoded on the calling thread.
+The row buffer rows setting controls the size of the blocks rows are
+handed between threads in, of which there are four.
+
+If the image has restart points in an sfRS chunk (see the manual), the
+workers instead inflate the segments between them too, each on its own.
+Then the callbacks all come once a segment's data has arrived and been
+decoded, and the info callback once the image data starts.  Takes effect
+from the start of the next image's data. */
+void sfpng_decoder_set_threads(sfpng_decoder* decoder, int threads);
+
+/** Set whether image data is decompressed with sfpng's own inflater.
+
+sfpng includes a DEFLATE decoder tuned for PNG image data, which is
+usually quite a bit faster than zlib's.  By default image data goes
+through zlib, unless sfpng was built with SFPNG_BUILTIN_INFLATE
+defined.  Compressed text is always handled by zlib.  Takes effect from
+the start of the next image's data. */
+void sfpng_decoder_set_builtin_inflate(sfpng_decoder* decoder, int enable);
+
 /** Get the image width in pixels.
 
 (Only valid after the info callback). */
@@ -173,3 +392,248 @@ XXX finish me. */
 void sfpng_decoder_transform(sfpng_decoder* decoder,
                              int row, const uint8_t* buf,
                              uint8_t* out);
+
+/** Pixel layouts the decoder can write into an output buffer.
+
+Both are 8 bits per channel, 32 bits per pixel, named in memory order. */
+typedef enum {
+  SFPNG_FORMAT_RGBA8888,
+  SFPNG_FORMAT_BGRA8888,
+} sfpng_format;
+
+/** Have the decoder write converted pixels straight into a buffer.
+
+Each row of the image is converted to |format| and written to
+|buf| + row * |row_stride| as soon as it is decoded, before the row
+callback (if any) is called for it.  The buffer must hold height rows of
+at least four bytes per pixel.  A |row_stride| of zero writes every row
+to the same place, for callers that consume each row from the row
+callback.  With interlace preview enabled, rows are written again each
+time a pass refines them.
+
+This is usually called from the info callback, once the image size is
+known; pass a NULL |buf| to stop writing output. */
+void sfpng_decoder_set_output(sfpng_decoder* decoder,
+                              uint8_t* buf,
+                              ptrdiff_t row_stride,
+                              sfpng_format format);
+
+/** Have the decoder scale the image down into the output buffer.
+
+The output buffer then holds |width| by |height| pixels, each the
+average of the box of image pixels it covers, with their color weighted
+by alpha so that transparent pixels don't tint it.  To shrink an image
+by a factor of n, as for a thumbnail, pass the image size divided by n
+and rounded up; any size no larger than the image works.  The rows are
+summed into the output as they're decoded, so only about a row of the
+output is needed besides the buffer, and the output rows are written
+once each, in order.  Interlace preview is off for scaled output.
+
+Call from the info callback, along with sfpng_decoder_set_output(); it
+lasts for the current image.  Fails if the size is out of range or the
+decoder can't allocate the sums. */
+sfpng_status sfpng_decoder_set_output_size(sfpng_decoder* decoder,
+                                           int width, int height)
+  SFPNG_WARN_UNUSED_RESULT;
+
+/** Counts of where a decoder's time and memory have gone.
+
+Times are in nanoseconds of wall-clock time on the thread doing the
+work, and bytes are those going into each phase: the chunk data copied
+into the chunk buffer, the data whose CRC was checked, the compressed
+image data inflated and the scanlines it produced, and the rows
+unfiltered and converted.  The filter counts are indexed by filter type,
+none through paeth.  Allocations are every call to the allocator,
+including zlib's.  The peaks are the sizes of the buffers for chunk
+data, scanlines and deinterlacing, which only ever grow. */
+typedef struct {
+  uint64_t chunk_bytes, chunk_ns;
+  uint64_t crc_bytes, crc_ns;
+  uint64_t inflate_calls, inflate_in_bytes, inflate_out_bytes, inflate_ns;
+  uint64_t filter_rows[5], filter_bytes[5], filter_ns[5];
+  uint64_t transform_rows, transform_ns;
+  uint64_t alloc_calls, alloc_bytes;
+  uint64_t peak_chunk_buf, peak_row_buf, peak_image_buf;
+} sfpng_stats;
+
+/** Get the decoder's statistics, returning whether there are any.
+
+They are only kept if sfpng was built with SFPNG_STATS defined, as
+timing every phase costs something; otherwise all but the peaks are zero
+and this returns 0.  They add up over every image the decoder has decoded since
+it was made or they were last cleared, and only cover work done on the
+calling thread: with threads set, the workers' inflating, unfiltering
+and converting isn't counted. */
+int sfpng_decoder_get_stats(const sfpng_decoder* decoder, sfpng_stats* stats);
+
+/** Zero the decoder's statistics. */
+void sfpng_decoder_clear_stats(sfpng_decoder* decoder);
+
+
+/** The opaque type storing the encode state.
+
+The encoder mirrors the decoder: rows of raw pixels are pushed into it
+one or more at a time, and the encoded file comes out of a callback as
+it is produced. */
+typedef struct _sfpng_encoder sfpng_encoder;
+
+/** Allocate and initialize a new encoder. */
+sfpng_encoder* sfpng_encoder_new();
+
+/** Allocate and initialize a new encoder that uses a custom allocator.
+
+As with sfpng_decoder_new_with_allocator(), everything the encoder
+allocates, including zlib's state, goes through the hooks. */
+sfpng_encoder* sfpng_encoder_new_with_allocator(sfpng_alloc_func alloc_func,
+                                                sfpng_free_func free_func,
+                                                void* opaque);
+/** Free an encoder. */
+void sfpng_encoder_free(sfpng_encoder* encoder);
+
+/** Get an encoder ready to encode another image.
+
+This can be called at any point, and discards everything about the
+current image, including its header and palette.  The callback, context
+and options are kept, as are the encoder's buffers and zlib state. */
+void sfpng_encoder_reset(sfpng_encoder* encoder);
+
+/** Set an arbitrary pointer on an encoder. */
+void sfpng_encoder_set_context(sfpng_encoder* encoder, void* context);
+
+/** Get the pointer set by _set_context(). */
+void* sfpng_encoder_get_context(sfpng_encoder* encoder);
+
+/** The type of the callback that receives the encoded file.
+
+The file is passed in order, a piece at a time; the pieces are only
+valid during the call. */
+typedef void (*sfpng_write_func)(sfpng_encoder* encoder,
+                                 const uint8_t* buf,
+                                 int len);
+/** Set the callback that receives the encoded file. */
+void sfpng_encoder_set_write_func(sfpng_encoder* encoder,
+                                  sfpng_write_func write_func);
+
+/** How the encoder picks each row's filter, for _set_filter().
+
+The first five use the same filter for every row, and have the values
+the PNG spec gives the filters.  The rest try every filter on each row
+and keep the one that looks like it will compress best. */
+typedef enum {
+  SFPNG_FILTER_NONE    = 0,
+  SFPNG_FILTER_SUB     = 1,
+  SFPNG_FILTER_UP      = 2,
+  SFPNG_FILTER_AVERAGE = 3,
+  SFPNG_FILTER_PAETH   = 4,
+  /** The smallest sum of the filtered bytes taken as signed values, as
+      suggested by the PNG spec and done by libpng. */
+  SFPNG_FILTER_MIN_SUM,
+  /** The smallest entropy of the filtered bytes, which is slower but
+      usually a little smaller. */
+  SFPNG_FILTER_MIN_ENTROPY,
+  /** No filter for paletted images and those of less than 8 bits per
+      sample, where filtering rarely helps, and otherwise
+      SFPNG_FILTER_MIN_SUM.  This is the default. */
+  SFPNG_FILTER_DEFAULT,
+} sfpng_filter;
+
+/** Set how the encoder picks each row's filter. */
+void sfpng_encoder_set_filter(sfpng_encoder* encoder, sfpng_filter filter);
+
+/** How the image data is compressed, for _set_strategy(). */
+typedef enum {
+  /** zlib's usual search for matches. */
+  SFPNG_STRATEGY_DEFAULT,
+  /** Only look for runs of the same byte, so only matches one byte back.
+      With a filter, such runs are most of what there is to find in
+      many images, and this is much faster than a full search; it's the
+      fast mode for when latency matters more than size. */
+  SFPNG_STRATEGY_RLE,
+  /** No matches at all, just Huffman coding of the filtered bytes.  The
+      fastest, but it gets much less out of flat areas than RLE. */
+  SFPNG_STRATEGY_HUFFMAN_ONLY,
+} sfpng_strategy;
+
+/** Set the zlib compression level, from 0 (none) to 9 (smallest).
+
+The default is zlib's, 6.  Takes effect from the next image. */
+void sfpng_encoder_set_level(sfpng_encoder* encoder, int level);
+
+/** Set how image data is compressed.
+
+The default is SFPNG_STRATEGY_DEFAULT.  For the fast mode, use
+SFPNG_STRATEGY_RLE with a low level and a fixed filter such as
+SFPNG_FILTER_SUB or SFPNG_FILTER_UP.  Takes effect from the next
+image. */
+void sfpng_encoder_set_strategy(sfpng_encoder* encoder,
+                                sfpng_strategy strategy);
+
+/** Set how many worker threads encode non-interlaced images.
+
+With threads, the image is cut into bands of rows that the workers
+filter and compress in parallel, each as a separate piece of one zlib
+stream, and the file comes out as each band is done, one IDAT chunk
+per band, on the calling thread.  The file is a little bigger than it
+would be without threads, and the rows are copied, but for large
+images the encoding speeds up nearly in proportion to the threads.
+Interlaced images, and all images when |threads| is zero (the
+default), are encoded on the calling thread.  Takes effect from the
+next image. */
+void sfpng_encoder_set_threads(sfpng_encoder* encoder, int threads);
+
+/** Set how many rows go in each band encoded by a worker thread.
+
+Zero (the default) picks bands of about 256kb.  Twice as many bands as
+there are threads are held in memory at once. */
+void sfpng_encoder_set_band_rows(sfpng_encoder* encoder, int rows);
+
+/** Set the image header.
+
+|depth| and |color_type| must be a combination the PNG spec allows, and
+|interlaced| selects Adam7 interlacing, for which the encoder has to
+hold on to the whole image until its last row.  Must be called before
+the first row is written.  Returns SFPNG_ERROR_BAD_ATTRIBUTE for an
+invalid header. */
+sfpng_status sfpng_encoder_set_header(sfpng_encoder* encoder,
+                                      int width, int height, int depth,
+                                      sfpng_color_type color_type,
+                                      int interlaced)
+  SFPNG_WARN_UNUSED_RESULT;
+
+/** Set the palette of a paletted image.
+
+|rgb| has |entries| entries of 3 bytes each, as from
+sfpng_decoder_get_palette().  |alpha|, which may be NULL, has the
+alpha of the first |alpha_entries| of them, and is written as a tRNS
+chunk.  Truecolor images may have a palette too, as a suggestion for
+displays with fewer colors, but without alpha.  Must be called after
+_set_header() and before the first row.  Returns
+SFPNG_ERROR_BAD_ATTRIBUTE for a grayscale image or a palette that's too
+big. */
+sfpng_status sfpng_encoder_set_palette(sfpng_encoder* encoder,
+                                       const uint8_t* rgb, int entries,
+                                       const uint8_t* alpha,
+                                       int alpha_entries)
+  SFPNG_WARN_UNUSED_RESULT;
+
+/** Write |count| rows of the image, the first |buf| and each of the
+rest |stride| bytes after the one before.
+
+Rows are in the same raw format the decoder's row callback uses: packed
+samples of the header's depth, with 16-bit samples most significant
+byte first.  The file starts coming out of the write callback with the
+first rows, and the last row of the image finishes it.
+
+Writing more rows than the image has, or fewer than none, returns
+SFPNG_ERROR_BAD_ATTRIBUTE without writing anything.  Otherwise, as with
+the decoder, it is an error to keep using the encoder after this
+function returns any status other than success, until it is reset. */
+sfpng_status sfpng_encoder_write_rows(sfpng_encoder* encoder,
+                                      const uint8_t* buf,
+                                      ptrdiff_t stride,
+                                      int count) SFPNG_WARN_UNUSED_RESULT;
+
+/** Write a single row of the image, as _write_rows(). */
+sfpng_status sfpng_encoder_write_row(sfpng_encoder* encoder,
+                                     const uint8_t* buf)
+  SFPNG_WARN_UNUSED_RESULT;
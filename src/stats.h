@@ -0,0 +1,33 @@
+/* Keeping the decoder's sfpng_stats, if sfpng is built with SFPNG_STATS
+   defined.  Otherwise these all expand to nothing, so that the hot paths
+   are just as they'd be without them.
+
+   A phase is timed by putting STATS_START(name) before it and
+   STATS_STOP(decoder, name, field) after, in the same block, which adds
+   the time between them to the field.  STATS_SAVE likewise keeps any
+   other value to compare against later as STATS_SAVED(name). */
+#ifdef SFPNG_STATS
+
+#include <time.h>
+
+static uint64_t stats_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+#define STATS_SAVE(name, value) const uint64_t stats_##name = (value)
+#define STATS_SAVED(name) stats_##name
+#define STATS_START(name) STATS_SAVE(name, stats_now())
+#define STATS_STOP(decoder, name, field) \
+  ((decoder)->stats.field += stats_now() - STATS_SAVED(name))
+#define STATS_ADD(decoder, field, n) ((decoder)->stats.field += (n))
+
+#else
+
+#define STATS_SAVE(name, value)
+#define STATS_START(name)
+#define STATS_STOP(decoder, name, field)
+#define STATS_ADD(decoder, field, n)
+
+#endif
@@ -1,98 +1,392 @@
 #include "sfpng.h"
 
+#include <string.h>
+
+#if defined(__SSE2__) && !defined(SFPNG_NO_SIMD)
+#define TRANSFORM_SSE2 1
+#include <emmintrin.h>
+#if defined(__GNUC__)
+#define TRANSFORM_SSSE3 1
+#include <tmmintrin.h>
+#endif
+#endif
+
 #include "decoder.h"
+#include "scale.h"
+#include "stats.h"
+#include "transform.h"
 
-void sfpng_decoder_transform(sfpng_decoder* decoder,
-                             int row,
-                             const uint8_t* in,
-                             uint8_t* out) {
-  out += row * (4 * decoder->width);
+/* Row converters from each PNG pixel format to 8-bit RGBA.  One of these
+   is picked per image by transform_select, so none of them look at the
+   image format per pixel.
 
-  const int depth = decoder->bit_depth;
-  int in_len_pixels = decoder->width;
-  int bit = 8 - depth;
+   16-bit samples are reduced to their high byte, and tRNS comparisons
+   are always done against the full-precision sample values. */
 
+/* Grayscale at 1, 2 or 4 bits per pixel, scaled up to 8 bits. */
+static void gray_low(const sfpng_decoder* decoder,
+                     const uint8_t* in, uint8_t* out, int width) {
+  const int depth = decoder->bit_depth;
   const int mask = (1 << depth) - 1;
+  const int scale = 255 / mask;
+  const int trans = decoder->has_trans ? decoder->trans.value : -1;
+  int bit = 8 - depth;
+  int x;
 
-  while (in_len_pixels) {
-    int r = 0, g = 0, b = 0, a = 0xFFFF;
-    int value = 0;
-    if (depth < 8) {
-      if (bit < 0) {
-        bit = 8 - depth;
-        ++in;
-      }
-      value = (*in >> bit) & mask;
-      r = g = b = value * (255 / mask);
-      bit -= depth;
-    } else if (depth == 8) {
-      if (decoder->color_type == SFPNG_COLOR_TRUECOLOR ||
-          decoder->color_type == SFPNG_COLOR_TRUECOLOR_ALPHA) {
-        r = *in++;
-        g = *in++;
-        b = *in++;
-      } else {
-        value = r = g = b = *in++;
-      }
-      if (decoder->color_type & SFPNG_COLOR_MASK_ALPHA)
-        a = *in++;
-    } else if (depth == 16) {
-      if (decoder->color_type & SFPNG_COLOR_MASK_COLOR) {
-        r = in[0] << 8 | in[1]; in += 2;
-        g = in[0] << 8 | in[1]; in += 2;
-        b = in[0] << 8 | in[1]; in += 2;
-      } else {
-        value = r = g = b = in[0] << 8 | in[1];
-        in += 2;
-      }
-      if (decoder->color_type & SFPNG_COLOR_MASK_ALPHA) {
-        a = in[0] << 8 | in[1];
-        in += 2;
-      }
+  for (x = 0; x < width; ++x) {
+    if (bit < 0) {
+      bit = 8 - depth;
+      ++in;
     }
+    int value = (*in >> bit) & mask;
+    bit -= depth;
+    out[0] = out[1] = out[2] = value * scale;
+    out[3] = value == trans ? 0 : 0xFF;
+    out += 4;
+  }
+}
+
+static void gray8(const sfpng_decoder* decoder,
+                  const uint8_t* in, uint8_t* out, int width) {
+  int x = 0;
+#if TRANSFORM_SSE2
+  const __m128i opaque = _mm_set1_epi8((char)0xFF);
+  for (; x + 16 <= width; x += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i*)(in + x));
+    __m128i gg = _mm_unpacklo_epi8(v, v);
+    __m128i ga = _mm_unpacklo_epi8(v, opaque);
+    _mm_storeu_si128((__m128i*)(out + 0), _mm_unpacklo_epi16(gg, ga));
+    _mm_storeu_si128((__m128i*)(out + 16), _mm_unpackhi_epi16(gg, ga));
+    gg = _mm_unpackhi_epi8(v, v);
+    ga = _mm_unpackhi_epi8(v, opaque);
+    _mm_storeu_si128((__m128i*)(out + 32), _mm_unpacklo_epi16(gg, ga));
+    _mm_storeu_si128((__m128i*)(out + 48), _mm_unpackhi_epi16(gg, ga));
+    out += 64;
+  }
+#endif
+  for (; x < width; ++x) {
+    out[0] = out[1] = out[2] = in[x];
+    out[3] = 0xFF;
+    out += 4;
+  }
+}
 
-    if (decoder->color_type == SFPNG_COLOR_INDEXED) {
-      if (value >= decoder->palette.entries) {
-        /* This is an error by the spec, but we don't have an error
-           return path.  Just use 0 values to match libpng. */
-        r = g = b = 0;
-      } else {
-        const uint8_t* palette = decoder->palette.bytes + (3 * value);
-        r = palette[0];
-        g = palette[1];
-        b = palette[2];
-      }
+static void gray8_trans(const sfpng_decoder* decoder,
+                        const uint8_t* in, uint8_t* out, int width) {
+  const int trans = decoder->trans.value;
+  int x;
+  for (x = 0; x < width; ++x) {
+    out[0] = out[1] = out[2] = in[x];
+    out[3] = in[x] == trans ? 0 : 0xFF;
+    out += 4;
+  }
+}
+
+static void gray16(const sfpng_decoder* decoder,
+                   const uint8_t* in, uint8_t* out, int width) {
+  const int trans = decoder->has_trans ? decoder->trans.value : -1;
+  int x;
+  for (x = 0; x < width; ++x) {
+    out[0] = out[1] = out[2] = in[0];
+    out[3] = (in[0] << 8 | in[1]) == trans ? 0 : 0xFF;
+    in += 2;
+    out += 4;
+  }
+}
+
+static void gray_alpha8(const sfpng_decoder* decoder,
+                        const uint8_t* in, uint8_t* out, int width) {
+  int x;
+  for (x = 0; x < width; ++x) {
+    out[0] = out[1] = out[2] = in[0];
+    out[3] = in[1];
+    in += 2;
+    out += 4;
+  }
+}
+
+static void gray_alpha16(const sfpng_decoder* decoder,
+                         const uint8_t* in, uint8_t* out, int width) {
+  int x;
+  for (x = 0; x < width; ++x) {
+    out[0] = out[1] = out[2] = in[0];
+    out[3] = in[2];
+    in += 4;
+    out += 4;
+  }
+}
+
+static void rgb8(const sfpng_decoder* decoder,
+                 const uint8_t* in, uint8_t* out, int width) {
+  int x;
+  for (x = 0; x < width; ++x) {
+    out[0] = in[0];
+    out[1] = in[1];
+    out[2] = in[2];
+    out[3] = 0xFF;
+    in += 3;
+    out += 4;
+  }
+}
+
+#if TRANSFORM_SSSE3
+__attribute__((target("ssse3")))
+static void rgb8_ssse3(const sfpng_decoder* decoder,
+                       const uint8_t* in, uint8_t* out, int width) {
+  const __m128i shuffle = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1,
+                                        6, 7, 8, -1, 9, 10, 11, -1);
+  const __m128i opaque = _mm_set1_epi32((int)0xFF000000);
+  int x = 0;
+  /* Each step loads 16 bytes but only uses the first 12, so stop while
+     that read is still within the row. */
+  for (; (width - x) * 3 >= 16; x += 4) {
+    __m128i v = _mm_loadu_si128((const __m128i*)in);
+    v = _mm_or_si128(_mm_shuffle_epi8(v, shuffle), opaque);
+    _mm_storeu_si128((__m128i*)out, v);
+    in += 12;
+    out += 16;
+  }
+  rgb8(decoder, in, out, width - x);
+}
+#endif
+
+static void rgb8_trans(const sfpng_decoder* decoder,
+                       const uint8_t* in, uint8_t* out, int width) {
+  const trans* t = &decoder->trans;
+  int x;
+  for (x = 0; x < width; ++x) {
+    out[0] = in[0];
+    out[1] = in[1];
+    out[2] = in[2];
+    out[3] = (in[0] == t->r && in[1] == t->g && in[2] == t->b) ? 0 : 0xFF;
+    in += 3;
+    out += 4;
+  }
+}
+
+static void rgb16(const sfpng_decoder* decoder,
+                  const uint8_t* in, uint8_t* out, int width) {
+  const trans* t = &decoder->trans;
+  const int has_trans = decoder->has_trans;
+  int x;
+  for (x = 0; x < width; ++x) {
+    out[0] = in[0];
+    out[1] = in[2];
+    out[2] = in[4];
+    out[3] = 0xFF;
+    if (has_trans &&
+        (in[0] << 8 | in[1]) == t->r &&
+        (in[2] << 8 | in[3]) == t->g &&
+        (in[4] << 8 | in[5]) == t->b) {
+      out[3] = 0;
     }
+    in += 6;
+    out += 4;
+  }
+}
 
-    if (decoder->has_trans) {
-      if (decoder->color_type == SFPNG_COLOR_INDEXED) {
-        int i;
-        for (i = 0; i < decoder->trans.palette.entries; ++i)
-          if (value == decoder->trans.palette.bytes[i])
-            a = 0;
-      } else if (decoder->color_type & SFPNG_COLOR_MASK_COLOR) {
-        if (r == decoder->trans.r &&
-            g == decoder->trans.g &&
-            b == decoder->trans.b) {
-          a = 0;
-        }
-      } else {
-        if (value == decoder->trans.value)
-          a = 0;
-      }
+static void rgba8(const sfpng_decoder* decoder,
+                  const uint8_t* in, uint8_t* out, int width) {
+  memcpy(out, in, 4 * width);
+}
+
+static void rgba16(const sfpng_decoder* decoder,
+                   const uint8_t* in, uint8_t* out, int width) {
+  int x;
+  for (x = 0; x < width; ++x) {
+    out[0] = in[0];
+    out[1] = in[2];
+    out[2] = in[4];
+    out[3] = in[6];
+    in += 8;
+    out += 4;
+  }
+}
+
+/* Fill in decoder->palette_rgba with the RGBA value of every possible
+   index, with the tRNS alpha folded in.  Indices past the end of the
+   palette are an error by the spec, but we don't have an error return
+   path; they get 0 color values to match libpng. */
+static void build_palette_rgba(sfpng_decoder* decoder) {
+  const palette* pal = &decoder->palette;
+  const palette* trans = &decoder->trans.palette;
+  int i;
+
+  for (i = 0; i < 256; ++i) {
+    uint8_t rgba[4] = { 0, 0, 0, 0xFF };
+    if (i < pal->entries)
+      memcpy(rgba, pal->bytes + 3 * i, 3);
+    if (decoder->has_trans && i < trans->entries)
+      rgba[3] = trans->bytes[i];
+    memcpy(&decoder->palette_rgba[i], rgba, 4);
+  }
+}
+
+static void indexed8(const sfpng_decoder* decoder,
+                     const uint8_t* in, uint8_t* out, int width) {
+  const uint32_t* lut = decoder->palette_rgba;
+  int x;
+  for (x = 0; x < width; ++x)
+    memcpy(out + 4 * x, &lut[in[x]], 4);
+}
+
+/* Paletted images at 1, 2 or 4 bits per pixel. */
+static void indexed_low(const sfpng_decoder* decoder,
+                        const uint8_t* in, uint8_t* out, int width) {
+  const uint32_t* lut = decoder->palette_rgba;
+  const int depth = decoder->bit_depth;
+  const int mask = (1 << depth) - 1;
+  int bit = 8 - depth;
+  int x;
+
+  for (x = 0; x < width; ++x) {
+    if (bit < 0) {
+      bit = 8 - depth;
+      ++in;
     }
+    memcpy(out + 4 * x, &lut[(*in >> bit) & mask], 4);
+    bit -= depth;
+  }
+}
+
+void transform_select(sfpng_decoder* decoder) {
+  const int depth = decoder->bit_depth;
+  const int has_trans = decoder->has_trans;
+  transform_func func = NULL;
 
-    if (decoder->bit_depth == 16) {
-      r >>= 8;
-      g >>= 8;
-      b >>= 8;
-      a >>= 8;
+  /* A tRNS chunk is not allowed for the types with an alpha channel,
+     and is ignored for them as in libpng. */
+  switch (decoder->color_type) {
+  case SFPNG_COLOR_GRAYSCALE:
+    if (depth < 8)
+      func = gray_low;
+    else if (depth == 8)
+      func = has_trans ? gray8_trans : gray8;
+    else
+      func = gray16;
+    break;
+  case SFPNG_COLOR_TRUECOLOR:
+    if (depth == 16) {
+      func = rgb16;
+    } else if (has_trans) {
+      func = rgb8_trans;
+    } else {
+      func = rgb8;
+#if TRANSFORM_SSSE3
+      if (__builtin_cpu_supports("ssse3"))
+        func = rgb8_ssse3;
+#endif
     }
+    break;
+  case SFPNG_COLOR_INDEXED:
+    build_palette_rgba(decoder);
+    func = depth == 8 ? indexed8 : indexed_low;
+    break;
+  case SFPNG_COLOR_GRAYSCALE_ALPHA:
+    func = depth == 8 ? gray_alpha8 : gray_alpha16;
+    break;
+  case SFPNG_COLOR_TRUECOLOR_ALPHA:
+    func = depth == 8 ? rgba8 : rgba16;
+    break;
+  }
+  decoder->transform_func = func;
+}
+
+void sfpng_decoder_transform(sfpng_decoder* decoder,
+                             int row,
+                             const uint8_t* in,
+                             uint8_t* out) {
+  if (!decoder->transform_func)
+    transform_select(decoder);
+  out += row * (4 * decoder->width);
+  STATS_START(transform);
+  decoder->transform_func(decoder, in, out, decoder->width);
+  STATS_STOP(decoder, transform, transform_ns);
+  STATS_ADD(decoder, transform_rows, 1);
+}
 
-    *out++ = r;
-    *out++ = g;
-    *out++ = b;
-    *out++ = a;
-    --in_len_pixels;
+/* Swap the R and B channels of |width| RGBA pixels in place. */
+static void swap_red_blue(uint8_t* p, int width) {
+  int x = 0;
+#if TRANSFORM_SSE2
+  const __m128i green_alpha = _mm_set1_epi32((int)0xFF00FF00);
+  const __m128i low = _mm_set1_epi32(0xFF);
+  for (; x + 4 <= width; x += 4) {
+    /* Little-endian lanes hold A,B,G,R from high to low byte. */
+    __m128i v = _mm_loadu_si128((const __m128i*)p);
+    __m128i rb = _mm_or_si128(_mm_and_si128(_mm_srli_epi32(v, 16), low),
+                              _mm_slli_epi32(_mm_and_si128(v, low), 16));
+    _mm_storeu_si128((__m128i*)p,
+                     _mm_or_si128(_mm_and_si128(v, green_alpha), rb));
+    p += 16;
+  }
+#endif
+  for (; x < width; ++x) {
+    uint8_t r = p[0];
+    p[0] = p[2];
+    p[2] = r;
+    p += 4;
   }
 }
+
+/* Convert a row to the output buffer's format and write it there. */
+static void output_row(sfpng_decoder* decoder, int row, const uint8_t* in) {
+  uint8_t* out = decoder->output_buf + row * decoder->output_stride;
+  decoder->transform_func(decoder, in, out, decoder->width);
+  if (decoder->output_format == SFPNG_FORMAT_BGRA8888)
+    swap_red_blue(out, decoder->width);
+}
+
+int transform_output_unordered(const sfpng_decoder* decoder) {
+  return decoder->output_buf && decoder->output_stride != 0 &&
+    !decoder->scale_width;
+}
+
+void transform_output_rows(sfpng_decoder* decoder, int row, int count,
+                           const uint8_t* buf, ptrdiff_t stride) {
+  int i;
+  for (i = 0; i < count; ++i)
+    output_row(decoder, row + i, buf + i * stride);
+}
+
+static void emit_rows(sfpng_decoder* decoder, int row, int count,
+                      const uint8_t* buf, ptrdiff_t stride, int output) {
+  int i;
+  for (i = 0; i < count; ++i) {
+    const uint8_t* in = buf + i * stride;
+    if (output && decoder->output_buf) {
+      /* Only rows converted here, on the calling thread, are counted;
+         transform_output_rows runs on the workers. */
+      STATS_START(transform);
+      if (decoder->scale_width)
+        scale_row(decoder, row + i, in);
+      else
+        output_row(decoder, row + i, in);
+      STATS_STOP(decoder, transform, transform_ns);
+      STATS_ADD(decoder, transform_rows, 1);
+    }
+    if (decoder->row_func)
+      decoder->row_func(decoder, row + i, in, decoder->stride);
+  }
+  if (decoder->rows_func)
+    decoder->rows_func(decoder, row, count, buf, stride, decoder->stride);
+}
+
+void transform_emit_rows(sfpng_decoder* decoder, int row, int count,
+                         const uint8_t* buf, ptrdiff_t stride) {
+  emit_rows(decoder, row, count, buf, stride, 1);
+}
+
+void transform_emit_output_rows(sfpng_decoder* decoder, int row, int count,
+                                const uint8_t* buf, ptrdiff_t stride) {
+  emit_rows(decoder, row, count, buf, stride, 0);
+}
+
+void sfpng_decoder_set_output(sfpng_decoder* decoder,
+                              uint8_t* buf,
+                              ptrdiff_t row_stride,
+                              sfpng_format format) {
+  decoder->output_buf = buf;
+  decoder->output_stride = row_stride;
+  decoder->output_format = format;
+}
@@ -0,0 +1,27 @@
+/* Pick the row converter used by sfpng_decoder_transform for the image's
+   format.  Must be called after all of the chunks that affect the
+   conversion (IHDR, PLTE, tRNS) have been processed. */
+void transform_select(sfpng_decoder* decoder);
+
+/* Pass |count| finished rows of the full image starting at |row|, in raw
+   format and |stride| bytes apart in |buf|, to the output buffer and the
+   row callback one at a time, and then to the batched row callback all
+   at once, whichever are set. */
+void transform_emit_rows(sfpng_decoder* decoder, int row, int count,
+                         const uint8_t* buf, ptrdiff_t stride);
+
+/* Whether rows can be written to the output buffer out of order, and so
+   by transform_output_rows on worker threads: not if there's no buffer,
+   if every row is written to the same place, or if the output is scaled,
+   as rows then have to come in order. */
+int transform_output_unordered(const sfpng_decoder* decoder);
+
+/* Convert |count| rows as for transform_emit_rows, but only write them
+   to the output buffer, which must be set and not scaled. */
+void transform_output_rows(sfpng_decoder* decoder, int row, int count,
+                           const uint8_t* buf, ptrdiff_t stride);
+
+/* Like transform_emit_rows, for rows that transform_output_rows has
+   already written to the output buffer. */
+void transform_emit_output_rows(sfpng_decoder* decoder, int row, int count,
+                                const uint8_t* buf, ptrdiff_t stride);
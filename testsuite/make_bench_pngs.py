@@ -0,0 +1,211 @@
+#!/usr/bin/python
+
+"""Generate a corpus of large PNGs to benchmark decoders on, such as
+with sfpng-bench.
+
+Unlike make_test_pngs.py, which makes small files that each poke at one
+corner of the format, these are meant to look to a decoder like real
+images at production sizes.  For each size, there is:
+
+  - an image of every color type and depth, with a mix of filters;
+  - a truecolor image with each filter type used on every row;
+  - truecolor images with the data in many small IDATs rather than one;
+  - interlaced truecolor and truecolor alpha images;
+  - a truecolor alpha image with a lot of metadata around the data.
+
+Generating real pictures and filtering them would take far too long in
+Python, so the scanlines are made up directly: runs of zeros, as smooth
+areas filter to, between runs of small noisy values, as detail does.
+Any filtered bytes are a valid image, which is all a decoder can tell.
+Everything is seeded from the file name, so the corpus is the same
+every time.
+
+usage: make_bench_pngs.py [--sizes 4k,8k,16k,WxH] [--level n] outdir
+"""
+
+import optparse
+import os
+import random
+import sys
+import zlib
+
+import pngforge
+
+SIZES = {
+    '4k': (3840, 2160),
+    '8k': (7680, 4320),
+    '16k': (15360, 8640),
+}
+
+# Color types and their allowed depths, as in 11.2.2 IHDR.
+COLOR_TYPES = [
+    ('gray', 0, 1, [1, 2, 4, 8, 16]),
+    ('truecolor', 2, 3, [8, 16]),
+    ('indexed', 3, 1, [1, 2, 4, 8]),
+    ('gray_alpha', 4, 2, [8, 16]),
+    ('truecolor_alpha', 6, 4, [8, 16]),
+]
+
+FILTER_NAMES = ['none', 'sub', 'up', 'average', 'paeth']
+
+# The size of each IDAT in the images split into many.
+SMALL_IDAT_BYTES = 4096
+
+def make_noise(length):
+    """Filtered detail: bytes clustered around zero, either way."""
+    rand = random.Random(0)
+    values = []
+    for i in range(length):
+        v = int(rand.expovariate(1 / 6.0))
+        values.append(chr((v if rand.random() < 0.5 else -v) & 0xff))
+    return ''.join(values)
+
+NOISE = make_noise(1 << 18)
+
+def residual_row(rand, length):
+    """|length| bytes of made-up filtered scanline."""
+    parts = []
+    n = 0
+    while n < length:
+        run = rand.randint(16, 2048)
+        if rand.random() < 0.3:
+            parts.append('\0' * run)
+        else:
+            start = rand.randint(0, len(NOISE) - run)
+            parts.append(NOISE[start:start + run])
+        n += run
+    return ''.join(parts)[:length]
+
+def image_data(rand, width, height, bits, filter, interlaced, level):
+    """The compressed scanlines of an image with |bits| per pixel, using
+    |filter| on every row, or a random one on each if it's None.  Rows
+    of less than a byte per pixel use no filter, as encoders do, and so
+    can have their padding bits zeroed, as encoders also do."""
+    if interlaced:
+        passes = pngforge.adam7_passes(width, height)
+    else:
+        passes = [(width, height)]
+    c = zlib.compressobj(level)
+    data = []
+    for pass_width, pass_height in passes:
+        if pass_width == 0:
+            continue
+        length = (pass_width * bits + 7) // 8
+        padding = length * 8 - pass_width * bits
+        for y in range(pass_height):
+            row = residual_row(rand, length)
+            if bits < 8:
+                f = 0
+                row = row[:-1] + chr(ord(row[-1]) >> padding << padding)
+            elif filter is not None:
+                f = filter
+            else:
+                f = rand.randint(0, 4)
+            data.append(c.compress(pngforge.scanline(f, row)))
+    data.append(c.flush())
+    return ''.join(data)
+
+def palette(depth):
+    """A palette with an entry for every index, so any data is valid."""
+    return pngforge.chunk('PLTE', ''.join(
+        [pngforge.rgb(i * 37 & 0xff, i * 91 & 0xff, i * 13 & 0xff)
+         for i in range(1 << depth)]))
+
+def metadata(rand):
+    """Lots of the ancillary chunks images pick up on their way through
+    editors and cameras."""
+    words = ['lorem', 'ipsum', 'dolor', 'sit', 'amet', 'map', 'tile',
+             'export', 'layer', 'render']
+    def prose(n):
+        return ' '.join([rand.choice(words) for i in range(n)])
+    chunks = []
+    for i in range(100):
+        chunks.append(pngforge.text('Comment%d' % i, prose(40)))
+    for i in range(20):
+        chunks.append(pngforge.ztxt('Description%d' % i, prose(800)))
+    for i in range(20):
+        chunks.append(pngforge.itxt('Title%d' % i, prose(60), 'en'))
+    profile = ''.join([chr(rand.randint(0, 255)) for i in range(1 << 14)])
+    chunks.append(pngforge.chunk('iCCP', 'profile\0\0' +
+                                 zlib.compress(profile * 8)))
+    chunks.append(pngforge.chunk('eXIf', 'MM\0\x2a' +
+                                 profile[:4096] * 8))
+    for i in range(10):
+        chunks.append(pngforge.chunk('prVt', profile[:2048]))
+    return ''.join(chunks)
+
+def make_png(name, width, height, color_type, depth, filter=None,
+             interlaced=False, small_idats=False, extra_metadata=False,
+             level=6):
+    rand = random.Random(zlib.crc32(name) & 0xffffffff)
+    channels = [c[2] for c in COLOR_TYPES if c[1] == color_type][0]
+    data = image_data(rand, width, height, channels * depth, filter,
+                      interlaced, level)
+    png = [pngforge.sig(),
+           pngforge.ihdr(width, height, depth, color_type,
+                         interlace=int(interlaced))]
+    if extra_metadata:
+        png.append(metadata(rand))
+    if color_type == pngforge.COLOR_INDEXED:
+        png.append(palette(depth))
+    if small_idats:
+        png.append(pngforge.split_idats(data, SMALL_IDAT_BYTES))
+    else:
+        png.append(pngforge.chunk('IDAT', data))
+    if extra_metadata:
+        png.append(pngforge.text('Software', 'make_bench_pngs.py'))
+    png.append(pngforge.iend())
+    return ''.join(png)
+
+def corpus(size_name, width, height):
+    """The (name, make_png arguments) of each image of the given size."""
+    images = []
+    for color_name, color_type, channels, depths in COLOR_TYPES:
+        for depth in depths:
+            images.append(('%s_%s%d' % (size_name, color_name, depth),
+                           dict(color_type=color_type, depth=depth)))
+    for filter, filter_name in enumerate(FILTER_NAMES):
+        images.append(('%s_truecolor8_%s' % (size_name, filter_name),
+                       dict(color_type=2, depth=8, filter=filter)))
+    for color_name, color_type in [('truecolor', 2),
+                                   ('truecolor_alpha', 6)]:
+        images.append(('%s_%s8_small_idats' % (size_name, color_name),
+                       dict(color_type=color_type, depth=8,
+                            small_idats=True)))
+        images.append(('%s_%s8_interlaced' % (size_name, color_name),
+                       dict(color_type=color_type, depth=8,
+                            interlaced=True)))
+    images.append(('%s_truecolor_alpha8_metadata' % size_name,
+                   dict(color_type=6, depth=8, extra_metadata=True)))
+    return images
+
+def parse_size(size):
+    if size in SIZES:
+        return size, SIZES[size]
+    width, height = [int(n) for n in size.split('x')]
+    return size, (width, height)
+
+if __name__ == '__main__':
+    parser = optparse.OptionParser(
+        usage='%prog [--sizes 4k,8k,16k,WxH] [--level n] outdir')
+    parser.add_option('--sizes', default='4k',
+                      help='comma-separated image sizes (default 4k)')
+    parser.add_option('--level', type='int', default=6,
+                      help='zlib compression level (default 6)')
+    options, args = parser.parse_args()
+    if len(args) != 1:
+        parser.error('need an output directory')
+    outdir = args[0]
+    if not os.path.isdir(outdir):
+        os.makedirs(outdir)
+
+    for size in options.sizes.split(','):
+        size_name, (width, height) = parse_size(size)
+        for name, kwargs in corpus(size_name, width, height):
+            filename = os.path.join(outdir, name + '.png')
+            sys.stdout.write(filename + '\n')
+            sys.stdout.flush()
+            content = make_png(name, width, height, level=options.level,
+                               **kwargs)
+            with open(filename, 'wb') as f:
+                f.write(content)
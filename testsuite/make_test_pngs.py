@@ -1,6 +1,10 @@
 #!/usr/bin/python
 
+import math
 import os
+import struct
+import zlib
+from fractions import Fraction
 
 import pngforge
 
@@ -21,6 +25,49 @@ def png_invalid_chunk_size_big():
     """Return a chunk that claims to be 1gb."""
     return pngforge.sig() + pngforge.chunk('BIGC', length=2**30)
 
+def png_invalid_huge_dimensions():
+    """An image as wide and tall as the spec allows, with 64-bit pixels,
+    whose rows alone would be 16gb."""
+    return (pngforge.sig() +
+            pngforge.ihdr(2**31 - 1, 2**31 - 1, depth=16, color_type=6) +
+            pngforge.idat(pngforge.scanline(0, '\0' * 8)) +
+            pngforge.iend())
+
+def unfinished_idat(size):
+    """An IDAT holding the start of a zlib stream, |size| zero bytes of
+    image data, and no further."""
+    c = zlib.compressobj()
+    return pngforge.chunk('IDAT', c.compress('\0' * size) +
+                          c.flush(zlib.Z_SYNC_FLUSH))
+
+def png_invalid_budget_interlaced():
+    """An interlaced image that would take 20mb to hold, well over the
+    decoded size limit sfpng-dumper sets, while a row takes 4mb.  The
+    first row is there, as the image is only allocated for that."""
+    return (pngforge.sig() +
+            pngforge.ihdr(1000000, 5, color_type=6, interlace=1) +
+            unfinished_idat(1 + 125000 * 4))
+
+def png_invalid_budget_row_buffer():
+    """Rows of 4mb, of which the row buffer fits one but not a batch of
+    five.  Less than a row is there, so none come out either way."""
+    return (pngforge.sig() + pngforge.ihdr(1000000, 23, color_type=6) +
+            unfinished_idat(1000000))
+
+def png_invalid_budget_pipeline():
+    """Rows of 2mb, of which the row buffer fits a few but the ring of
+    blocks decoding with threads doesn't."""
+    return (pngforge.sig() + pngforge.ihdr(500000, 23, color_type=6) +
+            unfinished_idat(500000))
+
+def png_invalid_budget_segments():
+    """Restart points on an image that fits the decoded size limit with
+    threads, but whose segments would need the whole 18mb image."""
+    index = struct.pack('>LL', 5, 100)
+    return (pngforge.sig() + pngforge.ihdr(300000, 20) +
+            pngforge.chunk('sfRS', index) +
+            unfinished_idat(300000))
+
 def png_invalid_bad_crc():
     """Return a chunk with a bad CRC."""
     return pngforge.sig() + pngforge.chunk('ABCD', crc=1)
@@ -37,6 +84,59 @@ def png_invalid_long_idat():
             pngforge.idat(pngforge.scanline(0, '\0' * 20)) +
             pngforge.iend())
 
+def png_invalid_truncated_idat():
+    """A file that ends halfway through its image data, stored rather than
+    compressed so that about half the rows are there.  Those rows should
+    still come out, in batches or not."""
+    rows = ''.join(restart_scanlines(9, 23))
+    data = pngforge.chunk('IDAT', zlib.compress(rows, 0))
+    return (pngforge.sig() + pngforge.ihdr(width=9, height=23) +
+            data[:8 + len(rows) // 2])
+
+def png_invalid_corrupt_deflate():
+    """Ten good rows, and then a fixed Huffman block with two literals of
+    the next row and a match whose distance code doesn't exist.  The good
+    rows should come out as libpng's do, although one inflate call gets
+    both them and the error.  (libpng's stops at the first literal, where
+    it has all of the tenth row; a bad block header there would be found
+    before the row was handed back.)"""
+    c = zlib.compressobj()
+    data = (c.compress(''.join(restart_scanlines(9, 23)[:10])) +
+            c.flush(zlib.Z_SYNC_FLUSH))
+    # The codes' bits, first bit first: the block header (final, fixed),
+    # literal 0 twice, length 3 and distance code 30.
+    bits = '1' + '10' + '00110000' * 2 + '0000001' + '11110'
+    bits += '0' * (-len(bits) % 8)
+    data += ''.join(chr(int(bits[i:i + 8][::-1], 2))
+                    for i in range(0, len(bits), 8))
+    return (pngforge.sig() + pngforge.ihdr(width=9, height=23) +
+            pngforge.chunk('IDAT', data) + pngforge.iend())
+
+def bad_filter_scanlines():
+    """The rows of restart_scanlines, except that the eighth has a filter
+    type that doesn't exist."""
+    scanlines = restart_scanlines(9, 23)
+    scanlines[7] = '\x05' + scanlines[7][1:]
+    return scanlines
+
+def png_invalid_bad_filter():
+    """Seven good rows and then one with a bad filter type, which with
+    threads comes partway through a block of rows."""
+    return (pngforge.sig() + pngforge.ihdr(width=9, height=23) +
+            pngforge.idat(''.join(bad_filter_scanlines())) +
+            pngforge.iend())
+
+def png_invalid_bad_filter_truncated():
+    """As invalid_bad_filter, but the file ends partway through the row
+    after the bad one.  With threads that leaves the bad row in a block
+    that isn't full, to be looked at once the file has ended.  Its filter
+    should still be the error, not the file being short."""
+    c = zlib.compressobj()
+    return (pngforge.sig() + pngforge.ihdr(width=9, height=23) +
+            pngforge.chunk('IDAT',
+                           c.compress(''.join(bad_filter_scanlines())[:240]) +
+                           c.flush(zlib.Z_SYNC_FLUSH)))
+
 def png_invalid_bad_palette_reference():
     """Leave out the palette on a paletted image."""
     return (pngforge.sig() +
@@ -65,11 +165,190 @@ def png_invalid_bad_palette_reference():
             pngforge.idat(pngforge.scanline(0, chr(64))) +
             pngforge.iend())
 
+def png_valid_palette_trans():
+    """A paletted image whose tRNS gives some entries partial alpha."""
+    palette = ''.join([pngforge.rgb(i * 64, 255 - i * 64, i) for i in range(4)])
+    return (pngforge.sig() +
+            pngforge.ihdr(width=4, height=1,
+                          color_type=pngforge.COLOR_INDEXED) +
+            pngforge.chunk('PLTE', palette) +
+            pngforge.chunk('tRNS', '\x80\x00\x40') +
+            pngforge.idat(pngforge.scanline(0, '\0\1\2\3')) +
+            pngforge.iend())
+
 def png_invalid_missing_iend():
     """A valid image, just missing the IEND."""
     return (pngforge.sig() + pngforge.ihdr(width=1, height=1) +
             pngforge.idat(pngforge.scanline(0, '\1\2\3')))
 
+def restart_scanlines(width, height):
+    """Rows of an RGB image using every filter, except that each fifth row
+    (where restart_idats restarts the stream) uses None or Sub."""
+    rows = []
+    for y in range(height):
+        filter = y % 2 if y % 5 == 0 else y % 5
+        pixels = ''.join([pngforge.rgb((x * 7 + y) & 0xff, (x * y) & 0xff,
+                                       (255 - x * 3 - y) & 0xff)
+                          for x in range(width)])
+        rows.append(pngforge.scanline(filter, pixels))
+    return rows
+
+def png_valid_restart_points():
+    """An image whose zlib stream restarts every five rows, with an sfRS
+    chunk saying where, so that threads can decode it in parallel."""
+    return (pngforge.sig() + pngforge.ihdr(width=9, height=23) +
+            pngforge.restart_idats(restart_scanlines(9, 23), 5) +
+            pngforge.iend())
+
+def png_valid_restart_points_bad_index():
+    """An sfRS chunk whose rows go backwards, which is ignored."""
+    index = struct.pack('>LLLL', 10, 100, 5, 200)
+    return (pngforge.sig() + pngforge.ihdr(width=9, height=23) +
+            pngforge.chunk('sfRS', index) +
+            pngforge.idat(''.join(restart_scanlines(9, 23))) +
+            pngforge.iend())
+
+def png_valid_restart_points_huge_offset():
+    """An sfRS chunk claiming a restart 4gb into a small image's data,
+    which is ignored rather than making room for that much data."""
+    index = struct.pack('>LLLL', 5, 100, 10, 2**32 - 16)
+    return (pngforge.sig() + pngforge.ihdr(width=9, height=23) +
+            pngforge.chunk('sfRS', index) +
+            pngforge.idat(''.join(restart_scanlines(9, 23))) +
+            pngforge.iend())
+
+def png_valid_restart_points_wrong_rows():
+    """An sfRS chunk with the right offsets but a row that's off by one,
+    so that a segment comes up short after the first has been decoded.
+    The decoder should start over without the index."""
+    scanlines = restart_scanlines(9, 23)
+    points, data = pngforge.restart_stream(scanlines, 5)
+    points[1] = (points[1][0] + 1, points[1][1])
+    return (pngforge.sig() + pngforge.ihdr(width=9, height=23) +
+            pngforge.restart_index(points) +
+            ''.join([pngforge.chunk('IDAT', d) for d in data]) +
+            pngforge.iend())
+
+def png_valid_restart_points_wrong_offsets():
+    """An sfRS chunk that looks fine but whose stream never restarts."""
+    scanlines = restart_scanlines(9, 23)
+    data = zlib.compress(''.join(scanlines))
+    points = [(5, len(data) / 4), (10, len(data) / 2), (15, len(data) * 3 / 4)]
+    return (pngforge.sig() + pngforge.ihdr(width=9, height=23) +
+            pngforge.restart_index(points) + pngforge.idat(''.join(scanlines)) +
+            pngforge.iend())
+
+def png_valid_restart_points_sync_flush():
+    """An sfRS chunk pointing at sync flushes rather than full ones, so
+    that each segment refers back to rows before it."""
+    pixels = ''.join([pngforge.rgb(x, 2 * x, 3 * x) for x in range(9)])
+    scanlines = [pngforge.scanline(0, pixels)] * 23
+    points, data = pngforge.restart_stream(scanlines, 5, zlib.Z_SYNC_FLUSH)
+    return (pngforge.sig() + pngforge.ihdr(width=9, height=23) +
+            pngforge.restart_index(points) +
+            ''.join([pngforge.chunk('IDAT', d) for d in data]) +
+            pngforge.iend())
+
+def png_valid_restart_points_dependent_rows():
+    """Proper restart points, but at rows that use the row before them."""
+    scanlines = [pngforge.scanline(4, row[1:])
+                 for row in restart_scanlines(9, 23)]
+    return (pngforge.sig() + pngforge.ihdr(width=9, height=23) +
+            pngforge.restart_idats(scanlines, 5) +
+            pngforge.iend())
+
+def png_valid_restart_points_trailing_data():
+    """Proper restart points, with more IDAT data after the zlib stream
+    than the rows could take up compressed.  The last segment should stop
+    keeping the data there, rather than growing to hold all of it."""
+    return (pngforge.sig() + pngforge.ihdr(width=9, height=23) +
+            pngforge.restart_idats(restart_scanlines(9, 23), 5) +
+            pngforge.chunk('IDAT', '\0' * 4000) +
+            pngforge.iend())
+
+def png_valid_restart_points_stored_bytes():
+    """A restart point after the first five rows, and the rest of the rows
+    stored a byte per deflate block, which takes up more than the rows
+    would compressed by any sensible encoder.  The decoder should give up
+    on the segments partway through that data and go on without them,
+    losing none of it."""
+    scanlines = restart_scanlines(9, 23)
+    c = zlib.compressobj()
+    first = c.compress(''.join(scanlines[:5])) + c.flush(zlib.Z_FULL_FLUSH)
+    rest = ''.join(scanlines[5:])
+    stored = ''.join([chr(i + 1 == len(rest)) + struct.pack('<HH', 1, 0xfffe) +
+                      byte for i, byte in enumerate(rest)])
+    adler = struct.pack('>L', zlib.adler32(''.join(scanlines)) & 0xffffffff)
+    return (pngforge.sig() + pngforge.ihdr(width=9, height=23) +
+            pngforge.restart_index([(5, len(first))]) +
+            pngforge.chunk('IDAT', first) +
+            pngforge.chunk('IDAT', stored + adler) +
+            pngforge.iend())
+
+def scaled_down(pixels, scale):
+    """Shrink |pixels|, rows of RGBA tuples, by |scale| each way, as
+    sfpng's scaled output should: image column x goes to output column
+    x * output width / image width, likewise for rows, and each output
+    pixel is the average of the pixels that go to it, with color weighted
+    by alpha, rounded to nearest with halves up.  Worked out in fractions
+    from which pixels go where, rather than from where boxes end, so as
+    not to share sfpng's arithmetic.  Returns the pixels in hex."""
+    height, width = len(pixels), len(pixels[0])
+    out_width = (width + scale - 1) // scale
+    out_height = (height + scale - 1) // scale
+    boxes = {}
+    for y in range(height):
+        for x in range(width):
+            box = (x * out_width // width, y * out_height // height)
+            boxes.setdefault(box, []).append(pixels[y][x])
+    def nearest(f):
+        return int(math.floor(f + Fraction(1, 2)))
+    out = []
+    for oy in range(out_height):
+        for ox in range(out_width):
+            box = boxes[(ox, oy)]
+            alpha = sum([p[3] for p in box])
+            if alpha == 0:
+                out.append((0, 0, 0, 0))
+                continue
+            out.append(tuple([nearest(Fraction(sum([p[c] * p[3]
+                                                    for p in box]), alpha))
+                              for c in range(3)] +
+                             [nearest(Fraction(alpha, len(box)))]))
+    return ''.join(['%02x%02x%02x%02x' % p for p in out])
+
+def png_valid_scaled_boxes():
+    """A 7x5 image, which neither 2 nor 3 divide, with the pixels it
+    should scale down to by each in text chunks for sfpng-dumper.  The
+    top right corner is transparent but white, and elsewhere every third
+    pixel is transparent but magenta, neither of which should show."""
+    pixels = []
+    for y in range(5):
+        row = []
+        for x in range(7):
+            if x >= 5 and y < 3:
+                row.append((255, 255, 255, 0))
+            elif (x + y) % 3 == 0:
+                row.append((255, 0, 255, 0))
+            else:
+                row.append(((x * 40 + y * 7) % 256, y * 50 + 3,
+                            x * y * 11 % 256, 40 + x * 30 + y * 5))
+        pixels.append(row)
+    return (pngforge.sig() + pngforge.ihdr(width=7, height=5, color_type=6) +
+            pngforge.text('sfpng scaled 2', scaled_down(pixels, 2)) +
+            pngforge.text('sfpng scaled 3', scaled_down(pixels, 3)) +
+            pngforge.idat(''.join([pngforge.scanline(0, ''.join(
+                [struct.pack('4B', *p) for p in row])) for row in pixels])) +
+            pngforge.iend())
+
+def png_valid_large_ztxt():
+    """A zTXt chunk that inflates to much more than it takes up."""
+    text = ''.join(['line %d of a long comment\n' % i for i in range(4000)])
+    return (pngforge.sig() + pngforge.ihdr(width=1, height=1) +
+            pngforge.ztxt('Comment', text) +
+            pngforge.idat(pngforge.scanline(0, '\1\2\3')) +
+            pngforge.iend())
+
 def png_valid_tiny():
     """Create a valid, though tiny, image."""
     return (pngforge.sig() + pngforge.ihdr(width=1, height=1) +
@@ -35,3 +35,61 @@ def idat(scanlines):
 
 def iend():
     return chunk('IEND')
+
+def restart_stream(scanlines, segment_rows, flush=zlib.Z_FULL_FLUSH):
+    """Compress |scanlines|, a list of rows, flushing the zlib stream with
+    |flush| every |segment_rows| rows.  Returns the flush points, as
+    (row, offset) pairs, and the compressed data of each segment."""
+    c = zlib.compressobj()
+    points = []
+    data = []
+    offset = 0
+    for i in range(0, len(scanlines), segment_rows):
+        if i > 0:
+            points.append((i, offset))
+        segment = c.compress(''.join(scanlines[i:i + segment_rows]))
+        if i + segment_rows < len(scanlines):
+            segment += c.flush(flush)
+        else:
+            segment += c.flush()
+        data.append(segment)
+        offset += len(segment)
+    return points, data
+
+def restart_index(points):
+    """An sfRS chunk listing |points|, (row, offset) pairs."""
+    return chunk('sfRS', ''.join([struct.pack('>LL', row, offset)
+                                  for row, offset in points]))
+
+def restart_idats(scanlines, segment_rows):
+    """Compress |scanlines|, a list of rows, restarting the zlib stream
+    with a full flush every |segment_rows| rows.  Returns an sfRS chunk
+    listing the restart points followed by an IDAT per segment."""
+    points, data = restart_stream(scanlines, segment_rows)
+    return restart_index(points) + ''.join([chunk('IDAT', d) for d in data])
+
+def adam7_passes(width, height):
+    """The width and height of each of the seven Adam7 passes, including
+    empty ones."""
+    passes = []
+    for x0, y0, dx, dy in [(0, 0, 8, 8), (4, 0, 8, 8), (0, 4, 4, 8),
+                           (2, 0, 4, 4), (0, 2, 2, 4), (1, 0, 2, 2),
+                           (0, 1, 1, 2)]:
+        passes.append(((width - x0 + dx - 1) // dx,
+                       (height - y0 + dy - 1) // dy))
+    return passes
+
+def split_idats(data, size):
+    """Compressed image data as IDAT chunks of at most |size| bytes."""
+    return ''.join([chunk('IDAT', data[i:i + size])
+                    for i in range(0, max(len(data), 1), size)])
+
+def text(key, value):
+    return chunk('tEXt', key + '\0' + value)
+
+def ztxt(key, value):
+    return chunk('zTXt', key + '\0\0' + zlib.compress(value))
+
+def itxt(key, value, language='', translated_key=''):
+    return chunk('iTXt', key + '\0\0\0' + language + '\0' +
+                 translated_key + '\0' + value)